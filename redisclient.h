@@ -32,15 +32,30 @@
 #define REDISCLIENT_H
 
 #include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <limits.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 #include <string>
 #include <vector>
 #include <map>
+#include <deque>
 #include <set>
 #include <stdexcept>
 #include <ctime>
 #include <sstream>
+#include <algorithm>
+#include <limits>
+#include <iterator>
 
 #include <boost/concept_check.hpp>
 #include <boost/lexical_cast.hpp>
@@ -48,15 +63,32 @@
 #include <boost/foreach.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/random.hpp>
 #include <boost/cstdint.hpp>
+#include <boost/static_assert.hpp>
 #include <boost/date_time/posix_time/ptime.hpp>
 #include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <boost/optional.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/variant.hpp>
+#include <boost/function.hpp>
+
+// The coroutine interface of the asynchronous client needs a C++20 compiler
+#if defined(__linux__) && defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#define REDIS_HAS_COROUTINES 1
+#include <coroutine>
+#include <exception>
+#endif
 
 #include "anet.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 #define REDIS_LBR                       "\r\n"
 #define REDIS_STATUS_REPLY_OK           "OK"
 #define REDIS_PREFIX_STATUS_REPLY_ERROR "-ERR "
@@ -66,6 +98,7 @@
 #define REDIS_PREFIX_MULTI_BULK_REPLY   '*'
 #define REDIS_PREFIX_INT_REPLY          ':'
 #define REDIS_WHITESPACE                " \f\n\r\t\v"
+#define REDIS_MISSING_VALUE             "**nonexistent-key**"
 
 template<class Object >
 struct make;
@@ -84,10 +117,113 @@ namespace redis
     multi_bulk_reply
   };
   
+  // Receive buffer that is kept per connection. All replies are parsed out of
+  // this buffer, so that a single recv() call can serve many (pipelined) replies.
+
+  class recv_buffer
+  {
+  public:
+    enum { chunk_size = 16 * 1024 };
+
+    recv_buffer()
+    : begin_(0), end_(0)
+    {
+    }
+
+    inline const char * data() const
+    {
+      return buffer_.empty() ? NULL : &buffer_[0] + begin_;
+    }
+
+    inline size_t size() const
+    {
+      return end_ - begin_;
+    }
+
+    inline bool empty() const
+    {
+      return begin_ == end_;
+    }
+
+    inline void consume(size_t n)
+    {
+      assert( n <= size() );
+      begin_ += n;
+      if( begin_ == end_ )
+        begin_ = end_ = 0;
+    }
+
+    // Returns a pointer to at least n bytes of free space behind the buffered data.
+    char * prepare(size_t n)
+    {
+      if( buffer_.size() - end_ < n )
+      {
+        if( begin_ > 0 )
+        {
+          memmove(&buffer_[0], &buffer_[0] + begin_, end_ - begin_);
+          end_ -= begin_;
+          begin_ = 0;
+        }
+        if( buffer_.size() - end_ < n )
+          buffer_.resize(end_ + n);
+      }
+      return &buffer_[0] + end_;
+    }
+
+    inline size_t free_space() const
+    {
+      return buffer_.size() - end_;
+    }
+
+    inline void commit(size_t n)
+    {
+      assert( n <= free_space() );
+      end_ += n;
+    }
+
+    void clear()
+    {
+      begin_ = end_ = 0;
+    }
+
+  private:
+    std::vector<char> buffer_;
+    size_t begin_;
+    size_t end_;
+  };
+
+  // State of a connection that is shared by several threads with auto pipelining. Requests are
+  // numbered in the order in which they are queued. When the replies of the last write were read,
+  // one caller sends all queued requests in one write, the callers then read their replies in the
+  // same order.
+  
+  struct request_queue
+  {
+    request_queue()
+    : next_ticket(0), sent(0), turn(0), writing(false), exclusive(false)
+    {
+    }
+    
+    boost::mutex mutex;
+    boost::condition_variable changed;
+    
+    std::string outbound;       // queued requests that were not written yet
+    unsigned long next_ticket;  // ticket of the next queued request
+    unsigned long sent;         // the requests with lower tickets were written
+    unsigned long turn;         // ticket of the request whose reply is read next
+    bool writing;
+    bool exclusive;             // a thread uses the connection directly
+    boost::thread::id owner;    // the thread that uses the connection directly
+    
+    // Wakes the callers of the tickets from turn on
+    std::deque<boost::condition_variable *> waiting;
+  };
+  
   struct connection_data
   {
     connection_data(const std::string & host = "localhost", uint16_t port = 6379, int dbindex = 0)
-     : host(host), port(port), dbindex(dbindex), socket(ANET_ERR)
+     : host(host), port(port), dbindex(dbindex), connect_timeout_ms(0), timeout_ms(0), socket(ANET_ERR),
+       broken(false), failures(0), replayed(0)
     {
     }
 
@@ -106,9 +242,26 @@ namespace redis
     std::string host;
     boost::uint16_t port;
     int dbindex;
+    
+    // Limits of connecting and of each wait for the socket to become readable or writable,
+    // in milliseconds. 0 waits as long as the operating system does.
+    int connect_timeout_ms;
+    int timeout_ms;
 
   private:
     int socket;
+    recv_buffer read_buffer;
+    boost::shared_ptr<request_queue> queue;
+    
+    // Reconnect state: the connection failed and is connected again on its next use, unless the
+    // backoff after failures consecutive failed attempts lasts until retry_at.
+    bool broken;
+    int failures;
+    boost::posix_time::ptime retry_at;
+    
+    // Idempotent request whose reply has not started to arrive yet and how often it was sent again
+    std::string replay;
+    int replayed;
 
     template<typename CONSISTENT_HASHER>
     friend class base_client;
@@ -178,6 +331,44 @@ namespace redis
     value_error(const std::string & err) : redis_error(err) {};
   };
 
+  // Parses the decimal integer in [begin, end) without allocating memory or depending on the
+  // locale. Throws protocol_error if the text is no integer or does not fit into INT_TYPE.
+  
+  template<typename INT_TYPE>
+  INT_TYPE parse_int(const char * begin, const char * end)
+  {
+    BOOST_STATIC_ASSERT( std::numeric_limits<INT_TYPE>::is_integer );
+    
+    bool negative = false;
+    if( begin != end && (*begin == '-' || *begin == '+') )
+      negative = *begin++ == '-';
+    
+    if( begin == end )
+      throw protocol_error("invalid integer; empty");
+    
+    if( negative && !std::numeric_limits<INT_TYPE>::is_signed )
+      throw protocol_error("invalid integer; negative value for unsigned type");
+    
+    boost::uintmax_t limit = static_cast<boost::uintmax_t>( std::numeric_limits<INT_TYPE>::max() );
+    if( negative )
+      limit += 1;
+    
+    boost::uintmax_t val = 0;
+    for( ; begin != end; ++begin )
+    {
+      unsigned int digit = static_cast<unsigned char>(*begin) - '0';
+      if( digit > 9 )
+        throw protocol_error("invalid integer; unexpected character");
+      if( val > (limit - digit) / 10 )
+        throw protocol_error("invalid integer; out of range");
+      val = val * 10 + digit;
+    }
+    
+    if( negative && val > 0 )
+      return static_cast<INT_TYPE>( -static_cast<boost::intmax_t>(val - 1) - 1 );
+    return static_cast<INT_TYPE>(val);
+  }
+  
   struct key
   {
     explicit key(const std::string & name)
@@ -188,95 +379,447 @@ namespace redis
     std::string name;
   };
   
+  // Non-owning view of a bulk value inside the receive buffer of a connection.
+  // A view is only valid while the visitor it was passed to is running.
+  
+  class value_view
+  {
+  public:
+    value_view(const char * data, size_t size)
+    : data_(data), size_(size)
+    {
+    }
+    
+    inline const char * data() const
+    {
+      return data_;
+    }
+    
+    inline size_t size() const
+    {
+      return size_;
+    }
+    
+    inline bool empty() const
+    {
+      return size_ == 0;
+    }
+    
+    inline const char * begin() const
+    {
+      return data_;
+    }
+    
+    inline const char * end() const
+    {
+      return data_ + size_;
+    }
+    
+    inline std::string str() const
+    {
+      return std::string(data_, size_);
+    }
+    
+    bool operator==(const std::string & other) const
+    {
+      return size_ == other.size() && memcmp(data_, other.data(), size_) == 0;
+    }
+    
+    bool operator!=(const std::string & other) const
+    {
+      return !(*this == other);
+    }
+    
+  private:
+    const char * data_;
+    size_t size_;
+  };
+  
+  // Reference to a caller owned argument of a command. Referenced arguments of at least
+  // makecmd::reference_threshold bytes are not copied into the command, but sent straight
+  // from the caller's memory with writev(). The data must therefore stay alive and unchanged
+  // until the command was sent.
+  
+  struct arg_ref
+  {
+    explicit arg_ref(const std::string & str)
+    : data(str.data()), size(str.size())
+    {
+    }
+    
+    arg_ref(const char * data, size_t size)
+    : data(data), size(size)
+    {
+    }
+    
+    const char * data;
+    size_t size;
+  };
+  
+  // The name and argument count of a command, serialized at compile time. Use REDIS_COMMAND_PREFIX
+  // to define one, so the constant part of a fixed arity command is not formatted on every call.
+  struct command_prefix
+  {
+    const char * data;
+    size_t size;
+    size_t argc;
+  };
+  
+  // Only defined for true, so a false condition does not compile
+  template<bool> struct prefix_check;
+  template<> struct prefix_check<true> { enum { value = 0 }; };
+  
+  // argc includes the command name, name_size is the length of name. Both are given as literals
+  // to build the prefix at compile time, a name_size that does not match name does not compile.
+  #define REDIS_COMMAND_PREFIX(argc, name_size, name) \
+    { "*" #argc "\r\n$" #name_size "\r\n" name "\r\n", sizeof("*" #argc "\r\n$" #name_size "\r\n" name "\r\n") - 1, \
+      argc + redis::prefix_check<(argc >= 1 && sizeof(name) - 1 == name_size)>::value }
+  
+  // Prefixes of the fixed arity commands on the hot path of base_client
+  namespace prefix
+  {
+    const command_prefix get       = REDIS_COMMAND_PREFIX(2, 3, "GET");
+    const command_prefix set       = REDIS_COMMAND_PREFIX(3, 3, "SET");
+    const command_prefix setnx     = REDIS_COMMAND_PREFIX(3, 5, "SETNX");
+    const command_prefix getset    = REDIS_COMMAND_PREFIX(3, 6, "GETSET");
+    const command_prefix append    = REDIS_COMMAND_PREFIX(3, 6, "APPEND");
+    const command_prefix exists    = REDIS_COMMAND_PREFIX(2, 6, "EXISTS");
+    const command_prefix del       = REDIS_COMMAND_PREFIX(2, 3, "DEL");
+    const command_prefix type      = REDIS_COMMAND_PREFIX(2, 4, "TYPE");
+    const command_prefix expire    = REDIS_COMMAND_PREFIX(3, 6, "EXPIRE");
+    const command_prefix ttl       = REDIS_COMMAND_PREFIX(2, 3, "TTL");
+    const command_prefix incr      = REDIS_COMMAND_PREFIX(2, 4, "INCR");
+    const command_prefix incrby    = REDIS_COMMAND_PREFIX(3, 6, "INCRBY");
+    const command_prefix decr      = REDIS_COMMAND_PREFIX(2, 4, "DECR");
+    const command_prefix decrby    = REDIS_COMMAND_PREFIX(3, 6, "DECRBY");
+    const command_prefix lpush     = REDIS_COMMAND_PREFIX(3, 5, "LPUSH");
+    const command_prefix rpush     = REDIS_COMMAND_PREFIX(3, 5, "RPUSH");
+    const command_prefix lpop      = REDIS_COMMAND_PREFIX(2, 4, "LPOP");
+    const command_prefix rpop      = REDIS_COMMAND_PREFIX(2, 4, "RPOP");
+    const command_prefix llen      = REDIS_COMMAND_PREFIX(2, 4, "LLEN");
+    const command_prefix lindex    = REDIS_COMMAND_PREFIX(3, 6, "LINDEX");
+    const command_prefix sadd      = REDIS_COMMAND_PREFIX(3, 4, "SADD");
+    const command_prefix srem      = REDIS_COMMAND_PREFIX(3, 4, "SREM");
+    const command_prefix sismember = REDIS_COMMAND_PREFIX(3, 9, "SISMEMBER");
+    const command_prefix scard     = REDIS_COMMAND_PREFIX(2, 5, "SCARD");
+    const command_prefix zadd      = REDIS_COMMAND_PREFIX(4, 4, "ZADD");
+    const command_prefix zrem      = REDIS_COMMAND_PREFIX(3, 4, "ZREM");
+    const command_prefix zincrby   = REDIS_COMMAND_PREFIX(4, 7, "ZINCRBY");
+    const command_prefix zscore    = REDIS_COMMAND_PREFIX(3, 6, "ZSCORE");
+    const command_prefix zcard     = REDIS_COMMAND_PREFIX(2, 5, "ZCARD");
+    const command_prefix hset      = REDIS_COMMAND_PREFIX(4, 4, "HSET");
+    const command_prefix hsetnx    = REDIS_COMMAND_PREFIX(4, 6, "HSETNX");
+    const command_prefix hget      = REDIS_COMMAND_PREFIX(3, 4, "HGET");
+    const command_prefix hdel      = REDIS_COMMAND_PREFIX(3, 4, "HDEL");
+    const command_prefix hexists   = REDIS_COMMAND_PREFIX(3, 7, "HEXISTS");
+    const command_prefix hincrby   = REDIS_COMMAND_PREFIX(4, 7, "HINCRBY");
+    const command_prefix hlen      = REDIS_COMMAND_PREFIX(2, 4, "HLEN");
+  }
+  
+  // Builds a command in the multi bulk format of the redis protocol. The arguments are
+  // serialized into one contiguous buffer while they are added. Space for the argument
+  // count is reserved in front of the buffer and filled in when the command is read,
+  // so building a command does not copy the arguments again. Integers and doubles are
+  // formatted without streams. A makecmd can be reused with reset(), which keeps the
+  // capacity of the buffer. Large arguments that are added as arg_ref are only referenced
+  // and end up as separate segments of the command (see to_iovec()). Fixed arity commands
+  // can start from a command_prefix, which already contains the argument count.
+  
   class makecmd
   {
   public:
+    enum { reference_threshold = 16 * 1024 };
+    
+
     explicit makecmd(const std::string & cmd_name)
     {
-      append(cmd_name);
-      //if (!finalize)
-      //  buffer_ << " ";
+      buffer_.reserve(initial_capacity);
+      reset(cmd_name);
     }
-
+    
+    // Starts the command with a precompiled prefix. Exactly prefix.argc - 1 arguments have to be added.
+    explicit makecmd(const command_prefix & prefix)
+    {
+      buffer_.reserve(initial_capacity);
+      buffer_.assign(prefix.data, prefix.size);
+      argc_ = 1;
+      fixed_argc_ = prefix.argc;
+      header_offset_ = 0;
+      has_key_ = false;
+      refs_size_ = 0;
+    }
+    
+    // Starts a new command, keeping the allocated buffer.
+    void reset(const std::string & cmd_name)
+    {
+      buffer_.assign(header_space, '\0');
+      argc_ = 0;
+      fixed_argc_ = 0;
+      header_offset_ = header_space;
+      key_name_.clear();
+      has_key_ = false;
+      refs_.clear();
+      refs_size_ = 0;
+      append(cmd_name.data(), cmd_name.size());
+    }
+    
     const std::string & key_name() const
     {
-      if(!key_name_)
+      if(!has_key_)
         throw std::runtime_error("No key defined!");
-      return *key_name_;
+      return key_name_;
     }
     
     inline makecmd & operator<<(const key & datum)
     {
-      if(key_name_)
+      if(has_key_)
         throw std::runtime_error("You could not add a second key");
-      else
-        key_name_ = datum.name;
-      append(datum.name);
+      append(datum.name.data(), datum.name.size());
+      has_key_ = true;
+      key_name_ = datum.name;
       return *this;
     }
     
     inline makecmd & operator<<(const std::string & datum)
     {
-      append(datum);
+      append(datum.data(), datum.size());
       return *this;
     }
     
-    template <typename T>
-    makecmd & operator<<(T const & datum)
+    inline makecmd & operator<<(const char * datum)
+    {
+      append(datum, strlen(datum));
+      return *this;
+    }
+    
+    makecmd & operator<<(const arg_ref & datum)
     {
-      append( boost::lexical_cast<std::string>(datum) );
+      if (datum.size < static_cast<size_t>(reference_threshold))
+      {
+        append(datum.data, datum.size);
+        return *this;
+      }
+      
+      append_header(datum.size);
+      refs_.push_back( segment(buffer_.size(), datum.data, datum.size) );
+      refs_size_ += datum.size;
+      buffer_.append(REDIS_LBR, 2);
+      count_argument();
       return *this;
     }
     
-    makecmd & operator<<(const std::vector<std::string> & data)
+    inline makecmd & operator<<(short datum)          { append_int(datum);  return *this; }
+    inline makecmd & operator<<(int datum)            { append_int(datum);  return *this; }
+    inline makecmd & operator<<(long datum)           { append_int(datum);  return *this; }
+    inline makecmd & operator<<(unsigned short datum) { append_uint(datum); return *this; }
+    inline makecmd & operator<<(unsigned int datum)   { append_uint(datum); return *this; }
+    inline makecmd & operator<<(unsigned long datum)  { append_uint(datum); return *this; }
+    inline makecmd & operator<<(float datum)          { append_double(datum, float_digits); return *this; }
+    inline makecmd & operator<<(double datum)         { append_double(datum, double_digits); return *this; }
+    
+    template <typename T>
+    makecmd & operator<<(T const & datum)
     {
-      lines_.insert( lines_.end(), data.begin(), data.end() );
+      const std::string str = boost::lexical_cast<std::string>(datum);
+      append(str.data(), str.size());
       return *this;
     }
     
     template <typename T>
     makecmd & operator<<(const std::vector<T> & data)
     {
-      size_t n = data.size();
-      for (size_t i = 0; i < n; ++i)
+      for (size_t i = 0; i < data.size(); ++i)
+        *this << data[i];
+      return *this;
+    }
+    
+    // True if the command has no referenced arguments, so data() holds the whole command.
+    inline bool contiguous() const
+    {
+      return refs_.empty();
+    }
+    
+    // The serialized command if it is contiguous(). The pointer is valid until the command is modified.
+    const char * data() const
+    {
+      assert( contiguous() );
+      return buffer_.data() + header_offset();
+    }
+    
+    // The size of the serialized command, including referenced arguments.
+    size_t size() const
+    {
+      return buffer_.size() - header_offset() + refs_size_;
+    }
+    
+    // Appends the segments of the serialized command to out.
+    void to_iovec(std::vector<struct iovec> & out) const
+    {
+      size_t pos = header_offset();
+      for (size_t i = 0; i < refs_.size(); ++i)
       {
-        append( boost::lexical_cast<std::string>( data[i] ) );
-        //if (i < n - 1)
-        //  buffer_ << " ";
+        add_iovec(out, buffer_.data() + pos, refs_[i].pos - pos);
+        add_iovec(out, refs_[i].data, refs_[i].size);
+        pos = refs_[i].pos;
       }
-      return *this;
+      add_iovec(out, buffer_.data() + pos, buffer_.size() - pos);
     }
     
     operator std::string () const
     {
-      std::ostringstream oss;
-      size_t n = lines_.size();
-      oss << REDIS_PREFIX_MULTI_BULK_REPLY << n << REDIS_LBR;
+      std::string res;
+      res.reserve( size() );
       
-      for (size_t i = 0; i < n; ++i)
+      size_t pos = header_offset();
+      for (size_t i = 0; i < refs_.size(); ++i)
       {
-        const std::string & param = lines_[i];
-        oss << REDIS_PREFIX_SINGLE_BULK_REPLY << param.size() << REDIS_LBR;
-        oss << param << REDIS_LBR;
+        res.append(buffer_, pos, refs_[i].pos - pos);
+        res.append(refs_[i].data, refs_[i].size);
+        pos = refs_[i].pos;
       }
-      
-      return oss.str();
+      res.append(buffer_, pos, std::string::npos);
+      return res;
     }
     
   private:
-    void append(const std::string & param)
+    // A referenced argument that belongs in front of buffer_[pos]
+    struct segment
+    {
+      segment(size_t pos, const char * data, size_t size)
+      : pos(pos), data(data), size(size)
+      {
+      }
+      
+      size_t pos;
+      const char * data;
+      size_t size;
+    };
+    
+    static void add_iovec(std::vector<struct iovec> & out, const char * data, size_t size)
+    {
+      struct iovec iov;
+      iov.iov_base = const_cast<char *>(data);
+      iov.iov_len = size;
+      out.push_back(iov);
+    }
+    
+    // Where the command starts in buffer_. The const accessors only read, so a finished command
+    // can be sent from several threads at once.
+    size_t header_offset() const
+    {
+      // With a prefix the argument count is part of it, so it must be right in release builds too
+      if (fixed_argc_ != 0 && argc_ != fixed_argc_)
+        throw std::runtime_error("Wrong number of arguments for the command prefix!");
+      return header_offset_;
+    }
+    
+    // Counts an added argument and updates the argument count in front of the arguments.
+    void count_argument()
+    {
+      ++argc_;
+      if (fixed_argc_ != 0)
+        return;
+      
+      char header[header_space];
+      char * end = header + header_space;
+      char * p = end;
+      *--p = '\n';
+      *--p = '\r';
+      p = format_uint(p, argc_);
+      *--p = REDIS_PREFIX_MULTI_BULK_REPLY;
+      
+      size_t header_size = end - p;
+      header_offset_ = header_space - header_size;
+      memcpy(&buffer_[header_offset_], p, header_size);
+    }
+    
+    enum
+    {
+      header_space = 24,        // '*', up to 20 digits and CRLF
+      initial_capacity = 256
+    };
+    
+    // Writes the digits of val in front of end and returns the start of the digits.
+    static char * format_uint(char * end, boost::uintmax_t val)
+    {
+      do
+      {
+        *--end = static_cast<char>('0' + val % 10);
+        val /= 10;
+      }
+      while (val > 0);
+      return end;
+    }
+    
+    void append_header(size_t size)
+    {
+      char header[header_space];
+      char * end = header + header_space;
+      char * p = end;
+      *--p = '\n';
+      *--p = '\r';
+      p = format_uint(p, size);
+      *--p = REDIS_PREFIX_SINGLE_BULK_REPLY;
+      
+      buffer_.append(p, end - p);
+    }
+    
+    void append(const char * param, size_t size)
+    {
+      append_header(size);
+      buffer_.append(param, size);
+      buffer_.append(REDIS_LBR, 2);
+      count_argument();
+    }
+    
+    void append_int(boost::intmax_t val)
+    {
+      char buf[header_space];
+      char * end = buf + header_space;
+      char * p = format_uint(end, val < 0 ? 0 - static_cast<boost::uintmax_t>(val) : static_cast<boost::uintmax_t>(val));
+      if (val < 0)
+        *--p = '-';
+      append(p, end - p);
+    }
+    
+    void append_uint(boost::uintmax_t val)
+    {
+      char buf[header_space];
+      char * end = buf + header_space;
+      char * p = format_uint(end, val);
+      append(p, end - p);
+    }
+    
+    // Significant digits that boost::lexical_cast writes, so the output stays the same and
+    // values survive the round trip
+    enum
+    {
+      float_digits = 9,
+      double_digits = 17
+    };
+    
+    void append_double(double val, int digits)
     {
-      lines_.push_back(param);
+      char buf[32];
+      int size = snprintf(buf, sizeof(buf), "%.*g", digits, val);
+      append(buf, size);
     }
     
-    std::vector<std::string> lines_;
-    boost::optional<std::string> key_name_;
+    std::string buffer_;
+    size_t argc_;
+    size_t fixed_argc_;
+    size_t header_offset_;
+    std::string key_name_;
+    bool has_key_;
+    std::vector<segment> refs_;
+    size_t refs_size_;
   };
 
   template<typename CONSISTENT_HASHER>
   class base_client;
 
-  typedef boost::variant< std::string, int, std::vector<std::string> > reply_val_t;
+  // Integer replies are 64 bit wide (long like base_client::int_type)
+  typedef boost::variant< std::string, long, std::vector<std::string> > reply_val_t;
   typedef std::pair<reply_t, reply_val_t> reply_data_t;
   
   class command
@@ -292,11 +835,6 @@ namespace redis
         throw std::runtime_error("invalid reply type");
     }
 
-    void set_reply(const reply_data_t & reply)
-    {
-      reply_ = reply;
-    }
-
     template<typename CONSISTENT_HASHER>
     friend class base_client;
     
@@ -324,10 +862,10 @@ namespace redis
       return boost::get<std::string>(reply_.second);
     }
     
-    int get_int_reply() const
+    long get_int_reply() const
     {
       check_reply_t(int_reply);
-      return boost::get<int>(reply_.second);
+      return boost::get<long>(reply_.second);
     }
     
     const std::string & get_bulk_reply() const
@@ -343,2252 +881,6326 @@ namespace redis
     }
   };
 
-  struct server_info 
-  {
-    std::string version;
-    bool bgsave_in_progress;
-    unsigned long connected_clients;
-    unsigned long connected_slaves;
-    unsigned long used_memory;
-    unsigned long changes_since_last_save;
-    unsigned long last_save_time;
-    unsigned long total_connections_received;
-    unsigned long total_commands_processed;
-    unsigned long uptime_in_seconds;
-    unsigned long uptime_in_days;
-    server_role role;
-    unsigned short arch_bits;
-    std::string multiplexing_api;
-    std::map<std::string, std::string> param_map;
-  };
+  // Completion state of a command that was queued in a pipeline. An error reply of the command
+  // is stored together with the exception type to raise it as.
   
-  inline ssize_t recv_or_throw(int fd, void* buf, size_t n, int flags)
+  struct deferred_status
   {
-    ssize_t bytes_received;
+    deferred_status()
+    : ready(false), raise(NULL)
+    {
+    }
     
-    do
-      bytes_received = ::recv(fd, buf, n, flags);
-    while(bytes_received < static_cast<ssize_t>(0) && errno == EINTR);
+    template<typename ERROR_TYPE>
+    void fail(const std::string & msg)
+    {
+      ready = true;
+      error = msg;
+      raise = &raise_as<ERROR_TYPE>;
+    }
     
-    if( bytes_received == static_cast<ssize_t>(0) )
-      throw connection_error("connection was closed");
+    void check() const
+    {
+      if (!ready)
+        throw std::runtime_error("the pipeline was not executed yet");
+      if (raise)
+        raise(error);
+    }
     
-    // Handle receive errors. I overlooked it totally, thanks mkx!
-    if( bytes_received == static_cast<ssize_t>(-1) )
-      throw connection_error(std::string("recv error: ") + strerror(errno));
-      
-    return bytes_received;
-  }
+    bool ready;
+    std::string error;
+    void (*raise)(const std::string &);
+    
+  private:
+    template<typename ERROR_TYPE>
+    static void raise_as(const std::string & msg)
+    {
+      throw ERROR_TYPE(msg);
+    }
+  };
   
-  // You should construct a 'client' object per connection to a redis-server.
-  //
-  // Please read the online redis command reference:
-  // http://code.google.com/p/redis/wiki/CommandReference
-  //
-  // No provisions for customizing the allocator on the string/bulk value type
-  // (std::string) are provided.  If needed, you can always change the
-  // string_type typedef in your local version.
-
-  template<typename CONSISTENT_HASHER>
-  class base_client
+  template<typename T>
+  struct deferred_state : deferred_status
+  {
+    T value;
+  };
+  
+  template<>
+  struct deferred_state<void> : deferred_status
+  {
+  };
+  
+  /**
+   * Typed result of a command that was queued in a base_client::pipeline. The value is available
+   * after the pipeline was executed. Copies share the result.
+   */
+  template<typename T>
+  class deferred
   {
-  private:
-    void init(connection_data & con)
-    {
-      char err[ANET_ERR_LEN];
-      con.socket = anetTcpConnect(err, const_cast<char*>(con.host.c_str()), con.port);
-      if (con.socket == ANET_ERR)
-      {
-        std::ostringstream os;
-        os << err << " (redis://" << con.host << ':' << con.port << ")";
-        throw connection_error( os.str() );
-      }
-      anetTcpNoDelay(NULL, con.socket);
-      select(con.dbindex, con);
-    }
-    
   public:
-    typedef std::string string_type;
-    typedef std::vector<string_type> string_vector;
-    typedef std::pair<string_type, string_type> string_pair;
-    typedef std::vector<string_pair> string_pair_vector;
-    typedef std::pair<string_type, double> string_score_pair;
-    typedef std::vector<string_score_pair> string_score_vector;
-    typedef std::set<string_type> string_set;
-
-    typedef long int_type;
-
-    explicit base_client(const string_type & host = "localhost",
-                    uint16_t port = 6379, int_type dbindex = 0)
+    deferred()
     {
-      connection_data con;
-      con.host = host;
-      con.port = port;
-      con.dbindex = dbindex;
-      init(con);
-      connections_.push_back(con);
     }
-
-    template<typename CON_ITERATOR>
-    base_client(CON_ITERATOR begin, CON_ITERATOR end)
+    
+    explicit deferred(const boost::shared_ptr< deferred_state<T> > & state)
+    : state_(state)
     {
-      while(begin != end)
-      {
-        connection_data con = *begin;
-        init(con);
-        connections_.push_back(con);
-        begin++;
-      }
-
-      if( connections_.empty() )
-        throw std::runtime_error("No connections given!");
     }
-
-    base_client<CONSISTENT_HASHER>* clone() const
+    
+    // True if the pipeline was executed, whether the command succeeded or not
+    bool ready() const
     {
-      return new base_client<CONSISTENT_HASHER>(connections_.begin(), connections_.end());
+      return state_ && state_->ready;
     }
-
-    inline static string_type missing_value()
+    
+    // Returns the result or throws the error the command failed with.
+    const T & get() const
     {
-      return "**nonexistent-key**";
+      if (!state_)
+        throw std::runtime_error("deferred result is not bound to a pipeline");
+      state_->check();
+      return state_->value;
     }
-
-    enum datatype 
-    {
-      datatype_none,      // key doesn't exist
-      datatype_string,
-      datatype_list,
-      datatype_set,
-      datatype_zset,
-      datatype_hash,
-      datatype_unknown
-    };
-
-    int_type get_list(const string_type & key, string_vector & out)
+    
+  private:
+    boost::shared_ptr< deferred_state<T> > state_;
+  };
+  
+  template<>
+  class deferred<void>
+  {
+  public:
+    deferred()
     {
-      return lrange(key, 0, -1, out);
-    }
-
-    void lrem_exact(const string_type & key,
-                    int_type count,
-                    const string_type & value)
-    { 
-      if (lrem(key, count, value) != count)
-        throw value_error("failed to remove exactly N elements from list");
     }
-    enum range_specifier
-    {
-      exclude_min = 1 << 0,
-      exclude_max = 1 << 1
-    };
-
-    enum aggregate_type
-    {
-      aggregate_sum = 1 << 0,
-      aggregate_min = 1 << 1,
-      aggregate_max = 1 << 2
-    };
-
-    enum sort_order
-    {
-      sort_order_ascending,
-      sort_order_descending
-    };
     
-    ~base_client()
+    explicit deferred(const boost::shared_ptr< deferred_state<void> > & state)
+    : state_(state)
     {
-      BOOST_FOREACH(connection_data & con, connections_)
-      {
-        if (con.socket != ANET_ERR)
-          close(con.socket);
-      }
     }
-
-    const std::vector<connection_data> & connections() const
+    
+    bool ready() const
     {
-      return connections_;
+      return state_ && state_->ready;
     }
     
-    void auth(const string_type & pass)
+    // Throws the error the command failed with.
+    void get() const
     {
-      if( connections_.size() > 1 )
-        throw std::runtime_error("feature is not available in cluster mode");
-
-      int socket = connections_[0].socket;
-      send_(socket, makecmd("AUTH") << pass);
-      recv_ok_reply_(socket);
+      if (!state_)
+        throw std::runtime_error("deferred result is not bound to a pipeline");
+      state_->check();
     }
     
-    void set(const string_type & key,
-                          const string_type & value)
+  private:
+    boost::shared_ptr< deferred_state<void> > state_;
+  };
+  
+  // Resumable parser for the redis reply protocol that is independent of any socket.
+  // It is fed with arbitrary chunks of bytes and collects the complete replies, no matter
+  // at which byte boundaries the data was split. Nil bulk replies are reported like
+  // base_client::get() does (REDIS_MISSING_VALUE), nil multi bulk replies as empty vectors.
+  // After a protocol_error was thrown the parser has to be reset().
+  
+  class reply_parser
+  {
+  public:
+    reply_parser()
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("SET") << key << value);
-      recv_ok_reply_(socket);
+      reset();
     }
     
-    void mset( const string_vector & keys, const string_vector & values )
+    void reset()
     {
-      assert( keys.size() == values.size() );
-
-      std::map< int, boost::optional<makecmd> > socket_commands;
-
-      for(size_t i=0; i < keys.size(); i++)
-      {
-        int socket = get_socket(keys);
-        boost::optional<makecmd> & cmd = socket_commands[socket];
-        if(!cmd)
-          cmd = makecmd("MSET");
-        *cmd << keys[i] << values[i];
-      }
-
-      typedef std::pair< int, boost::optional<makecmd> > sock_pair;
-      BOOST_FOREACH(const sock_pair & sp, socket_commands)
-      {
-        send_(sp.first, *sp.second);
-      }
-      
-      BOOST_FOREACH(const sock_pair & sp, socket_commands)
-      {
-        recv_ok_reply_(sp.first);
-      }
+      state_ = state_line;
+      line_.clear();
+      bulk_.clear();
+      bulk_left_ = 0;
+      in_multi_bulk_ = false;
+      elements_left_ = 0;
+      elements_.clear();
+      replies_.clear();
     }
     
-    void mset( const string_pair_vector & key_value_pairs )
+    // Parses the given chunk. Complete replies can be fetched with next_reply().
+    
+    void feed(const char * data, size_t size)
     {
-      std::map< int, boost::optional<makecmd> > socket_commands;
+      const char * p = data;
+      const char * end = data + size;
       
-      for(size_t i=0; i < key_value_pairs.size(); i++)
+      while (p < end)
       {
-        const string_type & key = key_value_pairs[i].first;
-        const string_type & value = key_value_pairs[i].second;
+        if (state_ == state_bulk)
+        {
+          size_t n = std::min(static_cast<size_t>(end - p), bulk_left_);
+          bulk_.append(p, n);
+          p += n;
+          bulk_left_ -= n;
+          
+          if (bulk_left_ == 0)
+          {
+            if (bulk_.size() < 2 || bulk_.compare(bulk_.size() - 2, 2, REDIS_LBR) != 0)
+              throw protocol_error("invalid bulk reply data; data of unexpected length");
+            
+            bulk_.erase(bulk_.size() - 2);
+            state_ = state_line;
+            take_value(bulk_reply, bulk_);
+          }
+          continue;
+        }
         
-        int socket = get_socket(key);
-        boost::optional<makecmd> & cmd = socket_commands[socket];
-        if(!cmd)
-          cmd = makecmd("MSET");
-        *cmd << key << value;
-      }
-      
-      typedef std::pair< int, boost::optional<makecmd> > sock_pair;
-      BOOST_FOREACH(const sock_pair & sp, socket_commands)
-      {
-        send_(sp.first, *sp.second);
-      }
-
-      BOOST_FOREACH(const sock_pair & sp, socket_commands)
-      {
-        recv_ok_reply_(sp.first);
+        const char * eol = static_cast<const char *>(memchr(p, '\n', end - p));
+        if (!eol)
+        {
+          line_.append(p, end - p);
+          break;
+        }
+        
+        line_.append(p, eol - p);
+        p = eol + 1;
+        if (!line_.empty() && line_[line_.size() - 1] == '\r')
+          line_.erase(line_.size() - 1);
+        
+        parse_line();
+        line_.clear();
       }
     }
-
-  private:
-    struct msetex_data
+    
+    inline void feed(const std::string & data)
     {
-      boost::optional<makecmd> mset_cmd;
-      std::string expire_cmds;
-      size_t count;
-    };
-
-  public:
-    void msetex( const string_pair_vector & key_value_pairs, int_type seconds )
+      feed(data.data(), data.size());
+    }
+    
+    // Moves the next complete reply to out. Returns false if there is none (yet).
+    
+    bool next_reply(reply_data_t & out)
     {
-      std::map< int, msetex_data > socket_commands;
-      
-      for(size_t i=0; i < key_value_pairs.size(); i++)
-      {
-        const string_type & key = key_value_pairs[i].first;
-        const string_type & value = key_value_pairs[i].second;
-        
-        int socket = get_socket(key);
-        msetex_data & dat = socket_commands[socket];
-        boost::optional<makecmd> & cmd = dat.mset_cmd;
-        if(!cmd)
-        {
-          cmd = makecmd("MSET");
-          dat.count = 0;
-        }
-        *cmd << key << value;
-
-        std::string & expire_cmds = dat.expire_cmds;
-        expire_cmds += makecmd("EXPIRE") << key << seconds;
-        dat.count++;
-      }
-      
-      typedef std::pair< int, msetex_data > sock_pair;
-      BOOST_FOREACH(const sock_pair & sp, socket_commands)
-      {
-        std::string cmds = *sp.second.mset_cmd;
-        cmds += sp.second.expire_cmds;
-        send_(sp.first, cmds);
-      }
+      if (replies_.empty())
+        return false;
       
-      BOOST_FOREACH(const sock_pair & sp, socket_commands)
-      {
-        recv_ok_reply_(sp.first);
-        for(size_t i= 0; i < sp.second.count; i++)
-          recv_int_ok_reply_(sp.first);
-        
-      }
+      out.first = replies_.front().first;
+      out.second.swap( replies_.front().second );
+      replies_.pop_front();
+      return true;
     }
     
-    string_type get(const string_type & key)
+    inline size_t replies_available() const
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("GET") << key);
-      return recv_bulk_reply_(socket);
+      return replies_.size();
     }
     
-    string_type getset(const string_type & key, const string_type & value)
+    // True if a reply has been started, but not yet completed.
+    
+    inline bool in_progress() const
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("GETSET") << key << value);
-      return recv_bulk_reply_(socket);
+      return state_ != state_line || !line_.empty() || in_multi_bulk_;
     }
-
+    
   private:
-    struct connection_keys
+    enum state_t
     {
-      boost::optional<makecmd> cmd;
-
-      /// Gives the position of the value in the original array
-      std::vector<size_t> indices;
+      state_line,
+      state_bulk
     };
-
-  public:
-    void exec(command & cmd)
-    {
-      int socket = get_socket(cmd.hash_key_);
-      send_( socket, cmd.request_ );
-      cmd.set_reply( recv_generic_reply_(socket) );
-    }
-
-    void exec(std::vector<command> & commands)
+    
+    static long parse_length(const std::string & line)
     {
-      std::map< int, std::string > socket_commands;
-      
-      for(size_t i=0; i < commands.size(); i++)
-      {
-        int socket = get_socket( commands[i].hash_key_ );
-        socket_commands[socket] += commands[i].request_;
-      }
-      
-      typedef std::pair< int, std::string > sock_pair;
-      BOOST_FOREACH(const sock_pair & sp, socket_commands)
-      {
-        send_(sp.first, sp.second);
-      }
-      
-      for(size_t i=0; i < commands.size(); i++)
-      {
-        int socket = get_socket( commands[i].hash_key_ );
-        commands[i].set_reply( recv_generic_reply_(socket) );
-      }
+      return parse_int<long>( line.data() + 1, line.data() + line.size() );
     }
     
-    void exec_transaction(std::vector<command> & commands)
+    void parse_line()
     {
-      int cmd_socket = -1;
-      std::string cmd_str = makecmd("MULTI");
+      if (line_.empty())
+        throw protocol_error("empty reply line");
       
-      for(size_t i=0; i < commands.size(); i++)
+      switch (line_[0])
       {
-        int socket = get_socket( commands[i].hash_key_ );
-        if( cmd_socket == -1 )
-          cmd_socket = socket;
-        else if( cmd_socket != socket )
-          throw std::runtime_error("calls in transaction map to different server!");
-           
-        cmd_str += commands[i].request_;
-      }
-
-      cmd_str += makecmd("EXEC");
-      
-      send_(cmd_socket, cmd_str);
-      recv_ok_reply_(cmd_socket); // MULTI => +OK
-      for(size_t i=0; i < commands.size(); i++)
+        case REDIS_PREFIX_STATUS_REPLY_VALUE:
+          add_value(status_code_reply, line_.substr(1));
+          break;
+        case REDIS_PREFIX_STATUS_REPLY_ERR_C:
+          if (line_.find(REDIS_PREFIX_STATUS_REPLY_ERROR) == 0)
+            add_value(error_reply, line_.substr( strlen(REDIS_PREFIX_STATUS_REPLY_ERROR) ));
+          else
+            add_value(error_reply, line_.substr(1));
+          break;
+        case REDIS_PREFIX_INT_REPLY:
+          add_value(int_reply, line_.substr(1));
+          break;
+        case REDIS_PREFIX_SINGLE_BULK_REPLY:
+        {
+          long length = parse_length(line_);
+          if (length < 0)
+          {
+            add_value(bulk_reply, REDIS_MISSING_VALUE);
+            break;
+          }
+          bulk_.clear();
+          bulk_.reserve(length + 2);
+          bulk_left_ = length + 2;
+          state_ = state_bulk;
+          break;
+        }
+        case REDIS_PREFIX_MULTI_BULK_REPLY:
+        {
+          if (in_multi_bulk_)
+            throw protocol_error("nested multi bulk replies are not supported");
+          
+          long length = parse_length(line_);
+          if (length <= 0)
+          {
+            replies_.push_back( reply_data_t(multi_bulk_reply, std::vector<std::string>()) );
+            break;
+          }
+          in_multi_bulk_ = true;
+          elements_left_ = length;
+          elements_.clear();
+          break;
+        }
+        default:
+          throw protocol_error("invalid/unknown reply type from redis server");
+      }
+    }
+    
+    // Adds a complete value either to the current multi bulk reply or as a reply of its own.
+    
+    void add_value(reply_t type, const std::string & value)
+    {
+      std::string copy(value);
+      take_value(type, copy);
+    }
+    
+    // Like add_value(), but swaps the value out of its argument instead of copying it.
+    
+    void take_value(reply_t type, std::string & value)
+    {
+      if (in_multi_bulk_)
       {
-        std::string resp = recv_single_line_reply_(cmd_socket);
-        if( resp != "QUEUED" )
-          throw std::runtime_error("invalid state (expected 'QUEUED' in transaction but got '" + resp + "')");
+        elements_.push_back(std::string());
+        elements_.back().swap(value);
+        if (--elements_left_ == 0)
+        {
+          in_multi_bulk_ = false;
+          replies_.push_back( reply_data_t(multi_bulk_reply, std::vector<std::string>()) );
+          boost::get< std::vector<std::string> >(replies_.back().second).swap(elements_);
+        }
+        return;
       }
-      if( read_line(cmd_socket)[0] != REDIS_PREFIX_MULTI_BULK_REPLY )
-        throw std::runtime_error("EXEC does not return a multi bulk reply");
-        
-      for(size_t i=0; i < commands.size(); i++)
+      
+      if (type == int_reply)
       {
-        commands[i].set_reply( recv_generic_reply_(cmd_socket) );
+        replies_.push_back( reply_data_t(int_reply, parse_length(line_)) );
+        return;
       }
+      
+      replies_.push_back( reply_data_t(type, std::string()) );
+      boost::get<std::string>(replies_.back().second).swap(value);
+    }
+    
+    state_t state_;
+    std::string line_;
+    std::string bulk_;
+    size_t bulk_left_;
+    bool in_multi_bulk_;
+    long elements_left_;
+    std::vector<std::string> elements_;
+    std::deque<reply_data_t> replies_;
+  };
+  
+  struct server_info 
+  {
+    std::string version;
+    bool bgsave_in_progress;
+    unsigned long connected_clients;
+    unsigned long connected_slaves;
+    unsigned long used_memory;
+    unsigned long changes_since_last_save;
+    unsigned long last_save_time;
+    unsigned long total_connections_received;
+    unsigned long total_commands_processed;
+    unsigned long uptime_in_seconds;
+    unsigned long uptime_in_days;
+    server_role role;
+    unsigned short arch_bits;
+    std::string multiplexing_api;
+    std::map<std::string, std::string> param_map;
+  };
+  
+  // Skips the first n bytes of the segments after a partial write.
+  
+  inline void advance_iovec(struct iovec *& iov, size_t & iovcnt, size_t n)
+  {
+    while (iovcnt > 0 && n >= iov->iov_len)
+    {
+      n -= iov->iov_len;
+      ++iov;
+      --iovcnt;
     }
     
-    void mget(const string_vector & keys, string_vector & out)
+    if (iovcnt > 0)
     {
-      out = string_vector( keys.size() );
-      std::map< int, connection_keys > socket_commands;
+      iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+  
+  // Writing to a connection that was closed by the server fails with EPIPE instead of raising SIGPIPE
+#ifdef MSG_NOSIGNAL
+# define REDIS_SEND_FLAGS MSG_NOSIGNAL
+#else
+# define REDIS_SEND_FLAGS 0
+#endif
+  
+  inline ssize_t recv_or_throw(int fd, void* buf, size_t n, int flags)
+  {
+    ssize_t bytes_received;
+    
+    do
+      bytes_received = ::recv(fd, buf, n, flags);
+    while(bytes_received < static_cast<ssize_t>(0) && errno == EINTR);
+    
+    if( bytes_received == static_cast<ssize_t>(0) )
+      throw connection_error("connection was closed");
+    
+    // Handle receive errors. I overlooked it totally, thanks mkx!
+    if( bytes_received == static_cast<ssize_t>(-1) )
+      throw connection_error(std::string("recv error: ") + strerror(errno));
       
-      for(size_t i=0; i < keys.size(); i++)
+    return bytes_received;
+  }
+  
+  // You should construct a 'client' object per connection to a redis-server.
+  //
+  // Please read the online redis command reference:
+  // http://code.google.com/p/redis/wiki/CommandReference
+  //
+  // No provisions for customizing the allocator on the string/bulk value type
+  // (std::string) are provided.  If needed, you can always change the
+  // string_type typedef in your local version.
+
+  template<typename CONSISTENT_HASHER>
+  class base_client
+  {
+  private:
+    // Connects to all servers at once and selects their databases with one round trip, so the
+    // time to set up a client does not grow with the number of servers.
+    void init()
+    {
+      BOOST_FOREACH(connection_data & con, connections_)
       {
-        int socket = get_socket(keys[i]);
-        connection_keys & con_keys = socket_commands[socket];
-        boost::optional<makecmd> & cmd = con_keys.cmd;
-        if(!cmd)
-          cmd = makecmd("MGET");
-        *cmd << keys[i];
-        con_keys.indices.push_back(i);
+        con.socket = ANET_ERR;
       }
       
-      typedef std::pair< int, connection_keys > sock_pair;
-      BOOST_FOREACH(const sock_pair & sp, socket_commands)
+      try
       {
-        send_(sp.first, *sp.second.cmd);
+        if (connect_mode_ == connect_lazily)
+        {
+          BOOST_FOREACH(connection_data & con, connections_)
+          {
+            // An unconnected socket reserves the descriptor. It is connected like a failed
+            // connection when it is used first.
+            con.socket = ::socket(AF_INET, SOCK_STREAM, 0);
+            if (con.socket == -1)
+            {
+              con.socket = ANET_ERR;
+              throw connection_error(std::string("socket: ") + strerror(errno));
+            }
+            con.read_buffer.clear();
+            con.queue.reset();
+            con.broken = true;
+            con.failures = 0;
+            con.retry_at = boost::posix_time::not_a_date_time;
+          }
+          return;
+        }
+        
+        char err[ANET_ERR_LEN];
+        std::vector<struct pollfd> fds( connections_.size() );
+        for (size_t i = 0; i < connections_.size(); ++i)
+        {
+          connection_data & con = connections_[i];
+          con.socket = anetTcpNonBlockConnect(err, const_cast<char*>(con.host.c_str()), con.port);
+          if (con.socket == ANET_ERR)
+            throw connection_error( std::string(err) + " (" + address_(con) + ")" );
+          
+          fds[i].fd = con.socket;
+          fds[i].events = POLLOUT;
+          fds[i].revents = 0;
+        }
+        
+        boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+        size_t pending = fds.size();
+        while (pending > 0)
+        {
+          // Wait until the earliest connect timeout of the pending connections
+          boost::int64_t elapsed = (boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds();
+          int ms = -1;
+          for (size_t i = 0; i < fds.size(); ++i)
+          {
+            int limit = connections_[i].connect_timeout_ms;
+            if (fds[i].fd < 0 || limit <= 0)
+              continue;
+            int left = static_cast<int>( std::max<boost::int64_t>(limit - elapsed, 0) );
+            if (ms == -1 || left < ms)
+              ms = left;
+          }
+          
+          int count;
+          do
+            count = ::poll(&fds[0], fds.size(), ms);
+          while (count == -1 && errno == EINTR);
+          
+          if (count == -1)
+            throw connection_error(std::string("poll error: ") + strerror(errno));
+          
+          elapsed = (boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds();
+          for (size_t i = 0; i < fds.size(); ++i)
+          {
+            const connection_data & con = connections_[i];
+            if (fds[i].fd < 0)
+              continue;
+            
+            if (fds[i].revents != 0)
+            {
+              if (!finish_connect_(con.socket, err))
+                throw connection_error( std::string(err) + " (" + address_(con) + ")" );
+              fds[i].fd = -1;
+              --pending;
+            }
+            else if (con.connect_timeout_ms > 0 && elapsed >= con.connect_timeout_ms)
+              throw timeout_error("connect timeout (" + address_(con) + ")");
+          }
+        }
+        
+        BOOST_FOREACH(connection_data & con, connections_)
+        {
+          con.read_buffer.clear();
+          con.queue.reset();
+          con.broken = false;
+          con.failures = 0;
+          con.retry_at = boost::posix_time::not_a_date_time;
+          anetTcpNoDelay(NULL, con.socket);
+          send_(con.socket, makecmd("SELECT") << con.dbindex);
+        }
+        
+        std::vector<int> waiting = all_sockets_();
+        while (!waiting.empty())
+          recv_ok_reply_( next_ready_(waiting) );
       }
-      
-      BOOST_FOREACH(const sock_pair & sp, socket_commands)
+      catch (...)
       {
-        const connection_keys & con_keys = sp.second;
-        string_vector cur_out;
-        recv_multi_bulk_reply_(sp.first, cur_out);
-        
-        for(size_t i=0; i < cur_out.size(); i++)
-          out[con_keys.indices[i]] = cur_out[i];
+        // The destructor does not run when the constructor fails
+        BOOST_FOREACH(connection_data & con, connections_)
+        {
+          if (con.socket != ANET_ERR)
+            close(con.socket);
+          con.socket = ANET_ERR;
+        }
+        throw;
       }
     }
     
-    bool setnx(const string_type & key,
-                            const string_type & value)
+    static std::string address_(const connection_data & con)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("SETNX") << key << value);
-      return recv_int_reply_(socket) == 1;
+      std::ostringstream os;
+      os << "redis://" << con.host << ':' << con.port;
+      return os.str();
     }
     
-    bool msetnx( const string_vector & keys, const string_vector & values )
+    // Connects without waiting longer than the connect timeout of the connection
+    static int timed_connect_(const connection_data & con, char * err)
     {
-      assert( keys.size() == values.size() );
+      int fd = anetTcpNonBlockConnect(err, const_cast<char*>(con.host.c_str()), con.port);
+      if (fd == ANET_ERR)
+        return ANET_ERR;
       
-      std::map< int, boost::optional<makecmd> > socket_commands;
+      struct pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = POLLOUT;
+      pfd.revents = 0;
       
-      for(size_t i=0; i < keys.size(); i++)
+      int count;
+      do
+        count = ::poll(&pfd, 1, con.connect_timeout_ms);
+      while (count == -1 && errno == EINTR);
+      
+      if (count == 0)
       {
-        int socket = get_socket(keys);
-        boost::optional<makecmd> & cmd = socket_commands[socket];
-        if(!cmd)
-          cmd = makecmd("MSETNX");
-        *cmd << keys[i] << values[i];
+        close(fd);
+        throw timeout_error("connect timeout (" + address_(con) + ")");
       }
-
-      if( socket_commands.size() > 1 )
-        throw std::runtime_error("feature is not available in cluster mode");
       
-      typedef std::pair< int, boost::optional<makecmd> > sock_pair;
-      BOOST_FOREACH(const sock_pair & sp, socket_commands)
+      if (count == -1)
+        snprintf(err, ANET_ERR_LEN, "poll: %s", strerror(errno));
+      
+      if (count == -1 || !finish_connect_(fd, err))
       {
-        send_(sp.first, *sp.second);
-        recv_ok_reply_(sp.first);
+        close(fd);
+        return ANET_ERR;
       }
+      return fd;
     }
     
-    bool msetnx( const string_pair_vector & key_value_pairs )
+    // Completes a non-blocking connect after the socket became writable
+    static bool finish_connect_(int fd, char * err)
     {
-      std::map< int, boost::optional<makecmd> > socket_commands;
+      int error = 0;
+      socklen_t len = sizeof(error);
+      if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+        error = errno;
       
-      for(size_t i=0; i < key_value_pairs.size(); i++)
+      if (error != 0)
       {
-        int socket = get_socket(keys);
-        boost::optional<makecmd> & cmd = socket_commands[socket];
-        if(!cmd)
-          cmd = makecmd("MSETNX");
-        *cmd << key_value_pairs[i].first << key_value_pairs[i].second;
+        snprintf(err, ANET_ERR_LEN, "connect: %s", strerror(error));
+        return false;
       }
       
-      if( socket_commands.size() > 1 )
-        throw std::runtime_error("feature is not available in cluster mode");
-      
-      typedef std::pair< int, boost::optional<makecmd> > sock_pair;
-      BOOST_FOREACH(const sock_pair & sp, socket_commands)
-      {
-        send_(sp.first, *sp.second);
-        recv_ok_reply_(sp.first);
-      }
+      // The other socket operations wait with poll() where a timeout applies
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+      return true;
     }
     
-    void setex(const string_type & key, const string_type & value, unsigned int secs)
+  public:
+    typedef std::string string_type;
+    typedef std::vector<string_type> string_vector;
+    typedef std::pair<string_type, string_type> string_pair;
+    typedef std::vector<string_pair> string_pair_vector;
+    typedef std::pair<string_type, double> string_score_pair;
+    typedef std::vector<string_score_pair> string_score_vector;
+    typedef std::set<string_type> string_set;
+
+    typedef long int_type;
+
+    // Size of the chunks that set_stream() and get_stream() transfer at once
+    enum { stream_chunk_size = 64 * 1024 };
+
+    // Default limits of unanswered commands per connection in batch operations
+    enum { default_window_commands = 1024, default_window_bytes = 256 * 1024 };
+
+    // Default limits of the chunks that variadic commands like mget(), mset() and del() are split into
+    enum { default_chunk_keys = 1000, default_chunk_bytes = 1024 * 1024 };
+
+    enum connect_mode
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("SETEX") << key << secs << value);
-      recv_ok_reply_(socket);
-    }
+      connect_all,      // connect to all servers in the constructor
+      connect_lazily    // connect to each server when it is used first
+    };
+
+    // Defaults of reconnecting failed connections, see set_reconnect()
+    enum { default_reconnect_min_ms = 10, default_reconnect_max_ms = 1000, default_retries = 2 };
+
+    // Defaults of the health monitor, see start_health_monitor()
+    enum { default_probe_interval_ms = 1000, default_probe_timeout_ms = 500, default_failure_threshold = 3 };
+
+    // State of a server as seen by the health monitor
+    struct server_health
+    {
+      server_health()
+      : available(true), probes(0), failures(0), consecutive_failures(0), rtt_ms(0.0)
+      {
+      }
+
+      bool available;               // false while the breaker of the server is open
+      unsigned long probes;         // PINGs sent
+      unsigned long failures;       // PINGs that failed or were not answered in time
+      int consecutive_failures;
+      double rtt_ms;                // moving average of the round trip time of the answered PINGs
+    };
+
+  private:
+    // Sends one request and keeps the turn to read its reply on the connection until destruction.
+    // With auto pipelining the request is queued and written together with the requests of other
+    // threads, otherwise it is sent right away.
     
-    size_t append(const string_type & key, const string_type & value)
+    class request_
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("APPEND") << key << value);
-      int res = recv_int_reply_(socket);
-      if(res < 0)
-        throw protocol_error("expected value size");
+    public:
+      template<typename REQUEST>
+      request_(base_client & client, int socket, const REQUEST & req)
+      : queue_(NULL), ticket_(0)
+      {
+        if (!client.auto_pipelining_)
+        {
+          client.send_request_(socket, req);
+          return;
+        }
+        
+        request_queue & queue = *client.connection_(socket).queue;
+        boost::mutex::scoped_lock lock(queue.mutex);
+        
+        if (queue.exclusive && queue.owner == boost::this_thread::get_id())
+        {
+          // Called within an operation that uses the connection exclusively
+          lock.unlock();
+          client.send_(socket, req);
+          return;
+        }
+        
+        ticket_ = queue.next_ticket++;
+        append_request_(queue.outbound, req);
+        queue.waiting.push_back(&wakeup_);
+        
+        for (;;)
+        {
+          if (queue.turn == ticket_ && queue.sent > ticket_)
+            break;
+          
+          // The requests are written when the replies of the last write were read. Until
+          // then the requests of all callers are collected for the next write.
+          if (queue.sent <= ticket_ && queue.turn == queue.sent && !queue.writing && !queue.exclusive)
+          {
+            std::string batch;
+            batch.swap(queue.outbound);
+            unsigned long batch_end = queue.next_ticket;
+            queue.writing = true;
+            lock.unlock();
+            
+            try
+            {
+              client.send_(socket, batch);
+            }
+            catch (...)
+            {
+              // The replies of the batch never arrive, the other callers fail on reading them
+              lock.lock();
+              written(queue, batch_end);
+              while (queue.turn != ticket_)
+                wakeup_.wait(lock);
+              next_turn(queue);
+              throw;
+            }
+            
+            lock.lock();
+            written(queue, batch_end);
+            continue;
+          }
+          
+          wakeup_.wait(lock);
+        }
+        
+        queue_ = &queue;
+      }
       
-      assert( static_cast<size_t>(res) >= value.size() );
-      return static_cast<size_t>(res);
-    }
+      ~request_()
+      {
+        if (!queue_)
+          return;
+        
+        boost::mutex::scoped_lock lock(queue_->mutex);
+        next_turn(*queue_);
+      }
+      
+    private:
+      request_(const request_ &);
+      request_ & operator=(const request_ &);
+      
+      static void written(request_queue & queue, unsigned long batch_end)
+      {
+        queue.sent = batch_end;
+        queue.writing = false;
+        queue.waiting.front()->notify_one();
+        queue.changed.notify_all();
+      }
+      
+      // Passes the turn to read a reply to the next caller. If it is not written yet, the
+      // connection is idle now and the caller writes all queued requests.
+      static void next_turn(request_queue & queue)
+      {
+        queue.waiting.pop_front();
+        ++queue.turn;
+        if (!queue.waiting.empty())
+          queue.waiting.front()->notify_one();
+        queue.changed.notify_all();
+      }
+      
+      request_queue * queue_;
+      unsigned long ticket_;
+      boost::condition_variable wakeup_;
+    };
     
-    string_type substr(const string_type & key, int start, int end)
+    static void append_request_(std::string & out, const std::string & req)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("SUBSTR") << key << start << end);
-      return recv_bulk_reply_(socket);
+      out += req;
     }
     
-    int_type incr(const string_type & key)
+    static void append_request_(std::string & out, const makecmd & req)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("INCR") << key);
-      return recv_int_reply_(socket);
+      if (req.contiguous())
+        out.append(req.data(), req.size());
+      else
+        out += static_cast<std::string>(req);
+    }
+    
+    // Gives the calling thread exclusive use of all connections while it exists. Used by operations
+    // that send or receive more than one request per connection. Queued requests of other threads
+    // are held back, the replies that are already on the way are read by their callers first.
+    // Does nothing without auto pipelining.
+    
+    class exclusive_
+    {
+    public:
+      explicit exclusive_(base_client & client)
+      {
+        if (!client.auto_pipelining_)
+          return;
+        
+        boost::thread::id self = boost::this_thread::get_id();
+        
+        // Always in the same order, so two exclusive operations can not deadlock
+        for (size_t i = 0; i < client.connections_.size(); ++i)
+        {
+          request_queue & queue = *client.connections_[i].queue;
+          boost::mutex::scoped_lock lock(queue.mutex);
+          
+          if (queue.exclusive && queue.owner == self)
+            continue;
+          
+          while (queue.exclusive || queue.writing)
+            queue.changed.wait(lock);
+          
+          queue.exclusive = true;
+          queue.owner = self;
+          acquired_.push_back(&queue);
+          
+          while (queue.turn != queue.sent)
+            queue.changed.wait(lock);
+        }
+      }
+      
+      ~exclusive_()
+      {
+        for (size_t i = 0; i < acquired_.size(); ++i)
+        {
+          request_queue & queue = *acquired_[i];
+          boost::mutex::scoped_lock lock(queue.mutex);
+          queue.exclusive = false;
+          queue.owner = boost::thread::id();
+          
+          // The next caller writes the requests that were queued in the meantime
+          if (!queue.waiting.empty())
+            queue.waiting.front()->notify_one();
+          queue.changed.notify_all();
+        }
+      }
+      
+    private:
+      exclusive_(const exclusive_ &);
+      exclusive_ & operator=(const exclusive_ &);
+      
+      std::vector<request_queue *> acquired_;
+    };
+
+    // Connection of its own for a blocking command while auto pipelining is on. The server answers
+    // the requests on a connection in order, so a BLPOP on the shared connection would hold back
+    // the replies of all other threads until it returns. The connections are kept per server for
+    // the next blocking command, unless release() was not called because the command failed.
+    
+    class blocking_
+    {
+    public:
+      blocking_(base_client & client, int socket)
+      : client_(client), index_(&client.connection_(socket) - &client.connections_[0]), dedicated_(NULL)
+      {
+        connection_data & con = client.connections_[index_];
+        client.check_available_(con);
+        
+        {
+          boost::mutex::scoped_lock lock(client.blocking_mutex_);
+          client.blocking_idle_.resize(client.connections_.size());
+          std::vector<base_client *> & idle = client.blocking_idle_[index_];
+          if (!idle.empty())
+          {
+            dedicated_ = idle.back();
+            idle.pop_back();
+            return;
+          }
+        }
+        
+        connection_data dedicated(con.host, con.port, con.dbindex);
+        dedicated.connect_timeout_ms = con.connect_timeout_ms;
+        dedicated.timeout_ms = con.timeout_ms;
+        dedicated_ = new base_client(&dedicated, &dedicated + 1);
+        try
+        {
+          if (!client.password_.empty())
+            dedicated_->auth(client.password_);
+        }
+        catch (...)
+        {
+          delete dedicated_;
+          throw;
+        }
+      }
+      
+      ~blocking_()
+      {
+        delete dedicated_;
+      }
+      
+      base_client * operator->() const
+      {
+        return dedicated_;
+      }
+      
+      // Keeps the connection for the next blocking command
+      void release()
+      {
+        boost::mutex::scoped_lock lock(client_.blocking_mutex_);
+        client_.blocking_idle_[index_].push_back(dedicated_);
+        dedicated_ = NULL;
+      }
+      
+    private:
+      blocking_(const blocking_ &);
+      blocking_ & operator=(const blocking_ &);
+      
+      base_client & client_;
+      size_t index_;
+      base_client * dedicated_;
+    };
+
+    // Sends a batch of commands with a bounded number of unanswered commands per connection.
+    // Commands are collected in chunks of half the window; before a chunk would overflow the window,
+    // replies of earlier chunks are read. So neither side blocks on a full socket buffer while the
+    // other one waits for it, no matter how large the batch is. READER must provide
+    // void operator()(int socket), reading and processing the next reply on the socket.
+
+    template<typename READER>
+    class window_
+    {
+    public:
+      window_(base_client & client, READER & read)
+      : client_(client), read_(read)
+      {
+      }
+
+      // When the operation failed, the replies that are still on the way would be taken for those
+      // of the next commands, so these connections are connected again on their next use
+      ~window_()
+      {
+        typedef typename std::map<int, connection_window>::iterator iterator;
+        for (iterator it = windows_.begin(); it != windows_.end(); ++it)
+        {
+          if (!it->second.chunks.empty())
+            client_.connection_(it->first).broken = true;
+        }
+      }
+
+      void add(int socket, const std::string & cmd)
+      {
+        connection_window & w = windows_[socket];
+        w.out += cmd;
+        queued_(socket, w);
+      }
+
+      // Commands that reference large arguments are sent on their own instead of being copied
+      void add(int socket, const makecmd & cmd)
+      {
+        connection_window & w = windows_[socket];
+        if (cmd.contiguous())
+        {
+          w.out.append(cmd.data(), cmd.size());
+          queued_(socket, w);
+          return;
+        }
+
+        flush_(socket, w);
+        make_room_(socket, w, 1, cmd.size());
+        client_.send_(socket, cmd);
+        sent_(w, 1, cmd.size());
+      }
+
+      // Sends the rest of the batch and reads all outstanding replies
+      void finish()
+      {
+        typedef typename std::map<int, connection_window>::iterator iterator;
+        for (iterator it = windows_.begin(); it != windows_.end(); ++it)
+          flush_(it->first, it->second);
+
+        std::vector<int> waiting = sockets_of_(windows_);
+        while (!waiting.empty())
+        {
+          int socket = client_.next_ready_(waiting);
+          connection_window & w = windows_[socket];
+          while (!w.chunks.empty())
+            read_one_(socket, w);
+        }
+      }
+
+    private:
+      struct connection_window
+      {
+        connection_window()
+        : queued(0), in_flight_commands(0), in_flight_bytes(0)
+        {
+        }
+
+        std::string out;
+        size_t queued;
+        size_t in_flight_commands;
+        size_t in_flight_bytes;
+
+        /// Unanswered commands and size of the chunks that were sent
+        std::deque< std::pair<size_t, size_t> > chunks;
+      };
+
+      void queued_(int socket, connection_window & w)
+      {
+        w.queued++;
+        if (2 * w.queued >= client_.window_commands_ || 2 * w.out.size() >= client_.window_bytes_)
+          flush_(socket, w);
+      }
+
+      void flush_(int socket, connection_window & w)
+      {
+        if (w.queued == 0)
+          return;
+
+        make_room_(socket, w, w.queued, w.out.size());
+        client_.send_(socket, w.out);
+        sent_(w, w.queued, w.out.size());
+        w.queued = 0;
+        w.out.clear();
+      }
+
+      void make_room_(int socket, connection_window & w, size_t commands, size_t bytes)
+      {
+        while (!w.chunks.empty() && (w.in_flight_commands + commands > client_.window_commands_ ||
+                                     w.in_flight_bytes + bytes > client_.window_bytes_))
+          read_one_(socket, w);
+      }
+
+      static void sent_(connection_window & w, size_t commands, size_t bytes)
+      {
+        w.chunks.push_back( std::make_pair(commands, bytes) );
+        w.in_flight_commands += commands;
+        w.in_flight_bytes += bytes;
+      }
+
+      void read_one_(int socket, connection_window & w)
+      {
+        read_(socket);
+        w.in_flight_commands--;
+        if (--w.chunks.front().first == 0)
+        {
+          w.in_flight_bytes -= w.chunks.front().second;
+          w.chunks.pop_front();
+        }
+      }
+
+      base_client & client_;
+      READER & read_;
+      std::map<int, connection_window> windows_;
+    };
+
+    // Splits a variadic command into chunks of at most chunk_keys_ keys (or members) or chunk_bytes_
+    // bytes of arguments per server, which are pipelined through a window_. If key is given, every
+    // chunk starts with it. READER reads the reply of one chunk.
+
+    template<typename READER>
+    class chunks_
+    {
+    public:
+      chunks_(base_client & client, READER & read, const char * name, const string_type * key = 0)
+      : client_(client), batch_(client, read), name_(name), key_(key)
+      {
+      }
+
+      // Returns the command to append the arguments of one key (or member) of size bytes to. The
+      // current chunk of the server is sent first if they do not fit into it.
+      makecmd & next(int socket, size_t size)
+      {
+        chunk & c = current_[socket];
+        if (c.cmd && (c.keys >= client_.chunk_keys_ || c.bytes + size > client_.chunk_bytes_))
+        {
+          batch_.add(socket, *c.cmd);
+          c.cmd.reset();
+        }
+
+        if (!c.cmd)
+        {
+          c.cmd = makecmd(name_);
+          if (key_)
+            *c.cmd << *key_;
+          c.keys = 0;
+          c.bytes = 0;
+        }
+
+        c.keys++;
+        c.bytes += size;
+        return *c.cmd;
+      }
+
+      // Sends the last chunks and reads all outstanding replies
+      void finish()
+      {
+        typedef typename std::map<int, chunk>::iterator iterator;
+        for (iterator it = current_.begin(); it != current_.end(); ++it)
+        {
+          if (it->second.cmd)
+            batch_.add(it->first, *it->second.cmd);
+        }
+        batch_.finish();
+      }
+
+    private:
+      struct chunk
+      {
+        boost::optional<makecmd> cmd;
+        size_t keys;
+        size_t bytes;
+      };
+
+      base_client & client_;
+      window_<READER> batch_;
+      const char * name_;
+      const string_type * key_;
+      std::map<int, chunk> current_;
+    };
+
+    struct ok_reader
+    {
+      explicit ok_reader(base_client & client)
+      : client(client)
+      {
+      }
+
+      void operator()(int socket)
+      {
+        client.recv_ok_reply_(socket);
+      }
+
+      base_client & client;
+    };
+
+    struct int_reader
+    {
+      explicit int_reader(base_client & client)
+      : client(client), sum(0), last(0)
+      {
+      }
+
+      void operator()(int socket)
+      {
+        last = client.recv_int_reply_(socket);
+        sum += last;
+      }
+
+      base_client & client;
+      int_type sum;
+      int_type last;
+    };
+
+  public:
+
+    /**
+     * Input range over the elements of one or more multi bulk replies. The elements are parsed off
+     * the socket one at a time while the range is iterated, so only the current element is held in
+     * memory. Copies of a range share their position. If reading the replies fails, their
+     * connections are connected again on their next use.
+     *
+     * @warning The range refers to the client, which has to outlive it. Until the range was iterated
+     * completely or close() was called (this also happens on destruction of the last copy), the
+     * client must not be used for other commands: the replies would be read out of order. With auto
+     * pipelining the other threads wait for the range meanwhile, so the thread that iterates it must
+     * not wait for them either.
+     */
+    template<typename VALUE>
+    class lazy_range
+    {
+    private:
+      struct state
+      {
+        state(base_client * client)
+        : client(client), cur(0), left(0), at_end(true)
+        {
+        }
+        
+        ~state()
+        {
+          try
+          {
+            close();
+          }
+          catch(...)
+          {
+          }
+        }
+        
+        void close()
+        {
+          while( !at_end )
+            advance();
+        }
+        
+        void advance()
+        {
+          if( at_end )
+            return;
+          
+          while( left == 0 )
+          {
+            if( ++cur >= replies.size() )
+            {
+              at_end = true;
+              guard.reset();
+              return;
+            }
+            left = replies[cur].second;
+          }
+          
+          try
+          {
+            client->recv_element_(replies[cur].first, value);
+          }
+          catch(...)
+          {
+            abandon(cur);
+            throw;
+          }
+          left--;
+        }
+        
+        // The replies from index on are not read completely, so their connections are connected
+        // again on their next use
+        void abandon(size_t index)
+        {
+          for( ; index < replies.size(); ++index )
+            client->connection_(replies[index].first).broken = true;
+          at_end = true;
+          guard.reset();
+        }
+        
+        base_client * client;
+        boost::shared_ptr<exclusive_> guard;
+        
+        /// Sockets with their count of elements that are not yet read
+        std::vector< std::pair<int, int_type> > replies;
+        size_t cur;
+        int_type left;
+        bool at_end;
+        VALUE value;
+      };
+      
+    public:
+      class iterator
+      {
+      public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef VALUE value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const VALUE * pointer;
+        typedef const VALUE & reference;
+        
+        iterator()
+        {
+        }
+        
+        explicit iterator(const boost::shared_ptr<state> & st)
+        : state_(st)
+        {
+        }
+        
+        const VALUE & operator*() const
+        {
+          return state_->value;
+        }
+        
+        const VALUE * operator->() const
+        {
+          return &state_->value;
+        }
+        
+        iterator & operator++()
+        {
+          state_->advance();
+          return *this;
+        }
+        
+        void operator++(int)
+        {
+          state_->advance();
+        }
+        
+        bool operator==(const iterator & other) const
+        {
+          return at_end() == other.at_end();
+        }
+        
+        bool operator!=(const iterator & other) const
+        {
+          return !(*this == other);
+        }
+        
+      private:
+        bool at_end() const
+        {
+          return !state_ || state_->at_end;
+        }
+        
+        boost::shared_ptr<state> state_;
+      };
+      
+      typedef iterator const_iterator;
+      
+      lazy_range()
+      : size_(0)
+      {
+      }
+      
+      iterator begin() const
+      {
+        return iterator(state_);
+      }
+      
+      iterator end() const
+      {
+        return iterator();
+      }
+      
+      /// The total count of elements (including the already iterated ones)
+      int_type size() const
+      {
+        return size_;
+      }
+      
+      /// Skips all elements that are not yet read
+      void close()
+      {
+        if( state_ )
+          state_->close();
+        state_.reset();
+        size_ = 0;
+      }
+      
+    private:
+      friend class base_client;
+      
+      // Reads the headers of the multi bulk replies of the given sockets and the first element.
+      // The range keeps the guard (exclusive use of the connections with auto pipelining) until
+      // all elements were read.
+      template<typename SOCKET_ITERATOR>
+      void open(base_client * client, SOCKET_ITERATOR begin, SOCKET_ITERATOR end,
+                const boost::shared_ptr<exclusive_> & guard)
+      {
+        close();
+        boost::shared_ptr<state> st( new state(client) );
+        for( SOCKET_ITERATOR it = begin; it != end; ++it )
+          st->replies.push_back( std::make_pair(*it, 0) );
+        
+        try
+        {
+          for( size_t i = 0; i < st->replies.size(); ++i )
+          {
+            int_type count = client->recv_bulk_reply_(st->replies[i].first, REDIS_PREFIX_MULTI_BULK_REPLY);
+            if( count == -1 )
+              count = 0;
+            if( count % client->element_size_(st->value) != 0 )
+              throw protocol_error("unexpected count of elements in multi bulk reply");
+            
+            count /= client->element_size_(st->value);
+            st->replies[i].second = count;
+            size_ += count;
+          }
+        }
+        catch(...)
+        {
+          st->abandon(0);
+          size_ = 0;
+          throw;
+        }
+        
+        if( !st->replies.empty() )
+        {
+          st->at_end = false;
+          st->left = st->replies[0].second;
+          st->guard = guard;
+          st->advance();
+        }
+        state_ = st;
+      }
+      
+      boost::shared_ptr<state> state_;
+      int_type size_;
+    };
+    
+    typedef lazy_range<string_type> string_range;
+    typedef lazy_range<string_pair> string_pair_range;
+    
+    /**
+     * Queues commands and sends them when execute() is called, per server in batches of at most the
+     * pipeline window (see set_pipeline_window()). Each command returns a deferred handle to its
+     * typed result, which is ready after execute(). An error reply only fails the handle of the
+     * command it belongs to. If the replies of a server cannot be read (connection or protocol
+     * error), its connection is closed and the handles of all its commands that did not complete
+     * fail with connection_error; the other servers are unaffected. Nothing is sent before
+     * execute(), so a pipeline that is destroyed earlier has no effect.
+     *
+     * @warning The client must not be used while execute() runs.
+     */
+    class pipeline
+    {
+    public:
+      explicit pipeline(base_client & client)
+      : client_(client)
+      {
+      }
+      
+      // Number of queued commands
+      size_t size() const
+      {
+        return pending_.size();
+      }
+      
+      bool empty() const
+      {
+        return pending_.empty();
+      }
+      
+      // Discards the queued commands, their handles never become ready.
+      void clear()
+      {
+        pending_.clear();
+      }
+      
+      // Sends all queued commands and receives their replies. The pipeline is empty afterwards.
+      void execute()
+      {
+        exclusive_ guard(client_);
+        std::vector< boost::shared_ptr<pending> > replies;
+        replies.swap(pending_);
+        
+        // The commands of each server in order
+        typedef std::map<int, std::deque<pending *> > queue_map;
+        queue_map queued;
+        for (size_t i = 0; i < replies.size(); ++i)
+          queued[replies[i]->socket].push_back(replies[i].get());
+        
+        // Servers whose replies are out of sync, with the reason
+        std::map<int, std::string> failed;
+        
+        // A window of commands is sent to every server before the replies are read, so the servers
+        // work in parallel but neither side blocks on a full socket buffer while the other one
+        // waits for it, no matter how large the pipeline is
+        while (!queued.empty())
+        {
+          std::map<int, size_t> sent;
+          for (typename queue_map::iterator it = queued.begin(); it != queued.end(); ++it)
+            sent[it->first] = send_window_(it->first, it->second, failed);
+          
+          for (typename queue_map::iterator it = queued.begin(); it != queued.end(); )
+          {
+            for (size_t n = sent[it->first]; n > 0; --n)
+            {
+              recv_(*it->second.front(), failed);
+              it->second.pop_front();
+            }
+            
+            if (it->second.empty())
+              queued.erase(it++);
+            else
+              ++it;
+          }
+        }
+      }
+      
+      deferred<string_type> get(const string_type & key)
+      {
+        return queue_(key, makecmd(prefix::get) << key, &read_bulk);
+      }
+      
+      deferred<void> set(const string_type & key, const string_type & value)
+      {
+        return queue_(key, makecmd(prefix::set) << key << value, &read_ok);
+      }
+      
+      deferred<bool> setnx(const string_type & key, const string_type & value)
+      {
+        return queue_(key, makecmd(prefix::setnx) << key << value, &read_bool);
+      }
+      
+      deferred<void> setex(const string_type & key, const string_type & value, unsigned int secs)
+      {
+        return queue_(key, makecmd("SETEX") << key << secs << value, &read_ok);
+      }
+      
+      deferred<string_type> getset(const string_type & key, const string_type & value)
+      {
+        return queue_(key, makecmd(prefix::getset) << key << value, &read_bulk);
+      }
+      
+      deferred<int_type> append(const string_type & key, const string_type & value)
+      {
+        return queue_(key, makecmd(prefix::append) << key << value, &read_int);
+      }
+      
+      deferred<int_type> incr(const string_type & key)
+      {
+        return queue_(key, makecmd(prefix::incr) << key, &read_int);
+      }
+      
+      deferred<int_type> incrby(const string_type & key, int_type by)
+      {
+        return queue_(key, makecmd(prefix::incrby) << key << by, &read_int);
+      }
+      
+      deferred<int_type> decr(const string_type & key)
+      {
+        return queue_(key, makecmd(prefix::decr) << key, &read_int);
+      }
+      
+      deferred<int_type> decrby(const string_type & key, int_type by)
+      {
+        return queue_(key, makecmd(prefix::decrby) << key << by, &read_int);
+      }
+      
+      deferred<bool> exists(const string_type & key)
+      {
+        return queue_(key, makecmd(prefix::exists) << key, &read_bool);
+      }
+      
+      deferred<bool> del(const string_type & key)
+      {
+        return queue_(key, makecmd(prefix::del) << key, &read_bool);
+      }
+      
+      // True if the timeout was set
+      deferred<bool> expire(const string_type & key, unsigned int secs)
+      {
+        return queue_(key, makecmd(prefix::expire) << key << secs, &read_bool);
+      }
+      
+      deferred<int_type> ttl(const string_type & key)
+      {
+        return queue_(key, makecmd(prefix::ttl) << key, &read_int);
+      }
+      
+      deferred<int_type> rpush(const string_type & key, const string_type & value)
+      {
+        return queue_(key, makecmd(prefix::rpush) << key << value, &read_int);
+      }
+      
+      deferred<int_type> lpush(const string_type & key, const string_type & value)
+      {
+        return queue_(key, makecmd(prefix::lpush) << key << value, &read_int);
+      }
+      
+      deferred<int_type> llen(const string_type & key)
+      {
+        return queue_(key, makecmd(prefix::llen) << key, &read_int);
+      }
+      
+      deferred<string_vector> lrange(const string_type & key, int_type start, int_type end)
+      {
+        return queue_(key, makecmd("LRANGE") << key << start << end, &read_vector);
+      }
+      
+      deferred<string_type> lindex(const string_type & key, int_type index)
+      {
+        return queue_(key, makecmd(prefix::lindex) << key << index, &read_bulk);
+      }
+      
+      deferred<string_type> lpop(const string_type & key)
+      {
+        return queue_(key, makecmd(prefix::lpop) << key, &read_bulk);
+      }
+      
+      deferred<string_type> rpop(const string_type & key)
+      {
+        return queue_(key, makecmd(prefix::rpop) << key, &read_bulk);
+      }
+      
+      deferred<bool> sadd(const string_type & key, const string_type & value)
+      {
+        return queue_(key, makecmd(prefix::sadd) << key << value, &read_bool);
+      }
+      
+      deferred<bool> srem(const string_type & key, const string_type & value)
+      {
+        return queue_(key, makecmd(prefix::srem) << key << value, &read_bool);
+      }
+      
+      deferred<bool> sismember(const string_type & key, const string_type & value)
+      {
+        return queue_(key, makecmd(prefix::sismember) << key << value, &read_bool);
+      }
+      
+      deferred<int_type> scard(const string_type & key)
+      {
+        return queue_(key, makecmd(prefix::scard) << key, &read_int);
+      }
+      
+      deferred<string_set> smembers(const string_type & key)
+      {
+        return queue_(key, makecmd("SMEMBERS") << key, &read_set);
+      }
+      
+      // True if the member was added, false if only its score was updated
+      deferred<bool> zadd(const string_type & key, double score, const string_type & member)
+      {
+        return queue_(key, makecmd(prefix::zadd) << key << score << member, &read_bool);
+      }
+      
+      deferred<bool> zrem(const string_type & key, const string_type & member)
+      {
+        return queue_(key, makecmd(prefix::zrem) << key << member, &read_bool);
+      }
+      
+      deferred<double> zincrby(const string_type & key, const string_type & member, double increment)
+      {
+        return queue_(key, makecmd(prefix::zincrby) << key << increment << member, &read_double);
+      }
+      
+      // Fails with a key_error if the member does not exist
+      deferred<double> zscore(const string_type & key, const string_type & member)
+      {
+        return queue_(key, makecmd(prefix::zscore) << key << member, &read_double);
+      }
+      
+      deferred<int_type> zrank(const string_type & key, const string_type & member)
+      {
+        return queue_(key, makecmd("ZRANK") << key << member, &read_int);
+      }
+      
+      deferred<int_type> zcard(const string_type & key)
+      {
+        return queue_(key, makecmd(prefix::zcard) << key, &read_int);
+      }
+      
+      deferred<string_vector> zrange(const string_type & key, int_type start, int_type end)
+      {
+        return queue_(key, makecmd("ZRANGE") << key << start << end, &read_vector);
+      }
+      
+      deferred<string_score_vector> zrange_withscores(const string_type & key, int_type start, int_type end)
+      {
+        return queue_(key, makecmd("ZRANGE") << key << start << end << "WITHSCORES", &read_scores);
+      }
+      
+      deferred<string_vector> zrevrange(const string_type & key, int_type start, int_type end)
+      {
+        return queue_(key, makecmd("ZREVRANGE") << key << start << end, &read_vector);
+      }
+      
+      deferred<string_score_vector> zrevrange_withscores(const string_type & key, int_type start, int_type end)
+      {
+        return queue_(key, makecmd("ZREVRANGE") << key << start << end << "WITHSCORES", &read_scores);
+      }
+      
+      deferred<bool> hset(const string_type & key, const string_type & field, const string_type & value)
+      {
+        return queue_(key, makecmd(prefix::hset) << key << field << value, &read_bool);
+      }
+      
+      deferred<bool> hsetnx(const string_type & key, const string_type & field, const string_type & value)
+      {
+        return queue_(key, makecmd(prefix::hsetnx) << key << field << value, &read_bool);
+      }
+      
+      deferred<string_type> hget(const string_type & key, const string_type & field)
+      {
+        return queue_(key, makecmd(prefix::hget) << key << field, &read_bulk);
+      }
+      
+      deferred<bool> hdel(const string_type & key, const string_type & field)
+      {
+        return queue_(key, makecmd(prefix::hdel) << key << field, &read_bool);
+      }
+      
+      deferred<bool> hexists(const string_type & key, const string_type & field)
+      {
+        return queue_(key, makecmd(prefix::hexists) << key << field, &read_bool);
+      }
+      
+      deferred<int_type> hincrby(const string_type & key, const string_type & field, int_type by)
+      {
+        return queue_(key, makecmd(prefix::hincrby) << key << field << by, &read_int);
+      }
+      
+      deferred<int_type> hlen(const string_type & key)
+      {
+        return queue_(key, makecmd(prefix::hlen) << key, &read_int);
+      }
+      
+      deferred<string_vector> hkeys(const string_type & key)
+      {
+        return queue_(key, makecmd("HKEYS") << key, &read_vector);
+      }
+      
+      deferred<string_vector> hvals(const string_type & key)
+      {
+        return queue_(key, makecmd("HVALS") << key, &read_vector);
+      }
+      
+      deferred<string_pair_vector> hgetall(const string_type & key)
+      {
+        return queue_(key, makecmd("HGETALL") << key, &read_pairs);
+      }
+      
+    private:
+      struct pending
+      {
+        explicit pending(int socket)
+        : socket(socket)
+        {
+        }
+        
+        virtual ~pending()
+        {
+        }
+        
+        virtual void recv(base_client & client) = 0;
+        virtual void fail(const std::string & msg) = 0;
+        
+        int socket;
+        std::string request;
+      };
+      
+      template<typename T>
+      struct pending_reply : pending
+      {
+        typedef void (*reader)(base_client &, int, deferred_state<T> &);
+        
+        pending_reply(int socket, reader read, const boost::shared_ptr< deferred_state<T> > & state)
+        : pending(socket), read(read), state(state)
+        {
+        }
+        
+        virtual void recv(base_client & client)
+        {
+          int socket = this->socket;
+          if (client.next_reply_type(socket) == error_reply)
+          {
+            std::string line = client.read_line(socket);
+            if (line.find(REDIS_PREFIX_STATUS_REPLY_ERROR) == 0)
+              line.erase(0, strlen(REDIS_PREFIX_STATUS_REPLY_ERROR));
+            else
+              line.erase(0, 1);
+            state->template fail<protocol_error>(line);
+            return;
+          }
+          
+          try
+          {
+            read(client, socket, *state);
+            state->ready = true;
+          }
+          catch (const key_error & e)
+          {
+            // Thrown after the complete reply was received, so the following replies are unaffected
+            state->template fail<key_error>(e.what());
+          }
+          catch (const boost::bad_lexical_cast & e)
+          {
+            // Likewise
+            state->template fail<value_error>(e.what());
+          }
+        }
+        
+        virtual void fail(const std::string & msg)
+        {
+          state->template fail<connection_error>(msg);
+        }
+        
+        reader read;
+        boost::shared_ptr< deferred_state<T> > state;
+      };
+      
+      // Sends the next commands of a server that fit into the pipeline window and returns their number
+      size_t send_window_(int socket, const std::deque<pending *> & commands, std::map<int, std::string> & failed)
+      {
+        std::string out;
+        size_t n = 0;
+        while (n < commands.size() && n < client_.window_commands_ &&
+               (n == 0 || out.size() + commands[n]->request.size() <= client_.window_bytes_))
+          out += commands[n++]->request;
+        
+        if (failed.find(socket) != failed.end())
+          return n;
+        
+        try
+        {
+          client_.send_(socket, out);
+        }
+        catch (const std::exception & e)
+        {
+          fail_connection_(socket, e.what(), failed);
+        }
+        return n;
+      }
+      
+      void recv_(pending & command, std::map<int, std::string> & failed)
+      {
+        std::map<int, std::string>::const_iterator it = failed.find(command.socket);
+        if (it != failed.end())
+        {
+          command.fail(it->second);
+          return;
+        }
+        
+        try
+        {
+          command.recv(client_);
+        }
+        catch (const std::exception & e)
+        {
+          fail_connection_(command.socket, e.what(), failed);
+          command.fail(e.what());
+        }
+      }
+      
+      // Closes a connection whose replies cannot be read anymore, the next command reconnects
+      void fail_connection_(int socket, const std::string & msg, std::map<int, std::string> & failed)
+      {
+        connection_data & con = client_.connection_(socket);
+        ::shutdown(con.socket, SHUT_RDWR);
+        con.broken = true;
+        failed[socket] = msg;
+      }
+      
+      template<typename T>
+      deferred<T> queue_(const string_type & key, const makecmd & cmd, void (*read)(base_client &, int, deferred_state<T> &))
+      {
+        int socket = client_.get_socket(key);
+        boost::shared_ptr< deferred_state<T> > state(new deferred_state<T>());
+        boost::shared_ptr<pending> command( new pending_reply<T>(socket, read, state) );
+        append_request_(command->request, cmd);
+        pending_.push_back(command);
+        return deferred<T>(state);
+      }
+      
+      // Reply readers
+      
+      static void read_ok(base_client & client, int socket, deferred_state<void> &)
+      {
+        client.recv_ok_reply_(socket);
+      }
+      
+      static void read_bool(base_client & client, int socket, deferred_state<bool> & state)
+      {
+        state.value = client.recv_int_reply_(socket) == 1;
+      }
+      
+      static void read_int(base_client & client, int socket, deferred_state<int_type> & state)
+      {
+        state.value = client.recv_int_reply_(socket);
+      }
+      
+      static void read_bulk(base_client & client, int socket, deferred_state<string_type> & state)
+      {
+        if (!client.recv_bulk_reply_(socket, state.value))
+          state.value = missing_value();
+      }
+      
+      static void read_double(base_client & client, int socket, deferred_state<double> & state)
+      {
+        std::string str;
+        if (!client.recv_bulk_reply_(socket, str))
+          throw key_error("no such member");
+        state.value = boost::lexical_cast<double>(str);
+      }
+      
+      static void read_vector(base_client & client, int socket, deferred_state<string_vector> & state)
+      {
+        client.recv_multi_bulk_reply_(socket, state.value);
+      }
+      
+      static void read_set(base_client & client, int socket, deferred_state<string_set> & state)
+      {
+        client.recv_multi_bulk_reply_(socket, state.value);
+      }
+      
+      static void read_pairs(base_client & client, int socket, deferred_state<string_pair_vector> & state)
+      {
+        string_vector s;
+        client.recv_multi_bulk_reply_(socket, s);
+        to_pairs_(s, state.value);
+      }
+      
+      static void read_scores(base_client & client, int socket, deferred_state<string_score_vector> & state)
+      {
+        string_vector s;
+        client.recv_multi_bulk_reply_(socket, s);
+        client.convert(s, state.value);
+      }
+      
+      base_client & client_;
+      std::vector< boost::shared_ptr<pending> > pending_;
+    };
+
+    explicit base_client(const string_type & host = "localhost",
+                    uint16_t port = 6379, int_type dbindex = 0)
+    : connect_mode_(connect_all), auto_pipelining_(false), window_commands_(default_window_commands),
+      window_bytes_(default_window_bytes), chunk_keys_(default_chunk_keys),
+      chunk_bytes_(default_chunk_bytes), reconnect_min_ms_(default_reconnect_min_ms),
+      reconnect_max_ms_(default_reconnect_max_ms), retries_(default_retries)
+    {
+      connection_data con;
+      con.host = host;
+      con.port = port;
+      con.dbindex = dbindex;
+      connections_.push_back(con);
+      init();
+    }
+
+    /**
+     * Creates a client for the servers in [begin, end). With connect_lazily no connection is
+     * opened here: each server is connected (and its database selected) by the first command sent
+     * to it, so clients that use only a few of many servers start faster and keep fewer
+     * connections. Connection errors are then thrown by that command.
+     */
+    template<typename CON_ITERATOR>
+    base_client(CON_ITERATOR begin, CON_ITERATOR end, connect_mode mode = connect_all)
+    : connect_mode_(mode), auto_pipelining_(false), window_commands_(default_window_commands),
+      window_bytes_(default_window_bytes), chunk_keys_(default_chunk_keys),
+      chunk_bytes_(default_chunk_bytes), reconnect_min_ms_(default_reconnect_min_ms),
+      reconnect_max_ms_(default_reconnect_max_ms), retries_(default_retries)
+    {
+      while(begin != end)
+      {
+        connections_.push_back(*begin);
+        begin++;
+      }
+
+      if( connections_.empty() )
+        throw std::runtime_error("No connections given!");
+      
+      init();
+    }
+
+    base_client<CONSISTENT_HASHER>* clone() const
+    {
+      return new base_client<CONSISTENT_HASHER>(connections_.begin(), connections_.end(), connect_mode_);
+    }
+
+    /**
+     * Lets several threads share this client. Requests of concurrent callers to the same server are
+     * then coalesced into one write and the replies are matched back in FIFO order, so the calls stay
+     * synchronous. Operations that need more than one round trip (e.g. mget in cluster mode, lazy
+     * ranges, pipelines and transactions) use the connections exclusively while they run. Blocking
+     * pops (blpop, brpop) wait on connections of their own, which are kept for reuse.
+     *
+     * @warning Must be called before the client is shared, i.e. while no other thread uses it.
+     */
+    void set_auto_pipelining(bool enable)
+    {
+      for (size_t i = 0; i < connections_.size(); ++i)
+      {
+        if (enable)
+          connections_[i].queue.reset( new request_queue() );
+        else
+          connections_[i].queue.reset();
+      }
+      auto_pipelining_ = enable;
+    }
+    
+    bool auto_pipelining() const
+    {
+      return auto_pipelining_;
+    }
+
+    /**
+     * Limits the commands that batch operations (exec() of a command vector, sadd() of a range,
+     * msetex() and pipelines) leave unanswered on one connection. Once max_commands commands or max_bytes bytes
+     * of requests are in flight, replies are read before more is sent. A larger window saves round
+     * trips, a smaller one keeps large replies from filling the socket buffers.
+     */
+    void set_pipeline_window(size_t max_commands, size_t max_bytes = default_window_bytes)
+    {
+      if (max_commands == 0 || max_bytes == 0)
+        throw std::runtime_error("pipeline window must not be empty");
+      window_commands_ = max_commands;
+      window_bytes_ = max_bytes;
+    }
+
+    size_t pipeline_window_commands() const
+    {
+      return window_commands_;
+    }
+
+    size_t pipeline_window_bytes() const
+    {
+      return window_bytes_;
+    }
+
+    /**
+     * Limits the commands that mget(), mset(), del() of a range and the range overloads of sadd(),
+     * srem(), rpush(), lpush(), zadd() and hdel() send to one server. Larger inputs are split into
+     * commands of at most max_keys keys (or members) or max_bytes bytes of arguments, which are
+     * pipelined. This bounds the time the server is blocked by one command and the memory needed to
+     * build it. A single key whose arguments exceed max_bytes still forms a chunk of its own.
+     */
+    void set_chunk_size(size_t max_keys, size_t max_bytes = default_chunk_bytes)
+    {
+      if (max_keys == 0 || max_bytes == 0)
+        throw std::runtime_error("chunk size must not be empty");
+      chunk_keys_ = max_keys;
+      chunk_bytes_ = max_bytes;
+    }
+
+    size_t chunk_keys() const
+    {
+      return chunk_keys_;
+    }
+
+    size_t chunk_bytes() const
+    {
+      return chunk_bytes_;
+    }
+
+    /**
+     * Limits each wait for a server to answer or to accept a request to the given number of
+     * milliseconds on all connections (0 waits without limit). A timeout throws timeout_error and
+     * shuts the connection down, so it is connected again when it is used next (see set_reconnect()).
+     * The timeout of connecting is set per connection with connection_data::connect_timeout_ms.
+     */
+    void set_timeout(int milliseconds)
+    {
+      if (milliseconds < 0)
+        throw std::runtime_error("timeout must not be negative");
+      BOOST_FOREACH(connection_data & con, connections_)
+      {
+        con.timeout_ms = milliseconds;
+      }
+    }
+
+    /**
+     * A connection that failed is connected again when it is used next, selecting its database and
+     * authenticating like before. The connections to the other servers are not affected. If
+     * connecting fails, the next attempt is delayed by min_delay_ms, doubling with each failure up to
+     * max_delay_ms, and until then the calls to that server throw connection_error right away.
+     *
+     * Reading commands (GET, EXISTS, LRANGE, HGETALL, ...) are sent again up to retries times,
+     * waiting for the backoff in between, if the connection fails before their reply arrives. So
+     * they succeed when the server comes back quickly. Writes are never repeated, not even SET: the
+     * first attempt may have been applied, and repeating it could overwrite a newer value that
+     * another client wrote meanwhile. Requests of more than 64 KB and those in pipelines,
+     * transactions, batch operations and with auto pipelining are not repeated either. 0 retries
+     * disables it.
+     */
+    void set_reconnect(int min_delay_ms, int max_delay_ms = default_reconnect_max_ms,
+                       int retries = default_retries)
+    {
+      if (min_delay_ms <= 0 || max_delay_ms < min_delay_ms || retries < 0)
+        throw std::runtime_error("invalid reconnect backoff");
+      reconnect_min_ms_ = min_delay_ms;
+      reconnect_max_ms_ = max_delay_ms;
+      retries_ = retries;
+    }
+
+    /**
+     * Starts a thread that PINGs every server each interval_ms on a connection of its own and keeps
+     * track of the round trip times and failures. A PING fails if it is not answered within
+     * timeout_ms. After failure_threshold failures in a row the breaker of the server opens: the
+     * calls that send to it throw connection_error right away instead of waiting for a dead server,
+     * until a PING is answered again. Calls that already wait for a reply are bounded by
+     * set_timeout() only.
+     *
+     * @warning Must be called before the client is shared, i.e. while no other thread uses it.
+     */
+    void start_health_monitor(int interval_ms = default_probe_interval_ms,
+                              int timeout_ms = default_probe_timeout_ms,
+                              int failure_threshold = default_failure_threshold)
+    {
+      if (interval_ms <= 0 || timeout_ms <= 0 || failure_threshold <= 0)
+        throw std::runtime_error("invalid health monitor settings");
+      monitor_.reset();
+      monitor_.reset( new health_monitor_(connections_, interval_ms, timeout_ms, failure_threshold) );
+    }
+
+    void stop_health_monitor()
+    {
+      monitor_.reset();
+    }
+
+    /**
+     * Copies the state of each server, in the order of connections(), as seen by the health
+     * monitor. Empty if it was not started.
+     */
+    void health(std::vector<server_health> & out) const
+    {
+      out.clear();
+      if (monitor_)
+        monitor_->health(out);
+    }
+
+    /**
+     * Bounds the total time of all calls the current thread makes on a client while the object
+     * exists. A nested deadline can only shorten the one around it. Exceeding it throws
+     * timeout_error just like set_timeout().
+     *
+     *   {
+     *     redis::client::deadline d(c, boost::posix_time::milliseconds(50));
+     *     c.get("a");
+     *     c.get("b");
+     *   }
+     */
+    class deadline
+    {
+    public:
+      deadline(base_client & client, const boost::posix_time::time_duration & limit)
+      : client_(client)
+      {
+        boost::posix_time::ptime until = boost::posix_time::microsec_clock::universal_time() + limit;
+        boost::posix_time::ptime * current = client_.deadline_.get();
+        
+        if (current)
+        {
+          previous_ = *current;
+          *current = std::min(*current, until);
+        }
+        else
+          client_.deadline_.reset( new boost::posix_time::ptime(until) );
+      }
+      
+      ~deadline()
+      {
+        if (previous_.is_not_a_date_time())
+          client_.deadline_.reset();
+        else
+          *client_.deadline_ = previous_;
+      }
+      
+    private:
+      deadline(const deadline &);
+      deadline & operator=(const deadline &);
+      
+      base_client & client_;
+      boost::posix_time::ptime previous_;
+    };
+    
+    inline static string_type missing_value()
+    {
+      return REDIS_MISSING_VALUE;
+    }
+
+    enum datatype 
+    {
+      datatype_none,      // key doesn't exist
+      datatype_string,
+      datatype_list,
+      datatype_set,
+      datatype_zset,
+      datatype_hash,
+      datatype_unknown
+    };
+
+    int_type get_list(const string_type & key, string_vector & out)
+    {
+      return lrange(key, 0, -1, out);
+    }
+
+    void lrem_exact(const string_type & key,
+                    int_type count,
+                    const string_type & value)
+    { 
+      if (lrem(key, count, value) != count)
+        throw value_error("failed to remove exactly N elements from list");
+    }
+    enum range_specifier
+    {
+      exclude_min = 1 << 0,
+      exclude_max = 1 << 1
+    };
+
+    enum aggregate_type
+    {
+      aggregate_sum = 1 << 0,
+      aggregate_min = 1 << 1,
+      aggregate_max = 1 << 2
+    };
+
+    enum sort_order
+    {
+      sort_order_ascending,
+      sort_order_descending
+    };
+    
+    ~base_client()
+    {
+      BOOST_FOREACH(connection_data & con, connections_)
+      {
+        if (con.socket != ANET_ERR)
+          close(con.socket);
+      }
+      for (size_t i = 0; i < blocking_idle_.size(); ++i)
+      {
+        for (size_t j = 0; j < blocking_idle_[i].size(); ++j)
+          delete blocking_idle_[i][j];
+      }
+    }
+
+    const std::vector<connection_data> & connections() const
+    {
+      return connections_;
+    }
+    
+    void auth(const string_type & pass)
+    {
+      exclusive_ guard(*this);
+      if( connections_.size() > 1 )
+        throw std::runtime_error("feature is not available in cluster mode");
+
+      int socket = connections_[0].socket;
+      send_(socket, makecmd("AUTH") << pass);
+      recv_ok_reply_(socket);
+      password_ = pass;
+    }
+    
+    void set(const string_type & key,
+                          const string_type & value)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::set) << key << arg_ref(value));
+      recv_ok_reply_(socket);
+    }
+    
+    /**
+     * Sets the key to size bytes read from the stream. The value is sent in chunks of
+     * stream_chunk_size bytes, so memory usage does not depend on the size of the value.
+     * If the stream ends early the command is aborted by closing the connection before the value
+     * is complete, so the server discards it and the key keeps its old value. A value_error is
+     * thrown then and the connection is reestablished by the next command.
+     */
+    void set_stream(const string_type & key, std::istream & in, size_t size)
+    {
+      exclusive_ guard(*this);
+      int socket = get_socket(key);
+      
+      std::ostringstream header;
+      header << REDIS_PREFIX_MULTI_BULK_REPLY << 3 << REDIS_LBR
+             << REDIS_PREFIX_SINGLE_BULK_REPLY << 3 << REDIS_LBR << "SET" << REDIS_LBR
+             << REDIS_PREFIX_SINGLE_BULK_REPLY << key.size() << REDIS_LBR << key << REDIS_LBR
+             << REDIS_PREFIX_SINGLE_BULK_REPLY << size << REDIS_LBR;
+      send_(socket, header.str());
+      
+      std::vector<char> chunk( std::min(size, static_cast<size_t>(stream_chunk_size)) + 2 );
+      size_t left = size;
+      
+      while( left > 0 )
+      {
+        size_t n = std::min(left, static_cast<size_t>(stream_chunk_size));
+        in.read(&chunk[0], n);
+        if( static_cast<size_t>(in.gcount()) != n )
+        {
+          connection_data & con = connection_(socket);
+          ::shutdown(con.socket, SHUT_RDWR);
+          con.broken = true;
+          throw value_error("stream ended before the given size was read");
+        }
+        
+        left -= n;
+        if( left == 0 )
+        {
+          chunk[n++] = '\r';
+          chunk[n++] = '\n';
+        }
+        send_(socket, &chunk[0], n);
+      }
+      
+      if( size == 0 )
+        send_(socket, REDIS_LBR);
+      
+      recv_ok_reply_(socket);
+    }
+    
+    void mset( const string_vector & keys, const string_vector & values )
+    {
+      exclusive_ guard(*this);
+      assert( keys.size() == values.size() );
+
+      ok_reader read(*this);
+      chunks_<ok_reader> chunks(*this, read, "MSET");
+
+      for(size_t i=0; i < keys.size(); i++)
+      {
+        int socket = get_socket(keys[i]);
+        chunks.next(socket, keys[i].size() + values[i].size()) << keys[i] << arg_ref(values[i]);
+      }
+
+      chunks.finish();
+    }
+    
+    void mset( const string_pair_vector & key_value_pairs )
+    {
+      exclusive_ guard(*this);
+      ok_reader read(*this);
+      chunks_<ok_reader> chunks(*this, read, "MSET");
+      
+      for(size_t i=0; i < key_value_pairs.size(); i++)
+      {
+        const string_type & key = key_value_pairs[i].first;
+        const string_type & value = key_value_pairs[i].second;
+        
+        int socket = get_socket(key);
+        chunks.next(socket, key.size() + value.size()) << key << arg_ref(value);
+      }
+      
+      chunks.finish();
+    }
+
+  private:
+    struct msetex_reader
+    {
+      explicit msetex_reader(base_client & client)
+      : client(client)
+      {
+      }
+
+      // On each connection the reply of MSET precedes the replies of the EXPIRE commands
+      void operator()(int socket)
+      {
+        if (mset_pending.erase(socket))
+          client.recv_ok_reply_(socket);
+        client.recv_int_ok_reply_(socket);
+      }
+
+      base_client & client;
+      std::set<int> mset_pending;
+    };
+
+  public:
+    void msetex( const string_pair_vector & key_value_pairs, int_type seconds )
+    {
+      exclusive_ guard(*this);
+      std::map< int, boost::optional<makecmd> > mset_cmds;
+      std::vector<int> sockets( key_value_pairs.size() );
+      
+      for(size_t i=0; i < key_value_pairs.size(); i++)
+      {
+        const string_type & key = key_value_pairs[i].first;
+        const string_type & value = key_value_pairs[i].second;
+        
+        sockets[i] = get_socket(key);
+        boost::optional<makecmd> & cmd = mset_cmds[sockets[i]];
+        if(!cmd)
+          cmd = makecmd("MSET");
+        *cmd << key << arg_ref(value);
+      }
+      
+      msetex_reader read(*this);
+      typedef std::pair< int, boost::optional<makecmd> > sock_pair;
+      BOOST_FOREACH(const sock_pair & sp, mset_cmds)
+      {
+        send_(sp.first, *sp.second);
+        read.mset_pending.insert(sp.first);
+      }
+      
+      window_<msetex_reader> window(*this, read);
+      for(size_t i=0; i < key_value_pairs.size(); i++)
+        window.add(sockets[i], makecmd(prefix::expire) << key_value_pairs[i].first << seconds);
+      window.finish();
+    }
+    
+    string_type get(const string_type & key)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::get) << key);
+      return recv_bulk_reply_(socket);
+    }
+    
+    /**
+     * Receives the value of the key into out, reusing the capacity of out.
+     * @returns false (and leaves out untouched) if the key does not exist
+     */
+    bool get(const string_type & key, string_type & out)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::get) << key);
+      return recv_bulk_reply_(socket, out);
+    }
+    
+    /**
+     * Receives the value of the key into [buf, buf+cap). If the value does not fit, only the first cap
+     * bytes are stored.
+     * @returns the full size of the value or -1 if the key does not exist
+     */
+    int_type get(const string_type & key, char * buf, size_t cap)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::get) << key);
+      return recv_bulk_reply_(socket, buf, cap);
+    }
+    
+    /**
+     * Writes the value of the key to the stream in chunks of stream_chunk_size bytes, so memory
+     * usage does not depend on the size of the value.
+     * @returns false if the key does not exist
+     */
+    bool get_stream(const string_type & key, std::ostream & out)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::get) << key);
+      
+      int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_SINGLE_BULK_REPLY);
+      if (length == -1)
+        return false;
+      
+      std::vector<char> chunk( std::min(static_cast<size_t>(length), static_cast<size_t>(stream_chunk_size)) );
+      size_t left = length;
+      
+      while( left > 0 )
+      {
+        size_t n = std::min(left, chunk.size());
+        read_n(socket, &chunk[0], n);
+        out.write(&chunk[0], n);
+        left -= n;
+      }
+      
+      recv_bulk_reply_end_(socket);
+      return true;
+    }
+    
+    /**
+     * Calls visitor(const value_view &) with the value of the key, without copying it out of the
+     * receive buffer. The visitor must not use this client.
+     * @returns false (and does not call the visitor) if the key does not exist
+     */
+    template<typename VISITOR>
+    bool get(const string_type & key, VISITOR visitor)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::get) << key);
+      return recv_bulk_reply_view_(socket, visitor);
+    }
+    
+    string_type getset(const string_type & key, const string_type & value)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::getset) << key << arg_ref(value));
+      return recv_bulk_reply_(socket);
+    }
+
+  private:
+    // Positions of the requested keys in the input, per server. The replies of the chunks of a
+    // server arrive in order, so done is the position of the first key of the next reply.
+    struct connection_keys
+    {
+      connection_keys()
+      : done(0)
+      {
+      }
+
+      std::vector<size_t> indices;
+      size_t done;
+    };
+
+    struct mget_reader
+    {
+      mget_reader(base_client & client, string_vector & out)
+      : client(client), out(out)
+      {
+      }
+
+      void operator()(int socket)
+      {
+        connection_keys & con_keys = keys[socket];
+        string_vector cur_out;
+        client.recv_multi_bulk_reply_(socket, cur_out);
+
+        for(size_t i=0; i < cur_out.size(); i++)
+          out[con_keys.indices[con_keys.done + i]].swap(cur_out[i]);
+        con_keys.done += cur_out.size();
+      }
+
+      base_client & client;
+      string_vector & out;
+      std::map<int, connection_keys> keys;
+    };
+
+    template<typename VISITOR>
+    struct mget_view_reader
+    {
+      mget_view_reader(base_client & client, VISITOR & visitor)
+      : client(client), visitor(visitor)
+      {
+      }
+
+      void operator()(int socket)
+      {
+        connection_keys & con_keys = keys[socket];
+        indexed_visitor<VISITOR> v(visitor, con_keys.indices, con_keys.done);
+        con_keys.done += client.recv_multi_bulk_reply_view_(socket, v);
+      }
+
+      base_client & client;
+      VISITOR & visitor;
+      std::map<int, connection_keys> keys;
+    };
+
+    struct exec_reader
+    {
+      explicit exec_reader(base_client & client)
+      : client(client)
+      {
+      }
+
+      void operator()(int socket)
+      {
+        std::deque<command *> & cmds = pending[socket];
+        client.recv_generic_reply_(socket, cmds.front()->reply_);
+        cmds.pop_front();
+      }
+
+      base_client & client;
+      std::map< int, std::deque<command *> > pending;
+    };
+
+  public:
+    void exec(command & cmd)
+    {
+      int socket = get_socket(cmd.hash_key_);
+      request_ req(*this, socket, cmd.request_);
+      recv_generic_reply_(socket, cmd.reply_);
+    }
+
+    void exec(std::vector<command> & commands)
+    {
+      exclusive_ guard(*this);
+      exec_reader read(*this);
+      window_<exec_reader> window(*this, read);
+      
+      for(size_t i=0; i < commands.size(); i++)
+      {
+        int socket = get_socket( commands[i].hash_key_ );
+        read.pending[socket].push_back(&commands[i]);
+        window.add(socket, commands[i].request_);
+      }
+      
+      window.finish();
+    }
+    
+    void exec_transaction(std::vector<command> & commands)
+    {
+      exclusive_ guard(*this);
+      int cmd_socket = -1;
+      std::string cmd_str = makecmd("MULTI");
+      
+      for(size_t i=0; i < commands.size(); i++)
+      {
+        int socket = get_socket( commands[i].hash_key_ );
+        if( cmd_socket == -1 )
+          cmd_socket = socket;
+        else if( cmd_socket != socket )
+          throw std::runtime_error("calls in transaction map to different server!");
+           
+        cmd_str += commands[i].request_;
+      }
+
+      cmd_str += makecmd("EXEC");
+      
+      send_(cmd_socket, cmd_str);
+      recv_ok_reply_(cmd_socket); // MULTI => +OK
+      for(size_t i=0; i < commands.size(); i++)
+      {
+        std::string resp = recv_single_line_reply_(cmd_socket);
+        if( resp != "QUEUED" )
+          throw std::runtime_error("invalid state (expected 'QUEUED' in transaction but got '" + resp + "')");
+      }
+      if( read_line(cmd_socket)[0] != REDIS_PREFIX_MULTI_BULK_REPLY )
+        throw std::runtime_error("EXEC does not return a multi bulk reply");
+        
+      for(size_t i=0; i < commands.size(); i++)
+      {
+        recv_generic_reply_(cmd_socket, commands[i].reply_);
+      }
+    }
+    
+    void mget(const string_vector & keys, string_vector & out)
+    {
+      exclusive_ guard(*this);
+      out = string_vector( keys.size() );
+      mget_reader read(*this, out);
+      chunks_<mget_reader> chunks(*this, read, "MGET");
+      
+      for(size_t i=0; i < keys.size(); i++)
+      {
+        int socket = get_socket(keys[i]);
+        read.keys[socket].indices.push_back(i);
+        chunks.next(socket, keys[i].size()) << keys[i];
+      }
+      
+      chunks.finish();
+    }
+    
+    /**
+     * Calls visitor(size_t index, const value_view &) for every existing key, where index is the
+     * position of the key in keys. In cluster mode the calls are not ordered by index.
+     * The visitor must not use this client.
+     */
+    template<typename VISITOR>
+    void mget(const string_vector & keys, VISITOR visitor)
+    {
+      exclusive_ guard(*this);
+      mget_view_reader<VISITOR> read(*this, visitor);
+      chunks_< mget_view_reader<VISITOR> > chunks(*this, read, "MGET");
+      
+      for(size_t i=0; i < keys.size(); i++)
+      {
+        int socket = get_socket(keys[i]);
+        read.keys[socket].indices.push_back(i);
+        chunks.next(socket, keys[i].size()) << keys[i];
+      }
+      
+      chunks.finish();
+    }
+    
+    bool setnx(const string_type & key,
+                            const string_type & value)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::setnx) << key << arg_ref(value));
+      return recv_int_reply_(socket) == 1;
+    }
+    
+    // Not split into chunks, all keys are set in one atomic command
+    bool msetnx( const string_vector & keys, const string_vector & values )
+    {
+      exclusive_ guard(*this);
+      assert( keys.size() == values.size() );
+      
+      std::map< int, boost::optional<makecmd> > socket_commands;
+      
+      for(size_t i=0; i < keys.size(); i++)
+      {
+        int socket = get_socket(keys[i]);
+        boost::optional<makecmd> & cmd = socket_commands[socket];
+        if(!cmd)
+          cmd = makecmd("MSETNX");
+        *cmd << keys[i] << arg_ref(values[i]);
+      }
+
+      return msetnx_(socket_commands);
+    }
+    
+    bool msetnx( const string_pair_vector & key_value_pairs )
+    {
+      exclusive_ guard(*this);
+      std::map< int, boost::optional<makecmd> > socket_commands;
+      
+      for(size_t i=0; i < key_value_pairs.size(); i++)
+      {
+        int socket = get_socket(key_value_pairs[i].first);
+        boost::optional<makecmd> & cmd = socket_commands[socket];
+        if(!cmd)
+          cmd = makecmd("MSETNX");
+        *cmd << key_value_pairs[i].first << arg_ref(key_value_pairs[i].second);
+      }
+      
+      return msetnx_(socket_commands);
+    }
+    
+  private:
+    bool msetnx_(const std::map< int, boost::optional<makecmd> > & socket_commands)
+    {
+      if( socket_commands.size() > 1 )
+        throw std::runtime_error("feature is not available in cluster mode");
+      
+      if( socket_commands.empty() )
+        return true;
+      
+      int socket = socket_commands.begin()->first;
+      send_(socket, *socket_commands.begin()->second);
+      return recv_int_reply_(socket) == 1;
+    }
+    
+  public:
+    void setex(const string_type & key, const string_type & value, unsigned int secs)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd("SETEX") << key << secs << arg_ref(value));
+      recv_ok_reply_(socket);
+    }
+    
+    size_t append(const string_type & key, const string_type & value)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::append) << key << arg_ref(value));
+      int res = recv_int_reply_(socket);
+      if(res < 0)
+        throw protocol_error("expected value size");
+      
+      assert( static_cast<size_t>(res) >= value.size() );
+      return static_cast<size_t>(res);
+    }
+    
+    string_type substr(const string_type & key, int start, int end)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd("SUBSTR") << key << start << end);
+      return recv_bulk_reply_(socket);
+    }
+    
+    int_type incr(const string_type & key)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::incr) << key);
+      return recv_int_reply_(socket);
+    }
+
+    template<typename INT_TYPE>
+    INT_TYPE incr(const string_type & key)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::incr) << key);
+      return recv_int_reply_<INT_TYPE>(socket);
+    }
+    
+    int_type incrby(const string_type & key, int_type by)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::incrby) << key << by);
+      return recv_int_reply_(socket);
+    }
+    
+    template<typename INT_TYPE>
+    INT_TYPE incrby(const string_type & key, INT_TYPE by)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::incrby) << key << by);
+      return recv_int_reply_<INT_TYPE>(socket);
+    }
+    
+    int_type decr(const string_type & key)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::decr) << key);
+      return recv_int_reply_(socket);
+    }
+    
+    template<typename INT_TYPE>
+    INT_TYPE decr(const string_type & key)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::decr) << key);
+      return recv_int_reply_<INT_TYPE>(socket);
+    }
+    
+    int_type decrby(const string_type & key, int_type by)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::decrby) << key << by);
+      return recv_int_reply_(socket);
+    }
+    
+    template<typename INT_TYPE>
+    INT_TYPE decrby(const string_type & key, INT_TYPE by)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::decrby) << key << by);
+      return recv_int_reply_<INT_TYPE>(socket);
+    }
+    
+    bool exists(const string_type & key)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::exists) << key);
+      return recv_int_reply_(socket) == 1;
+    }
+    
+    bool del(const string_type & key)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::del) << key);
+      return recv_int_reply_(socket) != 0;
+    }
+
+    template<typename ITERATOR>
+    bool del(ITERATOR begin, ITERATOR end)
+    {
+      exclusive_ guard(*this);
+      int_reader read(*this);
+      chunks_<int_reader> chunks(*this, read, "DEL");
+      while( begin != end )
+      {
+        string_type key = *begin++;
+        chunks.next(get_socket(key), key.size()) << key;
+      }
+
+      chunks.finish();
+      return read.sum;
+    }
+    
+    datatype type(const string_type & key)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::type) << key);
+      std::string response = recv_single_line_reply_(socket);
+      
+      if(response == "none")   return datatype_none;
+      if(response == "string") return datatype_string;
+      if(response == "list")   return datatype_list;
+      if(response == "set")    return datatype_set;
+      if(response == "zset")   return datatype_zset;
+      if(response == "hash")   return datatype_hash;
+
+#ifndef NDEBUG
+      std::cerr << "Got unknown datatype name: " << response << std::endl;
+#endif // NDEBUG
+      
+      return datatype_unknown;
+    }
+    
+    /**
+     * Lazy version of keys() that iterates the keys of all servers one by one.
+     *
+     * @warning out refers to the client and blocks its use until it is iterated, see lazy_range.
+     */
+    int_type keys(const string_type & pattern, string_range & out)
+    {
+      boost::shared_ptr<exclusive_> guard( new exclusive_(*this) );
+      out.close();
+      std::vector<int> sockets;
+      try
+      {
+        BOOST_FOREACH(const connection_data & con, connections_)
+        {
+          send_(con.socket, makecmd("KEYS") << pattern);
+          sockets.push_back(con.socket);
+        }
+      }
+      catch(...)
+      {
+        // The replies of the servers that got the request are not read
+        for( size_t i = 0; i < sockets.size(); ++i )
+          connection_(sockets[i]).broken = true;
+        throw;
+      }
+      
+      out.open(this, sockets.begin(), sockets.end(), guard);
+      return out.size();
+    }
+    
+    int_type keys(const string_type & pattern, string_vector & out)
+    {
+      exclusive_ guard(*this);
+      BOOST_FOREACH(const connection_data & con, connections_)
+      {
+        send_(con.socket, makecmd("KEYS") << pattern);
+      }
+
+      int_type res = 0;
+      
+      std::vector<int> waiting = all_sockets_();
+      while( !waiting.empty() )
+        res += recv_multi_bulk_reply_(next_ready_(waiting), out);
+      
+      return res;
+    }
+    
+    string_type randomkey()
+    {      
+      int socket = connections_[0].socket;
+      if( connections_.size() > 1 )
+      {
+        /*
+         * Select a random server if there are more then one
+         */
+        
+        boost::mt19937 gen;
+        boost::posix_time::ptime now = boost::posix_time::microsec_clock::local_time();
+        boost::posix_time::ptime epoch( boost::gregorian::date(1970, 1, 1) );
+        gen.seed( (now-epoch).total_seconds() );
+        
+        boost::uniform_int<> dist(0, connections_.size()-1);
+        boost::variate_generator< boost::mt19937&, boost::uniform_int<> > die(gen, dist);
+        socket = connections_[die()].socket;
+      }
+      
+      request_ req(*this, socket, makecmd("RANDOMKEY"));
+      return recv_bulk_reply_(socket);
+    }
+    
+    /**
+     * @warning Not cluster save (the old name and the new one must be on the same redis server)
+     */
+    void rename(const string_type & old_name, const string_type & new_name)
+    {
+      exclusive_ guard(*this);
+      int source_socket = get_socket(old_name);
+      int destin_socket = get_socket(new_name);
+      if( source_socket != destin_socket )
+      {
+        switch( type(old_name) )
+        {
+          case datatype_none:      // key doesn't exist
+            return;
+          case datatype_string:
+            set(new_name, get(old_name));
+            break;
+          case datatype_list:
+          {
+            string_vector content;
+            lrange(old_name, 0, -1, content);
+            del(new_name);
+            BOOST_FOREACH(const string_type & val, content)
+            {
+              rpush(new_name, val);
+            }
+            break;
+          }
+          case datatype_set:
+          {
+            string_set content;
+            smembers(old_name, content);
+            del(new_name);
+            BOOST_FOREACH(const string_type & val, content)
+            {
+              sadd(new_name, val);
+            }
+            break;
+          }
+          case datatype_zset:
+          case datatype_hash:
+          case datatype_unknown:
+          default:
+            throw std::runtime_error("renaming is not supported for this datatype in cluster mode");
+        }
+        del(old_name);
+        return;
+      }
+
+      send_(source_socket, makecmd("RENAME") << old_name << new_name);
+      recv_ok_reply_(source_socket);
+    }
+    
+    /**
+     * @warning Not cluster save (the old name and the new one must be on the same redis server)
+     */
+    bool renamenx(const string_type & old_name, const string_type & new_name)
+    {
+      int source_socket = get_socket(old_name);
+      int destin_socket = get_socket(new_name);
+      
+      if( source_socket != destin_socket )
+      {
+        if( exists(new_name) )
+          return false;
+        rename(old_name, new_name);
+        return true;
+      }
+      
+      request_ req(*this, source_socket, makecmd("RENAMENX") << old_name << new_name);
+      return recv_int_reply_(source_socket) == 1;
+    }
+
+    /**
+     * @returns the number of keys in the currently selected database. In cluster mode the number
+     * of keys in all currently selected databases is returned.
+     */
+    int_type dbsize()
+    {
+      exclusive_ guard(*this);
+      int_type val = 0;
+      
+      BOOST_FOREACH(const connection_data & con, connections_)
+      {
+        send_(con.socket, makecmd("DBSIZE"));
+      }
+      
+      std::vector<int> waiting = all_sockets_();
+      while( !waiting.empty() )
+        val += recv_int_reply_( next_ready_(waiting) );
+      
+      return val;
+    }
+
+    /**
+     * @returns the number of keys in the currently selected database with the given connection.
+     */
+    int_type dbsize(const connection_data & con)
+    {
+      request_ req(*this, con.socket, makecmd("DBSIZE"));
+      return recv_int_reply_(con.socket);
+    }
+    
+    void expire(const string_type & key, unsigned int secs)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::expire) << key << secs);
+      recv_int_ok_reply_(socket);
+    }
+    
+    int ttl(const string_type & key)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::ttl) << key);
+      return recv_int_reply_(socket);
+    }
+    
+    int_type rpush(const string_type & key,
+                            const string_type & value)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::rpush) << key << arg_ref(value));
+      return recv_int_reply_(socket);
+    }
+    
+    int_type lpush(const string_type & key,
+                            const string_type & value)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::lpush) << key << arg_ref(value));
+      return recv_int_reply_(socket);
+    }
+    
+    // Appends the values in order with variadic RPUSH commands and returns the new length of the list
+    template<typename ITERATOR>
+    int_type rpush(const string_type & key, ITERATOR begin, ITERATOR end)
+    {
+      if(begin == end)
+        return llen(key);
+      return members_("RPUSH", key, begin, end).last;
+    }
+    
+    // Prepends the values one after the other, so the last one ends up at the head of the list.
+    // Returns the new length of the list.
+    template<typename ITERATOR>
+    int_type lpush(const string_type & key, ITERATOR begin, ITERATOR end)
+    {
+      if(begin == end)
+        return llen(key);
+      return members_("LPUSH", key, begin, end).last;
+    }
+    
+    int_type llen(const string_type & key)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::llen) << key);
+      return recv_int_reply_(socket);
+    }
+    
+    int_type lrange(const string_type & key,
+                    int_type start,
+                    int_type end,
+                    string_vector & out)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd("LRANGE") << key << start << end);
+      return recv_multi_bulk_reply_(socket, out);
+    }
+    
+    /**
+     * Lazy version of lrange() that parses the elements off the socket while out is iterated.
+     *
+     * @warning out refers to the client and blocks its use until it is iterated, see lazy_range.
+     */
+    int_type lrange(const string_type & key,
+                    int_type start,
+                    int_type end,
+                    string_range & out)
+    {
+      boost::shared_ptr<exclusive_> guard( new exclusive_(*this) );
+      out.close();
+      int socket = get_socket(key);
+      send_(socket, makecmd("LRANGE") << key << start << end);
+      out.open(this, &socket, &socket + 1, guard);
+      return out.size();
+    }
+    
+    /**
+     * Calls visitor(const value_view &) for every element in the range, without copying them out
+     * of the receive buffer. The visitor must not use this client.
+     */
+    template<typename VISITOR>
+    int_type lrange(const string_type & key,
+                    int_type start,
+                    int_type end,
+                    VISITOR visitor)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd("LRANGE") << key << start << end);
+      element_visitor<VISITOR> v(visitor);
+      return recv_multi_bulk_reply_view_(socket, v);
+    }
+    
+    void ltrim(const string_type & key,
+                            int_type start,
+                            int_type end)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd("LTRIM") << key << start << end);
+      recv_ok_reply_(socket);
+    }
+    
+    string_type lindex(const string_type & key,
+                                                 int_type index)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::lindex) << key << index);
+      return recv_bulk_reply_(socket);
+    }
+    
+    void lset(const string_type & key, int_type index, const string_type & value)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd("LSET") << key << index << arg_ref(value));
+      recv_ok_reply_(socket);
+    }
+    
+    int_type lrem(const string_type & key, int_type count, const string_type & value)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd("LREM") << key << count << value);
+      return recv_int_reply_(socket);
+    }
+    
+    string_type lpop(const string_type & key)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::lpop) << key);
+      return recv_bulk_reply_(socket);
+    }
+    
+    string_type rpop(const string_type & key)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::rpop) << key);
+      return recv_bulk_reply_(socket);
+    }
+
+    /**
+     * @warning Not cluster save (all keys must be on the same redis server)
+     */
+    string_pair blpop(const string_vector & keys, int_type timeout_seconds = 0)
+    {
+      int socket = get_socket(keys);
+      if(socket == -1)
+        // How to do in cluster mode? Is reinserting of to much poped values a solution?
+        throw std::runtime_error("feature is not available in cluster mode");
+      
+      if (auto_pipelining_)
+      {
+        blocking_ dedicated(*this, socket);
+        string_pair res = dedicated->blpop(keys, timeout_seconds);
+        dedicated.release();
+        return res;
+      }
+      
+      request_ req(*this, socket, makecmd("BLPOP") << keys << timeout_seconds);
+      string_vector sv;
+      try
+      {
+        recv_multi_bulk_reply_(socket, sv);
+      }
+      catch(key_error & e)
+      {
+        assert(timeout_seconds > 0);
+        throw timeout_error("could not pop value in time");
+      }
+      if(sv.size() == 2)
+        return make_pair( sv[0], sv[1] );
+      else
+        return make_pair( "", missing_value() );
+    }
+
+    string_type blpop(const string_type & key, int_type timeout_seconds = 0)
+    {
+      int socket = get_socket(key);
+      if(socket == -1)
+        // How to do in cluster mode? Is reinserting of to much poped values a solution?
+        throw std::runtime_error("feature is not available in cluster mode");
+      
+      if (auto_pipelining_)
+      {
+        blocking_ dedicated(*this, socket);
+        string_type res = dedicated->blpop(key, timeout_seconds);
+        dedicated.release();
+        return res;
+      }
+      
+      request_ req(*this, socket, makecmd("BLPOP") << key << timeout_seconds);
+      string_vector sv;
+      try
+      {
+        recv_multi_bulk_reply_(socket, sv);
+      }
+      catch(key_error & e)
+      {
+        assert(timeout_seconds > 0);
+        return missing_value(); // should we throw a timeout_error?
+                                // we set a timeout so we expect that this can happen
+      }
+      if(sv.size() == 2)
+      {
+        assert(key == sv[0]);
+        return sv[1];
+      }
+      else
+        return missing_value();
+    }
+    
+    /**
+     * @warning Not cluster save (all keys must be on the same redis server)
+     */
+    string_pair brpop(const string_vector & keys, int_type timeout_seconds)
+    {
+      int socket = get_socket(keys);
+      makecmd m("BRPOP");
+      for(size_t i=0; i < keys.size(); i++)
+        m << keys[i];
+      m << timeout_seconds;
+      
+      if (auto_pipelining_)
+      {
+        blocking_ dedicated(*this, socket);
+        string_pair res = dedicated->brpop(keys, timeout_seconds);
+        dedicated.release();
+        return res;
+      }
+      
+      request_ req(*this, socket, m);
+      string_vector sv;
+      try
+      {
+        recv_multi_bulk_reply_(socket, sv);
+      }
+      catch(key_error & e)
+      {
+        assert(timeout_seconds > 0);
+        return make_pair( string_type(), missing_value() ); // should we throw a timeout_error?
+                                // we set a timeout so we expect that this can happen
+      }
+      if(sv.size() == 2)
+        return make_pair( sv[0], sv[1] );
+      else
+        return make_pair( string_type(), missing_value() );
+    }
+    
+    string_type brpop(const string_type & key, int_type timeout_seconds)
+    {
+      int socket = get_socket(key);
+      
+      if (auto_pipelining_)
+      {
+        blocking_ dedicated(*this, socket);
+        string_type res = dedicated->brpop(key, timeout_seconds);
+        dedicated.release();
+        return res;
+      }
+      
+      request_ req(*this, socket, makecmd("BRPOP") << key << timeout_seconds);
+      string_vector sv;
+      try
+      {
+        recv_multi_bulk_reply_(socket, sv);
+      }
+      catch(key_error & e)
+      {
+        assert(timeout_seconds > 0);
+        return missing_value(); // should we throw a timeout_error?
+                                // we set a timeout so we expect that this can happen
+      }
+      if(sv.size() == 2)
+      {
+        assert(key == sv[0]);
+        return sv[1];
+      }
+      else
+        return missing_value();
+    }
+    
+  private:
+    // Sends "name key member..." commands for the members of the range, split by chunks_
+    template<typename ITERATOR>
+    int_reader members_(const char * name, const string_type & key, ITERATOR begin, ITERATOR end)
+    {
+      exclusive_ guard(*this);
+      int_reader read(*this);
+      chunks_<int_reader> chunks(*this, read, name, &key);
+      int socket = get_socket(key);
+      
+      for(; begin != end; ++begin)
+      {
+        const string_type & member = *begin;
+        chunks.next(socket, member.size()) << member;
+      }
+      
+      chunks.finish();
+      return read;
+    }
+    
+  public:
+    bool sadd(const string_type & key,
+                           const string_type & value)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::sadd) << key << value);
+      return recv_int_reply_(socket) == 1;
+    }
+
+    // Adds the members with variadic SADD commands of at most chunk_keys() members each
+    // and returns the number of members that were not in the set yet.
+    template<typename ITERATOR>
+    int_type sadd(const string_type & key, ITERATOR begin, ITERATOR end)
+    {
+      return members_("SADD", key, begin, end).sum;
+    }
+    
+    void srem(const string_type & key,
+                           const string_type & value)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::srem) << key << value);
+      recv_int_ok_reply_(socket);
+    }
+    
+    // Returns the number of members that were removed
+    template<typename ITERATOR>
+    int_type srem(const string_type & key, ITERATOR begin, ITERATOR end)
+    {
+      return members_("SREM", key, begin, end).sum;
+    }
+    
+    string_type spop(const string_type & key)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd("SPOP") << key);
+      return recv_bulk_reply_(socket);
+    }
+    
+    void smove(const string_type & srckey, const string_type & dstkey, const string_type & member)
+    {
+      int src_socket = get_socket(srckey);
+      int dst_socket = get_socket(dstkey);
+      if(dst_socket != src_socket)
+      {
+        srem(srckey, member);
+        sadd(dstkey, member);
+        return;
+      }
+        
+      request_ req(*this, src_socket, makecmd("SMOVE") << srckey << dstkey << member);
+      recv_int_ok_reply_(src_socket);
+    }
+    
+    int_type scard(const string_type & key)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::scard) << key);
+      return recv_int_reply_(socket);
+    }
+    
+    bool sismember(const string_type & key,
+                                const string_type & value)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::sismember) << key << value);
+      return recv_int_reply_(socket) == 1;
+    }
+
+    /**
+     * @returns the intersection between the Sets stored at key1, key2, ..., keyN
+     * @warning Not cluster save (all keys must be on the same redis server)
+     */
+    int_type sinter(const string_vector & keys, string_set & out)
+    {
+      exclusive_ guard(*this);
+      std::map<int, string_vector> per_server;
+      BOOST_FOREACH(const string_type & key, keys)
+      {
+        per_server[get_socket(key)].push_back(key);
+      }
+
+      size_t i = 0;
+
+      typedef std::pair<const int, string_vector> per_server_pair;
+      BOOST_FOREACH(const per_server_pair & p, per_server)
+      {
+        send_(p.first, makecmd("SINTER") << p.second);
+      }
+      
+      std::vector<int> waiting = sockets_of_(per_server);
+      while( !waiting.empty() )
+      {
+        string_set cur;
+        recv_multi_bulk_reply_(next_ready_(waiting), cur);
+        if(i > 0)
+        {
+          string_set prev = out;
+          out.clear();
+          
+          std::set_intersection(prev.begin(), prev.end(), cur.begin(), cur.end(), std::inserter(out, out.end()));
+        }
+        else
+        {
+          out = cur;
+        }
+        i++;
+      }
+  
+      return out.size();
+    }
+
+    /**
+     * @warning Not cluster save (all keys must be on the same redis server)
+     */
+    int_type sinterstore(const string_type & dstkey, const string_vector & keys)
+    {
+      exclusive_ guard(*this);
+      int socket = get_socket(dstkey);
+      int source_sockets = get_socket(keys);
+      if(socket != source_sockets)
+      {
+        std::cerr << 0 << std::endl;
+        string_set content;
+        std::cerr << 1 << std::endl;
+        sinter(keys, content);
+        std::cerr << 2 << std::endl;
+        del(dstkey);
+        std::cerr << 3 << std::endl;
+        BOOST_FOREACH(const string_type & val, content)
+        {
+          std::cerr << 4 << std::endl;
+          sadd(dstkey, val);
+        } 
+        std::cerr << 5 << std::endl;
+        return content.size();
+      }
+      
+      send_(socket, makecmd("SINTERSTORE") << dstkey << keys);
+      return recv_int_reply_(socket);
+    }
+    
+    int_type sunion(const string_vector & keys, string_set & out)
+    {
+      exclusive_ guard(*this);
+      int socket = get_socket(keys);
+      if(socket == -1)
+      {
+        std::map< int, boost::optional<makecmd> > per_socket_keys;
+        BOOST_FOREACH(const string_type & key, keys)
+        {
+          boost::optional<makecmd> & optCmd = per_socket_keys[ get_socket(key) ];
+          if( !optCmd )
+            optCmd = makecmd("SUNION");
+          *optCmd << key;
+        }
+
+        typedef std::pair< const int, boost::optional<makecmd> > per_sock_pair;
+        BOOST_FOREACH(const per_sock_pair & p, per_socket_keys)
+        {
+          send_(p.first, *p.second);
+        }
+        
+        std::vector<int> waiting = sockets_of_(per_socket_keys);
+        while( !waiting.empty() )
+          recv_multi_bulk_reply_(next_ready_(waiting), out);
+        return out.size();
+      }
+      
+      send_(socket, makecmd("SUNION") << keys);
+      return recv_multi_bulk_reply_(socket, out);
+    }
+    
+    int_type sunionstore(const string_type & dstkey,
+                                                   const string_vector & keys)
+    {
+      int socket = get_socket(dstkey);
+      int source_sockets = get_socket(keys);
+      if(socket != source_sockets)
+      {
+        string_set content;
+        sunion(keys, content);
+        del(dstkey);
+        return sadd(dstkey, content.begin(), content.end());
+      }
+      
+      request_ req(*this, socket, makecmd("SUNIONSTORE") << dstkey << keys);
+      return recv_int_reply_(socket);
+    }
+    
+    int_type sdiff(const string_vector & keys, string_set & out)
+    {
+      int socket = get_socket(keys);
+      request_ req(*this, socket, makecmd("SDIFF") << keys);
+      return recv_multi_bulk_reply_(socket, out);
+    }
+    
+    int_type sdiffstore(const string_type & dstkey, const string_vector & keys)
+    {
+      int socket = get_socket(dstkey);
+      int source_sockets = get_socket(keys);
+      if(socket != source_sockets)
+        throw std::runtime_error("not available in cluster mode");
+      
+      request_ req(*this, socket, makecmd("SDIFFSTORE") << dstkey << keys);
+      return recv_int_reply_(socket);
+    }
+    
+    int_type smembers(const string_type & key, string_set & out)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd("SMEMBERS") << key);
+      return recv_multi_bulk_reply_(socket, out);
+    }
+    
+    /**
+     * Lazy version of smembers() that parses the members off the socket while out is iterated.
+     *
+     * @warning out refers to the client and blocks its use until it is iterated, see lazy_range.
+     */
+    int_type smembers(const string_type & key, string_range & out)
+    {
+      boost::shared_ptr<exclusive_> guard( new exclusive_(*this) );
+      out.close();
+      int socket = get_socket(key);
+      send_(socket, makecmd("SMEMBERS") << key);
+      out.open(this, &socket, &socket + 1, guard);
+      return out.size();
+    }
+    
+    string_type srandmember(const string_type & key)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd("SPOP") << key);
+      return recv_bulk_reply_(socket);
+    }
+    
+    void zadd(const string_type & key, double score, const string_type & member)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::zadd) << key << score << member);
+      recv_int_ok_reply_(socket);
+    }
+    
+    void zadd(const string_type & key, const string_score_pair & value)
+    {
+      zadd(key, value.second, value.first);
+    }
+    
+    // Adds the string_score_pairs of the range with variadic ZADD commands and returns the
+    // number of members that were not in the sorted set yet.
+    template<typename ITERATOR>
+    int_type zadd(const string_type & key, ITERATOR begin, ITERATOR end)
+    {
+      exclusive_ guard(*this);
+      int_reader read(*this);
+      chunks_<int_reader> chunks(*this, read, "ZADD", &key);
+      int socket = get_socket(key);
+      
+      for(; begin != end; ++begin)
+      {
+        const string_score_pair & value = *begin;
+        chunks.next(socket, value.first.size()) << value.second << value.first;
+      }
+      
+      chunks.finish();
+      return read.sum;
+    }
+    
+    void zrem(const string_type & key, const string_type & member)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::zrem) << key << member);
+      recv_int_ok_reply_(socket);
+    }
+    
+    double zincrby(const string_type & key, const string_type & member, double increment)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::zincrby) << key << increment << member);
+      return boost::lexical_cast<double>( recv_bulk_reply_(socket) );
+    }
+    
+    int_type zrank(const string_type & key, const string_type & member)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd("ZRANK") << key << member);
+      return recv_int_reply_(socket);
+    }
+    
+    int_type zrevrank(const string_type & key, const string_type & value)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd("ZREVRANK") << key << value);
+      return boost::lexical_cast<int_type>( recv_int_reply_(socket) );
+    }
+    
+    void zrange(const string_type & key, int_type start, int_type end, string_vector & out)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd("ZRANGE") << key << start << end);
+      recv_multi_bulk_reply_(socket, out);
     }
 
-    template<typename INT_TYPE>
-    INT_TYPE incr(const string_type & key)
+  private:
+    void convert(const string_vector & in, string_score_vector & out)
+    {
+      assert( in.size() % 2 == 0 );
+
+      for(size_t i=0; i < in.size(); i += 2)
+      {
+        const std::string & value = in[i];
+        const std::string & str_score = in[i+1];
+        double score = boost::lexical_cast<double>(str_score);
+        out.push_back( make_pair(value, score) );
+      }
+    }
+    
+
+  public:
+    
+    void zrange(const string_type & key, int_type start, int_type end, string_score_vector & out)
     {
       int socket = get_socket(key);
-      send_(socket, makecmd("INCR") << key);
-      return recv_int_reply_<INT_TYPE>(socket);
+      request_ req(*this, socket, makecmd("ZRANGE") << key << start << end << "WITHSCORES");
+      string_vector res;
+      recv_multi_bulk_reply_(socket, res);
+      convert(res, out);
     }
     
-    int_type incrby(const string_type & key, int_type by)
+    void zrevrange(const string_type & key, int_type start, int_type end, string_vector & out)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd("ZREVRANGE") << key << start << end);
+      recv_multi_bulk_reply_(socket, out);
+    }
+    
+    void zrevrange(const string_type & key, int_type start, int_type end, string_score_vector & out)
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd("ZREVRANGE") << key << start << end << "WITHSCORES");
+      string_vector res;
+      recv_multi_bulk_reply_(socket, res);
+      convert(res, out);
+    }
+
+  protected:
+    void zrangebyscore_base(bool withscores, const string_type & key, double min, double max, string_vector & out, int_type offset, int_type max_count, int range_modification)
+    {
+      int socket = get_socket(key);
+      std::string min_str, max_str;
+      if( range_modification & exclude_min )
+        min_str = "(";
+      if( range_modification & exclude_max )
+        max_str = "(";
+      
+      min_str += boost::lexical_cast<std::string>(min);
+      max_str += boost::lexical_cast<std::string>(max);
+      
+      makecmd m("ZRANGEBYSCORE");
+      m << key << min_str << max_str;
+        
+      if(max_count != -1 || offset > 0)
+      {
+        std::cerr << "Adding limit: " << offset << " " << max_count << std::endl;
+        m << "LIMIT" << offset << max_count;
+      }
+        
+      request_ req(*this, socket, m);
+      recv_multi_bulk_reply_(socket, out);
+    }
+    
+  public:
+    void zrangebyscore(const string_type & key, double min, double max, string_vector & out, int_type offset = 0, int_type max_count = -1, int range_modification = 0)
+    {
+      zrangebyscore_base(false, key, min, max, out, offset, max_count, range_modification);
+    }
+    
+    void zrangebyscore(const string_type & key, double min, double max, string_score_vector & out, int_type offset = 0, int_type max_count = -1, int range_modification = 0)
+    {
+      string_vector res;
+      zrangebyscore_base(true, key, min, max, res, offset, max_count, range_modification);
+      convert(res, out);
+    }
+    
+    int_type zcount(const string_type & key, double min, double max, int range_modification = 0)
+    {
+      int socket = get_socket(key);
+      std::string min_str, max_str;
+      if( range_modification & exclude_min )
+        min_str = "(";
+      if( range_modification & exclude_max )
+        max_str = "(";
+      
+      min_str += boost::lexical_cast<std::string>(min);
+      max_str += boost::lexical_cast<std::string>(max);
+      
+      request_ req(*this, socket, makecmd("ZCOUNT") << key << min_str << max_str);
+      return recv_int_reply_(socket);
+    }
+    
+    int_type zremrangebyrank( const string_type & key, int_type start, int_type end )
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd("ZREMRANGEBYRANK") << key << start << end);
+      return recv_int_reply_(socket);
+    }
+    
+    int_type zremrangebyscore( const string_type& key, double min, double max )
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd("ZREMRANGEBYSCORE") << key << min << max);
+      return recv_int_reply_(socket);
+    }
+    
+    int_type zcard( const string_type & key )
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::zcard) << key);
+      return recv_int_reply_(socket);
+    }
+    
+    double zscore( const string_type& key, const string_type& element )
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::zscore) << key << element);
+      return boost::lexical_cast<double>( recv_bulk_reply_(socket) );
+    }
+    
+    int_type zunionstore( const string_type & dstkey, const string_vector & keys, const std::vector<double> & weights = std::vector<double>(), aggregate_type aggragate = aggregate_sum )
+    {
+      int dst_socket = get_socket(dstkey);
+      int socket = get_socket(keys);
+      if(socket != dst_socket)
+        throw std::runtime_error("feature is not available in cluster mode");
+      
+      makecmd m("ZUNIONSTORE");
+      m << dstkey << keys.size() << keys;
+      
+      if( weights.size() > 0 )
+      {
+        assert(keys.size() == weights.size());
+        m << "WEIGHTS" << weights;
+      }
+      
+      m << "AGGREGATE";
+      switch(aggragate)
+      {
+        case aggregate_sum:
+          m << "SUM";
+          break;
+        case aggregate_min:
+          m << "MIN";
+          break;
+        case aggregate_max:
+          m << "MAX";
+          break;
+        default:
+          assert(false);
+      }
+      
+      request_ req(*this, socket, m);
+      return recv_int_reply_(socket);
+    }
+    
+    int_type zinterstore(const string_type & dstkey, const string_vector & keys, const std::vector<double> & weights = std::vector<double>(), aggregate_type aggragate = aggregate_sum )
+    {
+      int dst_socket = get_socket(dstkey);
+      int socket = get_socket(keys);
+      if(socket != dst_socket)
+        throw std::runtime_error("feature is not available in cluster mode");
+      
+      makecmd m("ZINTERSTORE");
+      m << dstkey << keys.size() << keys;
+      if( weights.size() > 0 )
+      {
+        assert(keys.size() == weights.size());
+        m << "WEIGHTS" << weights;
+      }
+      
+      m << "AGGREGATE";
+      switch(aggragate)
+      {
+        case aggregate_sum:
+          m << "SUM";
+          break;
+        case aggregate_min:
+          m << "MIN";
+          break;
+        case aggregate_max:
+          m << "MAX";
+          break;
+        default:
+          assert(false);
+      }
+      
+      request_ req(*this, socket, m);
+      return recv_int_reply_(socket);
+    }
+    
+    bool hset( const string_type & key, const string_type & field, const string_type & value )
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::hset) << key << field << arg_ref(value));
+      return recv_int_reply_(socket) == 1;
+    }
+    
+    string_type hget( const string_type & key, const string_type & field )
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::hget) << key << field);
+      return recv_bulk_reply_(socket);
+    }
+    
+    bool hsetnx( const string_type & key, const string_type & field, const string_type & value )
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::hsetnx) << key << field << arg_ref(value));
+      return recv_int_reply_(socket) == 1;
+    }
+    
+    void hmset( const string_type & key, const string_vector & fields, const string_vector& values )
+    {
+      int socket = get_socket(key);
+      makecmd m("HMSET");
+      m << key;
+      assert( fields.size() == values.size() );
+      
+      for(size_t i=0; i < fields.size(); i++)
+        m << fields[i] << arg_ref(values[i]);
+      
+      request_ req(*this, socket, m);
+      recv_ok_reply_(socket);
+    }
+    
+    void hmset( const string_type & key, const string_pair_vector & field_value_pairs )
+    {
+      int socket = get_socket(key);
+      makecmd m("HMSET");
+      m << key;
+      
+      for(size_t i=0; i < field_value_pairs.size(); i++)
+        m << field_value_pairs[i].first << arg_ref(field_value_pairs[i].second);
+      
+      request_ req(*this, socket, m);
+      recv_ok_reply_(socket);
+    }
+    
+    void hmget( const string_type & key, const string_vector & fields, string_vector & out)
+    {
+      int socket = get_socket(key);
+      makecmd m("HMGET");
+      m << key;
+      
+      for(size_t i=0; i < fields.size(); i++)
+        m << fields[i];
+
+      request_ req(*this, socket, m);
+      recv_multi_bulk_reply_(socket, out);
+    }
+    
+    int_type hincrby( const string_type & key, const string_type & field, int_type by )
+    {
+      int socket = get_socket(key);
+      request_ req(*this, socket, makecmd(prefix::hincrby) << key << field << by);
+      return recv_int_reply_(socket);
+    }
+    
+    bool hexists( const string_type & key, const string_type & field )
     {
       int socket = get_socket(key);
-      send_(socket, makecmd("INCRBY") << key << by);
-      return recv_int_reply_(socket);
+      request_ req(*this, socket, makecmd(prefix::hexists) << key << field);
+      return recv_int_reply_(socket) == 1;
     }
     
-    template<typename INT_TYPE>
-    INT_TYPE incrby(const string_type & key, INT_TYPE by)
+    bool hdel( const string_type& key, const string_type& field )
     {
       int socket = get_socket(key);
-      send_(socket, makecmd("INCRBY") << key << by);
-      return recv_int_reply_<INT_TYPE>(socket);
+      request_ req(*this, socket, makecmd(prefix::hdel) << key << field);
+      return recv_int_reply_(socket) == 1;
     }
     
-    int_type decr(const string_type & key)
+    // Returns the number of fields that were removed
+    template<typename ITERATOR>
+    int_type hdel( const string_type & key, ITERATOR begin, ITERATOR end )
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("DECR") << key);
-      return recv_int_reply_(socket);
+      return members_("HDEL", key, begin, end).sum;
     }
     
-    template<typename INT_TYPE>
-    INT_TYPE decr(const string_type & key)
+    int_type hlen( const string_type & key )
     {
       int socket = get_socket(key);
-      send_(socket, makecmd("DECR") << key);
-      return recv_int_reply_<INT_TYPE>(socket);
+      request_ req(*this, socket, makecmd(prefix::hlen) << key);
+      return recv_int_reply_(socket);
     }
     
-    int_type decrby(const string_type & key, int_type by)
+    void hkeys( const string_type & key, string_vector & out )
     {
       int socket = get_socket(key);
-      send_(socket, makecmd("DECRBY") << key << by);
-      return recv_int_reply_(socket);
+      request_ req(*this, socket, makecmd("HKEYS") << key);
+      recv_multi_bulk_reply_(socket, out);
     }
     
-    template<typename INT_TYPE>
-    INT_TYPE decrby(const string_type & key, INT_TYPE by)
+    void hvals( const string_type & key, string_vector & out )
     {
       int socket = get_socket(key);
-      send_(socket, makecmd("DECRBY") << key << by);
-      return recv_int_reply_<INT_TYPE>(socket);
+      request_ req(*this, socket, makecmd("HVALS") << key);
+      recv_multi_bulk_reply_(socket, out);
     }
     
-    bool exists(const string_type & key)
+    void hgetall( const string_type & key, string_pair_vector & out )
     {
       int socket = get_socket(key);
-      send_(socket, makecmd("EXISTS") << key);
-      return recv_int_reply_(socket) == 1;
+      request_ req(*this, socket, makecmd("HGETALL") << key);
+      string_vector s;
+      recv_multi_bulk_reply_(socket, s);
+      to_pairs_(s, out);
     }
     
-    bool del(const string_type & key)
+    /**
+     * Lazy version of hgetall() that parses the fields and values off the socket while out is iterated.
+     *
+     * @warning out refers to the client and blocks its use until it is iterated, see lazy_range.
+     */
+    int_type hgetall( const string_type & key, string_pair_range & out )
     {
+      boost::shared_ptr<exclusive_> guard( new exclusive_(*this) );
+      out.close();
       int socket = get_socket(key);
-      send_(socket, makecmd("DEL") << key);
-      return recv_int_reply_(socket) != 0;
+      send_(socket, makecmd("HGETALL") << key);
+      out.open(this, &socket, &socket + 1, guard);
+      return out.size();
     }
-
-    template<typename ITERATOR>
-    bool del(ITERATOR begin, ITERATOR end)
+    
+    void select(int_type dbindex)
     {
-      std::map<int, string_vector> sock_key_map;
-      while( begin != end )
+      exclusive_ guard(*this);
+      std::vector<int> selected;
+      BOOST_FOREACH(connection_data & con, connections_)
       {
-        string_type key = *begin++;
-        sock_key_map[ get_socket(key) ].push_back(key);
+        // Connections that are not (or no longer) connected select the database when they connect
+        if (con.broken)
+          continue;
+        send_(con.socket, makecmd("SELECT") << dbindex);
+        selected.push_back(con.socket);
       }
-
-      typedef std::pair<const int, string_vector> sock_key_pair;
-      BOOST_FOREACH(const sock_key_pair & p, sock_key_map)
+      
+      for (size_t i = 0; i < selected.size(); ++i)
+        recv_ok_reply_(selected[i]);
+      
+      BOOST_FOREACH(connection_data & con, connections_)
       {
-        send_(p.first, makecmd("DEL") << p.second);
+        con.dbindex = dbindex;
       }
-
-      int_type res =  false;
-
-      BOOST_FOREACH(const sock_key_pair & p, sock_key_map)
+    }
+    
+    void select(int_type dbindex, const connection_data & con)
+    {
+      exclusive_ guard(*this);
+      int socket = con.socket;
+      send_(socket, makecmd("SELECT") << dbindex);
+      recv_ok_reply_(socket);
+      BOOST_FOREACH(connection_data & cur_con, connections_)
       {
-        res += recv_int_reply_(p.first);
+        if( cur_con == con )
+          cur_con.dbindex = dbindex;
       }
-
-      return res;
     }
     
-    datatype type(const string_type & key)
+    void move(const string_type & key,
+                           int_type dbindex)
     {
       int socket = get_socket(key);
-      send_(socket, makecmd("TYPE") << key);
-      std::string response = recv_single_line_reply_(socket);
-      
-      if(response == "none")   return datatype_none;
-      if(response == "string") return datatype_string;
-      if(response == "list")   return datatype_list;
-      if(response == "set")    return datatype_set;
-      if(response == "zset")   return datatype_zset;
-      if(response == "hash")   return datatype_hash;
-
-#ifndef NDEBUG
-      std::cerr << "Got unknown datatype name: " << response << std::endl;
-#endif // NDEBUG
-      
-      return datatype_unknown;
+      request_ req(*this, socket, makecmd("MOVE") << key << dbindex);
+      recv_int_ok_reply_(socket);
     }
     
-    int_type keys(const string_type & pattern, string_vector & out)
+    void flushdb()
     {
+      exclusive_ guard(*this);
       BOOST_FOREACH(const connection_data & con, connections_)
       {
-        send_(con.socket, makecmd("KEYS") << pattern);
-      }
-
-      int_type res = 0;
-      
-      BOOST_FOREACH(const connection_data & con, connections_)
-      {
-        res += recv_multi_bulk_reply_(con.socket, out);
+        send_(con.socket, makecmd("FLUSHDB"));
       }
       
-      return res;
+      std::vector<int> waiting = all_sockets_();
+      while( !waiting.empty() )
+        recv_ok_reply_( next_ready_(waiting) );
     }
     
-    string_type randomkey()
-    {      
-      int socket = connections_[0].socket;
+    void flushdb(const connection_data & con)
+    {
+      int socket = con.socket;
+      request_ req(*this, socket, makecmd("FLUSHDB"));
+      recv_ok_reply_(socket);
+    }
+    
+    void flushall()
+    {
       if( connections_.size() > 1 )
-      {
-        /*
-         * Select a random server if there are more then one
-         */
-        
-        boost::mt19937 gen;
-        boost::posix_time::ptime now = boost::posix_time::microsec_clock::local_time();
-        boost::posix_time::ptime epoch( boost::gregorian::date(1970, 1, 1) );
-        gen.seed( (now-epoch).total_seconds() );
-        
-        boost::uniform_int<> dist(0, connections_.size()-1);
-        boost::variate_generator< boost::mt19937&, boost::uniform_int<> > die(gen, dist);
-        socket = connections_[die()].socket;
-      }
+        throw std::runtime_error("feature is not available in cluster mode");
       
-      send_(socket, makecmd("RANDOMKEY") );
-      return recv_bulk_reply_(socket);
+      int socket = connections_[0].socket;
+      request_ req(*this, socket, makecmd("FLUSHALL"));
+      recv_ok_reply_(socket);
     }
     
-    /**
-     * @warning Not cluster save (the old name and the new one must be on the same redis server)
-     */
-    void rename(const string_type & old_name, const string_type & new_name)
+    void flushall(const connection_data & con)
     {
-      int source_socket = get_socket(old_name);
-      int destin_socket = get_socket(new_name);
-      if( source_socket != destin_socket )
-      {
-        switch( type(old_name) )
-        {
-          case datatype_none:      // key doesn't exist
-            return;
-          case datatype_string:
-            set(new_name, get(old_name));
-            break;
-          case datatype_list:
-          {
-            string_vector content;
-            lrange(old_name, 0, -1, content);
-            del(new_name);
-            BOOST_FOREACH(const string_type & val, content)
-            {
-              rpush(new_name, val);
-            }
-            break;
-          }
-          case datatype_set:
-          {
-            string_set content;
-            smembers(old_name, content);
-            del(new_name);
-            BOOST_FOREACH(const string_type & val, content)
-            {
-              sadd(new_name, val);
-            }
-            break;
-          }
-          case datatype_zset:
-          case datatype_hash:
-          case datatype_unknown:
-          default:
-            throw std::runtime_error("renaming is not supported for this datatype in cluster mode");
-        }
-        del(old_name);
-        return;
-      }
-
-      send_(source_socket, makecmd("RENAME") << old_name << new_name);
-      recv_ok_reply_(source_socket);
+      int socket = con.socket;
+      request_ req(*this, socket, makecmd("FLUSHALL"));
+      recv_ok_reply_(socket);
     }
     
-    /**
-     * @warning Not cluster save (the old name and the new one must be on the same redis server)
-     */
-    bool renamenx(const string_type & old_name, const string_type & new_name)
+    int_type sort(const string_type & key,
+                  string_vector & out,
+                  sort_order order = sort_order_ascending,
+                  bool lexicographically = false)
     {
-      int source_socket = get_socket(old_name);
-      int destin_socket = get_socket(new_name);
+      int socket = get_socket(key);
+      makecmd m("SORT");
+      m << key << (order == sort_order_ascending ? "ASC" : "DESC");
+      if(lexicographically)
+        m << "ALPHA";
       
-      if( source_socket != destin_socket )
-      {
-        if( exists(new_name) )
-          return false;
-        rename(old_name, new_name);
-        return true;
-      }
+      request_ req(*this, socket, m);
+      return recv_multi_bulk_reply_(socket, out);
+    }
+    
+    int_type sort(const string_type & key,
+                  string_vector & out,
+                  int_type limit_start,
+                  int_type limit_end,
+                  sort_order order = sort_order_ascending,
+                  bool lexicographically = false)
+    {
+      exclusive_ guard(*this);
+      makecmd m("SORT");
+      m << key
+        << "LIMIT"
+        << limit_start
+        << limit_end
+        << (order == sort_order_ascending ? "ASC" : "DESC");
+        
+      if(lexicographically)
+        m << "ALPHA";
       
-      send_(source_socket, makecmd("RENAMENX") << old_name << new_name);
-      return recv_int_reply_(source_socket) == 1;
+      send_(m);
+      return recv_multi_bulk_reply_(out);
     }
-
-    /**
-     * @returns the number of keys in the currently selected database. In cluster mode the number
-     * of keys in all currently selected databases is returned.
-     */
-    int_type dbsize()
+    
+    int_type sort(const string_type & key,
+                  string_vector & out,
+                  const string_type & by_pattern,
+                  int_type limit_start,
+                  int_type limit_end,
+                  const string_vector & get_patterns,
+                  sort_order order = sort_order_ascending,
+                  bool lexicographically = false)
     {
-      int_type val = 0;
+      int socket = get_socket(key);
+      makecmd m("SORT");
+      
+      m << key
+      << "BY"    << by_pattern
+      << "LIMIT" << limit_start << limit_end;
+      
+      string_vector::const_iterator it = get_patterns.begin();
+      for ( ; it != get_patterns.end(); ++it)
+        m << "GET" << *it;
+      
+      m << (order == sort_order_ascending ? "ASC" : "DESC");
+      if(lexicographically)
+        m << "ALPHA";
       
+      request_ req(*this, socket, m);
+      return recv_multi_bulk_reply_(socket, out);
+    }
+    
+    void save()
+    {
+      exclusive_ guard(*this);
       BOOST_FOREACH(const connection_data & con, connections_)
       {
-        send_(con.socket, makecmd("DBSIZE"));
+        send_(con.socket, makecmd("SAVE"));
       }
       
       BOOST_FOREACH(const connection_data & con, connections_)
       {
-        val += recv_int_reply_(con.socket);
+        recv_ok_reply_(con.socket);
       }
-      
-      return val;
-    }
-
-    /**
-     * @returns the number of keys in the currently selected database with the given connection.
-     */
-    int_type dbsize(const connection_data & con)
-    {
-      send_(con.socket, makecmd("DBSIZE"));
-      return recv_int_reply_(con.socket);
     }
     
-    void expire(const string_type & key, unsigned int secs)
+    void save(const connection_data & con)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("EXPIRE") << key << secs);
-      recv_int_ok_reply_(socket);
+      request_ req(*this, con.socket, makecmd("SAVE"));
+      recv_ok_reply_(con.socket);
     }
     
-    int ttl(const string_type & key)
+    void bgsave()
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("TTL") << key);
-      return recv_int_reply_(socket);
+      exclusive_ guard(*this);
+      BOOST_FOREACH(const connection_data & con, connections_)
+      {
+        send_(con.socket, makecmd("BGSAVE"));
+      }
+      
+      BOOST_FOREACH(const connection_data & con, connections_)
+      {
+        std::string reply = recv_single_line_reply_(con.socket);
+        if(reply != REDIS_STATUS_REPLY_OK && reply != "Background saving started")
+          throw protocol_error("Unexpected response on bgsave: '" + reply + "'");
+      }
     }
     
-    int_type rpush(const string_type & key,
-                            const string_type & value)
+    void bgsave(const connection_data & con)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("RPUSH") << key << value);
-      return recv_int_reply_(socket);
+      request_ req(*this, con.socket, makecmd("BGSAVE"));
+      std::string reply = recv_single_line_reply_(con.socket);
+      if(reply != REDIS_STATUS_REPLY_OK && reply != "Background saving started")
+        throw protocol_error("Unexpected response on bgsave: '" + reply + "'");
     }
     
-    int_type lpush(const string_type & key,
-                            const string_type & value)
+    time_t lastsave()
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("LPUSH") << key << value);
-      return recv_int_reply_(socket);
+      exclusive_ guard(*this);
+      time_t res = 0;
+      BOOST_FOREACH(const connection_data & con, connections_)
+      {
+        int socket = con.socket;
+        send_(socket, makecmd("LASTSAVE"));
+        time_t cur = recv_int_reply_(socket);
+        if(res > 0)
+          res = std::min(cur, res);
+        else
+          res = cur;
+      }
+      return res;
     }
     
-    int_type llen(const string_type & key)
+    time_t lastsave(const connection_data & con)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("LLEN") << key);
-      return recv_int_reply_(socket);
+      request_ req(*this, con.socket, makecmd("LASTSAVE"));
+      return recv_int_reply_(con.socket);
     }
     
-    int_type lrange(const string_type & key,
-                    int_type start,
-                    int_type end,
-                    string_vector & out)
+    void shutdown()
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("LRANGE") << key << start << end);
-      return recv_multi_bulk_reply_(socket, out);
+      exclusive_ guard(*this);
+      BOOST_FOREACH(const connection_data & con, connections_)
+      {
+        int socket = con.socket;
+        send_(socket, makecmd("SHUTDOWN"));
+        
+        // we expected to get a connection_error as redis closes the connection on shutdown command.
+        
+        try
+        {
+          recv_ok_reply_(socket);
+        }
+        catch (connection_error & e)
+        {
+        }
+      }
     }
     
-    void ltrim(const string_type & key,
-                            int_type start,
-                            int_type end)
+    void shutdown(const connection_data & con)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("LTRIM") << key << start << end);
-      recv_ok_reply_(socket);
+      request_ req(*this, con.socket, makecmd("SHUTDOWN"));
+      
+      // we expected to get a connection_error as redis closes the connection on shutdown command.
+      
+      try
+      {
+        recv_ok_reply_(con.socket);
+      }
+      catch (connection_error & e)
+      {
+      }
     }
-    
-    string_type lindex(const string_type & key,
-                                                 int_type index)
+
+    void info(const connection_data & con, server_info & out)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("LINDEX") << key << index);
-      return recv_bulk_reply_(socket);
+      exclusive_ guard(*this);
+      int socket = con.socket;
+      send_(socket, makecmd("INFO"));
+      std::string response = recv_bulk_reply_(socket);
+      
+      if (response.empty())
+        throw protocol_error("empty");
+      
+      string_vector lines;
+      split_lines(response, lines);
+      if (lines.empty())
+        throw protocol_error("empty line for info");
+      
+      for(string_vector::const_iterator it = lines.begin(); it != lines.end(); ++it)
+      {
+        const std::string & line = *it;
+        if( line.empty() || line[0] == '#' ) // Don't throw protocol_error on empty and comment lines
+          continue;
+        string_vector line_parts;
+        split(line, ':', line_parts);
+        if (line_parts.size() != 2)
+          throw protocol_error("unexpected line format for info");
+        
+        const std::string & key = line_parts[0];
+        const std::string & val = line_parts[1];
+        
+        out.param_map[key] = val;
+        
+        if (key == "redis_version")
+          out.version = val;
+        else if (key == "bgsave_in_progress")
+          out.bgsave_in_progress = boost::lexical_cast<unsigned long>(val) == 1;
+        else if (key == "connected_clients")
+          out.connected_clients = boost::lexical_cast<unsigned long>(val);
+        else if (key == "connected_slaves")
+          out.connected_slaves = boost::lexical_cast<unsigned long>(val);
+        else if (key == "used_memory")
+          out.used_memory = boost::lexical_cast<unsigned long>(val);
+        else if (key == "changes_since_last_save")
+          out.changes_since_last_save = boost::lexical_cast<unsigned long>(val);
+        else if (key == "last_save_time")
+          out.last_save_time = boost::lexical_cast<unsigned long>(val);
+        else if (key == "total_connections_received")
+          out.total_connections_received = boost::lexical_cast<unsigned long>(val);
+        else if (key == "total_commands_processed")
+          out.total_commands_processed = boost::lexical_cast<unsigned long>(val);
+        else if (key == "uptime_in_seconds")
+          out.uptime_in_seconds = boost::lexical_cast<unsigned long>(val);
+        else if (key == "uptime_in_days")
+          out.uptime_in_days = boost::lexical_cast<unsigned long>(val);
+        else if (key == "role")
+          out.role = val == "master" ? role_master : role_slave;
+        else if (key == "arch_bits")
+          out.arch_bits = boost::lexical_cast<unsigned short>(val);
+        else if (key == "multiplexing_api")
+          out.multiplexing_api = val;
+        #ifndef NDEBUG // Ignore new/unknown keys in release mode
+          else
+            std::cerr << "Found unknown info key '" << key << "'" << std::endl;
+          #endif // NDEBUG
+      }
     }
     
-    void lset(const string_type & key, int_type index, const string_type & value)
+    void info(server_info & out)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("LSET") << key << index << value);
-      recv_ok_reply_(socket);
+      info(connections_[0], out);
     }
-    
-    int_type lrem(const string_type & key, int_type count, const string_type & value)
+
+    int_type publish(const string_type & channel, const string_type & message)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("LREM") << key << count << value);
+      int socket = get_socket(channel);
+      request_ req(*this, socket, makecmd("PUBLISH") << channel << message);
       return recv_int_reply_(socket);
     }
-    
-    string_type lpop(const string_type & key)
-    {
-      int socket = get_socket(key);
-      send_(socket, makecmd("LPOP") << key);
-      return recv_bulk_reply_(socket);
-    }
-    
-    string_type rpop(const string_type & key)
+
+#if 0 // currently unuseable
+    struct subscription_t
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("RPOP") << key);
-      return recv_bulk_reply_(socket);
-    }
+      string_type channel;
+      boost::function<void (const string_type &)> callback;
+    };
 
-    /**
-     * @warning Not cluster save (all keys must be on the same redis server)
-     */
-    string_pair blpop(const string_vector & keys, int_type timeout_seconds = 0)
+    void subscribe(const string_type & channel)
     {
-      int socket = get_socket(keys);
-      if(socket == -1)
-        // How to do in cluster mode? Is reinserting of to much poped values a solution?
-        throw std::runtime_error("feature is not available in cluster mode");
+      int socket = get_socket(channel);
       
-      send_(socket, makecmd("BLPOP") << keys << timeout_seconds);
-      string_vector sv;
-      try
-      {
-        recv_multi_bulk_reply_(socket, sv);
-      }
-      catch(key_error & e)
-      {
-        assert(timeout_seconds > 0);
-        throw timeout_error("could not pop value in time");
-      }
-      if(sv.size() == 2)
-        return make_pair( sv[0], sv[1] );
-      else
-        return make_pair( "", missing_value() );
     }
+#endif // 0 // currently unuseable
+    
+  private:
+    base_client(const base_client &);
+    base_client & operator=(const base_client &);
 
-    string_type blpop(const string_type & key, int_type timeout_seconds = 0)
+    void send_(int socket, const std::string & msg)
     {
-      int socket = get_socket(key);
-      if(socket == -1)
-        // How to do in cluster mode? Is reinserting of to much poped values a solution?
-        throw std::runtime_error("feature is not available in cluster mode");
+#ifndef NDEBUG
+      //output_proto_debug(msg, false);
+#endif
       
-      send_(socket, makecmd("BLPOP") << key << timeout_seconds);
-      string_vector sv;
-      try
-      {
-        recv_multi_bulk_reply_(socket, sv);
-      }
-      catch(key_error & e)
-      {
-        assert(timeout_seconds > 0);
-        return missing_value(); // should we throw a timeout_error?
-                                // we set a timeout so we expect that this can happen
-      }
-      if(sv.size() == 2)
-      {
-        assert(key == sv[0]);
-        return sv[1];
-      }
-      else
-        return missing_value();
+      send_(socket, msg.data(), msg.size());
     }
-    
-    /**
-     * @warning Not cluster save (all keys must be on the same redis server)
-     */
-    string_pair brpop(const string_vector & keys, int_type timeout_seconds)
+    
+    void send_(int socket, const makecmd & cmd)
     {
-      int socket = get_socket(keys);
-      makecmd m("BRPOP");
-      for(size_t i=0; i < keys.size(); i++)
-        m << keys[i];
-      m << timeout_seconds;
-      send_(socket, m);
-      string_vector sv;
-      try
+      if (cmd.contiguous())
       {
-        recv_multi_bulk_reply_(socket, sv);
-      }
-      catch(key_error & e)
-      {
-        assert(timeout_seconds > 0);
-        return missing_value(); // should we throw a timeout_error?
-                                // we set a timeout so we expect that this can happen
+        send_(socket, cmd.data(), cmd.size());
+        return;
       }
-      if(sv.size() == 2)
-        return make_pair( sv[0], sv[1] );
-      else
-        return make_pair( "", missing_value );
+      
+      std::vector<struct iovec> iov;
+      cmd.to_iovec(iov);
+      send_iov_(socket, &iov[0], iov.size());
     }
     
-    string_type brpop(const string_type & key, int_type timeout_seconds)
+    void send_(int socket, const char * data, size_t size)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("BRPOP") << key << timeout_seconds);
-      string_vector sv;
-      try
-      {
-        recv_multi_bulk_reply_(socket, sv);
-      }
-      catch(key_error & e)
-      {
-        assert(timeout_seconds > 0);
-        return missing_value(); // should we throw a timeout_error?
-                                // we set a timeout so we expect that this can happen
-      }
-      if(sv.size() == 2)
+      struct iovec iov;
+      iov.iov_base = const_cast<char *>(data);
+      iov.iov_len = size;
+      send_iov_(socket, &iov, 1);
+    }
+    
+    // Writes all given segments, handling partial writes and the IOV_MAX limit. With a timeout
+    // the socket is written without blocking and polled while its send buffer is full.
+    
+    void send_iov_(int socket, struct iovec * iov, size_t iovcnt)
+    {
+      connection_data & con = connection_(socket);
+      check_available_(con);
+      if (con.broken)
+        reconnect_(con);
+      if (!con.replay.empty())
+        con.replay.clear();
+      
+      int flags = REDIS_SEND_FLAGS;
+      if (wait_ms_(con) != -1)
+        flags |= MSG_DONTWAIT;
+      
+      while (iovcnt > 0)
       {
-        assert(key == sv[0]);
-        return sv[1];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = std::min(iovcnt, static_cast<size_t>(IOV_MAX));
+        
+        ssize_t bytes_written = ::sendmsg(socket, &msg, flags);
+        if (bytes_written < static_cast<ssize_t>(0))
+        {
+          if (errno == EINTR)
+            continue;
+          if ((flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK))
+          {
+            wait_(con, POLLOUT);
+            continue;
+          }
+          con.broken = true;
+          throw connection_error(strerror(errno));
+        }
+        
+        advance_iovec(iov, iovcnt, bytes_written);
       }
-      else
-        return missing_value();
     }
     
-    bool sadd(const string_type & key,
-                           const string_type & value)
+    // Fails right away while the health monitor considers the server unavailable. The connection
+    // most likely failed with the server, it is replaced when the breaker closes.
+    void check_available_(connection_data & con)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("SADD") << key << value);
-      return recv_int_reply_(socket) == 1;
+      if (monitor_ && !monitor_->available(&con - &connections_[0]))
+      {
+        con.broken = true;
+        throw connection_error("server is unavailable (" + address_(con) + ")");
+      }
     }
-
-    template<typename ITERATOR>
-    int_type sadd(const string_type & key, ITERATOR begin, ITERATOR end)
+    
+    // Sends a request whose reply is read next. Idempotent requests are remembered until their
+    // reply starts to arrive, so they can be sent again if the connection fails before.
+    
+    template<typename REQUEST>
+    void send_request_(int socket, const REQUEST & req)
     {
-      int socket = get_socket(key);
-      std::string commands;
-      size_t count = 0;
+      connection_data & con = connection_(socket);
+      check_available_(con);
       
-      while(begin != end)
+      std::string replay;
+      if (retries_ > 0 && replayable_(req))
+        append_request_(replay, req);
+      
+      con.replayed = 0;
+      try
       {
-        string_type val = *begin++;
-        commands += makecmd("SADD") << key << val;
-        count++;
+        send_(socket, req);
       }
-      
-      send_(socket, commands);
-
-      int_type res = 0;
-      for(size_t i=0; i < count; i++)
+      catch (connection_error &)
       {
-        res += recv_int_reply_(socket);
+        if (replay.empty())
+          throw;
+        con.replay.swap(replay);
+        replay_(con);
+        return;
       }
-      return res;
+      con.replay.swap(replay);
     }
     
-    void srem(const string_type & key,
-                           const string_type & value)
+    // Larger requests are not remembered for sending them again
+    enum { max_replay_size = 64 * 1024 };
+    
+    static bool replayable_(const std::string & req)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("SREM") << key << value);
-      recv_int_ok_reply_(socket);
+      return req.size() <= max_replay_size && replayable_(req.data(), req.size());
     }
     
-    string_type spop(const string_type & key)
+    static bool replayable_(const makecmd & req)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("SPOP") << key);
-      return recv_bulk_reply_(socket);
+      if (req.size() > max_replay_size)
+        return false;
+      if (req.contiguous())
+        return replayable_(req.data(), req.size());
+      
+      // Large arguments are referenced, the command name is in the first segment
+      std::vector<struct iovec> iov;
+      req.to_iovec(iov);
+      return replayable_(static_cast<const char *>(iov[0].iov_base), iov[0].iov_len);
     }
     
-    void smove(const string_type & srckey, const string_type & dstkey, const string_type & member)
+    // True for commands that may be sent again when their reply did not arrive, the reading ones.
+    static bool replayable_(const char * data, size_t size)
     {
-      int src_socket = get_socket(srckey);
-      int dst_socket = get_socket(dstkey);
-      if(dst_socket != src_socket)
+      static const char * const commands[] = {
+        "GET", "MGET", "EXISTS", "TYPE", "TTL", "KEYS", "RANDOMKEY", "DBSIZE", "PING", "INFO",
+        "LLEN", "LRANGE", "LINDEX", "SCARD", "SISMEMBER", "SMEMBERS", "SINTER", "SUNION", "SDIFF",
+        "SRANDMEMBER", "ZSCORE", "ZCARD", "ZCOUNT", "ZRANK", "ZREVRANK", "ZRANGE", "ZREVRANGE",
+        "ZRANGEBYSCORE", "HGET", "HMGET", "HEXISTS", "HLEN", "HKEYS", "HVALS", "HGETALL"
+      };
+      
+      // The name follows the argument count and its length: "*<n>\r\n$<len>\r\n<name>\r\n"
+      const char * end = data + size;
+      const char * name = static_cast<const char *>( memchr(data, '\n', size) );
+      if (name)
+        name = static_cast<const char *>( memchr(name + 1, '\n', end - name - 1) );
+      if (!name)
+        return false;
+      ++name;
+      const char * name_end = static_cast<const char *>( memchr(name, '\r', end - name) );
+      if (!name_end)
+        return false;
+      
+      size_t length = name_end - name;
+      for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); ++i)
       {
-        srem(srckey, member);
-        sadd(dstkey, member);
-        return;
+        if (strlen(commands[i]) == length && strncasecmp(commands[i], name, length) == 0)
+          return true;
       }
-        
-      send_(src_socket, makecmd("SMOVE") << srckey << dstkey << member);
-      recv_int_ok_reply_(src_socket);
+      return false;
     }
     
-    int_type scard(const string_type & key)
+    // Connects a failed connection again with the same socket descriptor, so the sockets that
+    // callers hold stay valid. Failed attempts delay the next one with exponential backoff.
+    void reconnect_(connection_data & con)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("SCARD") << key);
-      return recv_int_reply_(socket);
+      boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+      if (!con.retry_at.is_not_a_date_time() && now < con.retry_at)
+        throw connection_error("connection failed, reconnecting is delayed (" + address_(con) + ")");
+      
+      char err[ANET_ERR_LEN];
+      int fd;
+      try
+      {
+        if (con.connect_timeout_ms > 0)
+          fd = timed_connect_(con, err);
+        else
+          fd = anetTcpConnect(err, const_cast<char*>(con.host.c_str()), con.port);
+      }
+      catch (timeout_error &)
+      {
+        delay_reconnect_(con, now);
+        throw;
+      }
+      
+      if (fd == ANET_ERR)
+      {
+        delay_reconnect_(con, now);
+        throw connection_error( std::string(err) + " (" + address_(con) + ")" );
+      }
+      
+      dup2(fd, con.socket);
+      close(fd);
+      anetTcpNoDelay(NULL, con.socket);
+      con.read_buffer.clear();
+      con.replay.clear();
+      con.broken = false;
+      
+      try
+      {
+        if (!password_.empty())
+        {
+          send_(con.socket, makecmd("AUTH") << password_);
+          recv_ok_reply_(con.socket);
+        }
+        send_(con.socket, makecmd("SELECT") << con.dbindex);
+        recv_ok_reply_(con.socket);
+      }
+      catch (...)
+      {
+        con.broken = true;
+        delay_reconnect_(con, now);
+        throw;
+      }
+      
+      con.failures = 0;
+      con.retry_at = boost::posix_time::not_a_date_time;
     }
     
-    bool sismember(const string_type & key,
-                                const string_type & value)
+    void delay_reconnect_(connection_data & con, const boost::posix_time::ptime & now)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("SISMEMBER") << key << value);
-      return recv_int_reply_(socket) == 1;
+      int delay = reconnect_max_ms_;
+      if (con.failures < 20)
+        delay = std::min(reconnect_min_ms_ << con.failures, reconnect_max_ms_);
+      ++con.failures;
+      con.retry_at = now + boost::posix_time::milliseconds(delay);
     }
-
-    /**
-     * @returns the intersection between the Sets stored at key1, key2, ..., keyN
-     * @warning Not cluster save (all keys must be on the same redis server)
-     */
-    int_type sinter(const string_vector & keys, string_set & out)
+    
+    // PINGs all servers periodically on connections of its own, see start_health_monitor()
+    class health_monitor_
     {
-      std::map<int, string_vector> per_server;
-      BOOST_FOREACH(const string_type & key, keys)
+    public:
+      health_monitor_(const std::vector<connection_data> & connections, int interval_ms,
+                      int timeout_ms, int failure_threshold)
+      : connections_(connections), probes_(connections.size()), health_(connections.size()),
+        interval_ms_(interval_ms), timeout_ms_(timeout_ms), failure_threshold_(failure_threshold),
+        stop_(false)
       {
-        per_server[get_socket(key)].push_back(key);
+        thread_.reset( new boost::thread(runner(*this)) );
       }
 
-      size_t i = 0;
+      ~health_monitor_()
+      {
+        {
+          boost::mutex::scoped_lock lock(mutex_);
+          stop_ = true;
+        }
+        wakeup_.notify_all();
+        thread_->join();
 
-      typedef std::pair<const int, string_vector> per_server_pair;
-      BOOST_FOREACH(const per_server_pair & p, per_server)
+        for (size_t i = 0; i < probes_.size(); ++i)
+          close_(i);
+      }
+
+      bool available(size_t index) const
       {
-        send_(p.first, makecmd("SINTER") << p.second);
+        boost::mutex::scoped_lock lock(mutex_);
+        return health_[index].available;
       }
-      
-      BOOST_FOREACH(const per_server_pair & p, per_server)
+
+      void health(std::vector<server_health> & out) const
       {
-        string_set cur;
-        recv_multi_bulk_reply_(p.first, cur);
-        if(i > 0)
+        boost::mutex::scoped_lock lock(mutex_);
+        out = health_;
+      }
+
+    private:
+      health_monitor_(const health_monitor_ &);
+      health_monitor_ & operator=(const health_monitor_ &);
+
+      struct runner
+      {
+        explicit runner(health_monitor_ & monitor) : monitor(monitor) {}
+        void operator()() { monitor.run_(); }
+        health_monitor_ & monitor;
+      };
+
+      struct probe
+      {
+        probe() : fd(-1) {}
+        int fd;
+        boost::posix_time::ptime sent;
+        std::string reply;
+      };
+
+      void run_()
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        while (!stop_)
         {
-          string_set prev = out;
-          out.clear();
-          
-          std::set_intersection(prev.begin(), prev.end(), cur.begin(), cur.end(), std::inserter(out, out.end()));
+          lock.unlock();
+          probe_all_();
+          lock.lock();
+
+          boost::system_time next = boost::get_system_time() + boost::posix_time::milliseconds(interval_ms_);
+          while (!stop_ && wakeup_.timed_wait(lock, next))
+            ;
         }
-        else
+      }
+
+      // Sends a PING to every server (connecting first where needed) and waits for the answers
+      void probe_all_()
+      {
+        std::vector<struct pollfd> fds( probes_.size() );
+        size_t pending = 0;
+        for (size_t i = 0; i < probes_.size(); ++i)
         {
-          out = cur;
+          probe & p = probes_[i];
+          fds[i].fd = -1;
+          fds[i].revents = 0;
+
+          if (p.fd == -1)
+          {
+            char err[ANET_ERR_LEN];
+            p.fd = anetTcpNonBlockConnect(err, const_cast<char*>(connections_[i].host.c_str()), connections_[i].port);
+            if (p.fd == ANET_ERR)
+            {
+              p.fd = -1;
+              record_(i, false);
+              continue;
+            }
+            fds[i].events = POLLOUT;
+          }
+          else if (ping_(p))
+            fds[i].events = POLLIN;
+          else
+          {
+            failed_(i);
+            continue;
+          }
+
+          fds[i].fd = p.fd;
+          pending++;
+        }
+
+        boost::posix_time::ptime until = boost::posix_time::microsec_clock::universal_time() +
+                                         boost::posix_time::milliseconds(timeout_ms_);
+        while (pending > 0)
+        {
+          boost::int64_t left = (until - boost::posix_time::microsec_clock::universal_time()).total_milliseconds();
+          if (left <= 0)
+            break;
+
+          int count = ::poll(&fds[0], fds.size(), static_cast<int>(left));
+          if (count == -1 && errno != EINTR)
+            break;
+
+          for (size_t i = 0; i < fds.size() && count > 0; ++i)
+          {
+            if (fds[i].fd == -1 || fds[i].revents == 0)
+              continue;
+
+            probe & p = probes_[i];
+            fds[i].revents = 0;
+            if (fds[i].events == POLLOUT)
+            {
+              char err[ANET_ERR_LEN];
+              if (finish_connect_(p.fd, err) && ping_(p))
+              {
+                fds[i].events = POLLIN;
+                continue;
+              }
+              failed_(i);
+            }
+            else
+            {
+              // Any answer, including an error reply, shows that the server is alive
+              char buf[64];
+              ssize_t n = ::recv(p.fd, buf, sizeof(buf), 0);
+              if (n > 0)
+              {
+                p.reply.append(buf, n);
+                if (p.reply.find(REDIS_LBR) == std::string::npos)
+                  continue;
+                record_(i, true);
+              }
+              else
+                failed_(i);
+            }
+
+            fds[i].fd = -1;
+            pending--;
+          }
+        }
+
+        // Not answered in time
+        for (size_t i = 0; i < fds.size(); ++i)
+        {
+          if (fds[i].fd != -1)
+            failed_(i);
         }
-        i++;
       }
-  
-      return out.size();
-    }
 
-    /**
-     * @warning Not cluster save (all keys must be on the same redis server)
-     */
-    int_type sinterstore(const string_type & dstkey, const string_vector & keys)
-    {
-      int socket = get_socket(dstkey);
-      int source_sockets = get_socket(keys);
-      if(socket != source_sockets)
+      bool ping_(probe & p)
       {
-        std::cerr << 0 << std::endl;
-        string_set content;
-        std::cerr << 1 << std::endl;
-        sinter(keys, content);
-        std::cerr << 2 << std::endl;
-        del(dstkey);
-        std::cerr << 3 << std::endl;
-        BOOST_FOREACH(const string_type & val, content)
-        {
-          std::cerr << 4 << std::endl;
-          sadd(dstkey, val);
-        } 
-        std::cerr << 5 << std::endl;
-        return content.size();
+        static const char request[] = "*1\r\n$4\r\nPING\r\n";
+        p.reply.clear();
+        p.sent = boost::posix_time::microsec_clock::universal_time();
+        return ::send(p.fd, request, sizeof(request) - 1, REDIS_SEND_FLAGS | MSG_DONTWAIT) ==
+               static_cast<ssize_t>(sizeof(request) - 1);
       }
-      
-      send_(socket, makecmd("SINTERSTORE") << dstkey << keys);
-      return recv_int_reply_(socket);
-    }
-    
-    int_type sunion(const string_vector & keys, string_set & out)
-    {
-      int socket = get_socket(keys);
-      if(socket == -1)
+
+      // The connection is closed, so a late answer can not be taken for the next one
+      void failed_(size_t index)
       {
-        std::map< int, boost::optional<makecmd> > per_socket_keys;
-        BOOST_FOREACH(const string_type & key, keys)
+        close_(index);
+        record_(index, false);
+      }
+
+      void close_(size_t index)
+      {
+        if (probes_[index].fd != -1)
+          close(probes_[index].fd);
+        probes_[index].fd = -1;
+      }
+
+      void record_(size_t index, bool answered)
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        server_health & h = health_[index];
+        h.probes++;
+
+        if (answered)
         {
-          boost::optional<makecmd> & optCmd = per_socket_keys[ get_socket(key) ];
-          if( !optCmd )
-            optCmd = makecmd("SUNION");
-          *optCmd << key;
+          double rtt = (boost::posix_time::microsec_clock::universal_time() - probes_[index].sent).total_microseconds() / 1000.0;
+          h.rtt_ms = h.probes == h.failures + 1 ? rtt : 0.8 * h.rtt_ms + 0.2 * rtt;
+          h.consecutive_failures = 0;
+          h.available = true;
+        }
+        else
+        {
+          h.failures++;
+          if (++h.consecutive_failures >= failure_threshold_)
+            h.available = false;
         }
+      }
 
-        typedef std::pair< const int, boost::optional<makecmd> > per_sock_pair;
-        BOOST_FOREACH(const per_sock_pair & p, per_socket_keys)
+      std::vector<connection_data> connections_;
+      std::vector<probe> probes_;
+      std::vector<server_health> health_;
+      int interval_ms_;
+      int timeout_ms_;
+      int failure_threshold_;
+      bool stop_;
+      mutable boost::mutex mutex_;
+      boost::condition_variable wakeup_;
+      boost::scoped_ptr<boost::thread> thread_;
+    };
+
+    // Sends the remembered request again on a new connection after the old one failed. Waits for
+    // the backoff between the attempts unless that exceeds the timeout.
+    void replay_(connection_data & con)
+    {
+      std::string request;
+      request.swap(con.replay);
+      
+      for (;;)
+      {
+        ++con.replayed;
+        
+        // Neither waiting nor connecting while the breaker of the server is open
+        check_available_(con);
+        
+        if (!con.retry_at.is_not_a_date_time())
         {
-          send_(p.first, *p.second);
+          boost::posix_time::time_duration delay = con.retry_at - boost::posix_time::microsec_clock::universal_time();
+          int ms = wait_ms_(con);
+          if (ms != -1 && delay.total_milliseconds() > ms)
+            throw timeout_error("timeout while reconnecting (" + address_(con) + ")");
+          if (!delay.is_negative())
+            boost::this_thread::sleep(delay);
         }
         
-        BOOST_FOREACH(const per_sock_pair & p, per_socket_keys)
+        try
         {
-          recv_multi_bulk_reply_(p.first, out);
+          reconnect_(con);
+          send_(con.socket, request.data(), request.size());
+          con.replay.swap(request);
+          return;
+        }
+        catch (connection_error &)
+        {
+          if (con.replayed >= retries_)
+            throw;
         }
-        return out.size();
       }
+    }
+    
+    std::string recv_single_line_reply_(int socket)
+    {
+      std::string line = read_line(socket);
       
-      send_(socket, makecmd("SUNION") << keys);
-      return recv_multi_bulk_reply_(socket, out);
+      #ifndef NDEBUG
+      //output_proto_debug(line);
+      #endif
+      
+      if (line.empty())
+        throw protocol_error("empty single line reply");
+      
+      if (line.find(REDIS_PREFIX_STATUS_REPLY_ERROR) == 0)
+      {
+        std::string error_msg = line.substr( strlen(REDIS_PREFIX_STATUS_REPLY_ERROR) );
+        if (error_msg.empty())
+          error_msg = "unknown error";
+        throw protocol_error(error_msg);
+      }
+      
+      if (line[0] != REDIS_PREFIX_STATUS_REPLY_VALUE)
+        throw protocol_error("unexpected prefix for status reply");
+      
+      return line.substr(1);
     }
     
-    int_type sunionstore(const string_type & dstkey,
-                                                   const string_vector & keys)
+    void recv_ok_reply_(int socket)
     {
-      int socket = get_socket(dstkey);
-      int source_sockets = get_socket(keys);
-      if(socket != source_sockets)
+      if (recv_single_line_reply_(socket) != REDIS_STATUS_REPLY_OK)
+        throw protocol_error("expected OK response");
+    }
+    
+    int_type recv_bulk_reply_(int socket, char prefix)
+    {
+      int_type length = 0;
+      char line_prefix = recv_int_line_(socket, prefix, length);
+      
+      if (line_prefix != prefix)
       {
-        string_set content;
-        sunion(keys, content);
-        del(dstkey);
-        return sadd(dstkey, content.begin(), content.end());
+#ifndef NDEBUG
+        std::cerr << "unexpected prefix for bulk reply (expected '" << prefix << "' but got '" << line_prefix << "')" << std::endl;
+#endif // NDEBUG
+        throw protocol_error("unexpected prefix for bulk reply");
       }
       
-      send_(socket, makecmd("SUNIONSTORE") << dstkey << keys);
-      return recv_int_reply_(socket);
+      return length;
     }
     
-    int_type sdiff(const string_vector & keys, string_set & out)
+    std::string recv_bulk_reply_(int socket)
     {
-      int socket = get_socket(keys);
-      send_(socket, makecmd("SDIFF") << keys);
-      return recv_multi_bulk_reply_(socket, out);
+      std::string data;
+      if( !recv_bulk_reply_(socket, data) )
+        return missing_value();
+      
+      return data;
     }
     
-    int_type sdiffstore(const string_type & dstkey, const string_vector & keys)
+    // Receives a bulk reply into out, reusing its capacity. Returns false if the value does not exist.
+    
+    bool recv_bulk_reply_(int socket, std::string & out)
     {
-      int socket = get_socket(dstkey);
-      int source_sockets = get_socket(keys);
-      if(socket != source_sockets)
-        throw std::runtime_error("not available in cluster mode");
+      int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_SINGLE_BULK_REPLY );
       
-      send_(socket, makecmd("SDIFFSTORE") << dstkey << keys);
-      return recv_int_reply_(socket);
+      if (length == -1)
+        return false;
+      
+      out.resize(length);
+      if (length > 0)
+        read_n(socket, &out[0], length);
+      
+#ifndef NDEBUG
+      //output_proto_debug(out);
+#endif
+      
+      recv_bulk_reply_end_(socket);
+      return true;
     }
     
-    int_type smembers(const string_type & key, string_set & out)
+    // Receives a bulk reply into [buf, buf+cap). If the value is larger, the remaining bytes are
+    // discarded. Returns the full length of the value or -1 if it does not exist.
+    
+    int_type recv_bulk_reply_(int socket, char * buf, size_t cap)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("SMEMBERS") << key);
-      return recv_multi_bulk_reply_(socket, out);
+      int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_SINGLE_BULK_REPLY );
+      
+      if (length == -1)
+        return -1;
+      
+      size_t to_copy = std::min(static_cast<size_t>(length), cap);
+      read_n(socket, buf, to_copy);
+      skip_n(socket, length - to_copy);
+      recv_bulk_reply_end_(socket);
+      return length;
     }
     
-    string_type srandmember(const string_type & key)
+    void recv_bulk_reply_end_(int socket)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("SPOP") << key);
-      return recv_bulk_reply_(socket);
+      const char * crlf = recv_buffered_(socket, 2);
+      if (crlf[0] != '\r' || crlf[1] != '\n')
+        throw protocol_error("invalid bulk reply data; data of unexpected length");
     }
     
-    void zadd(const string_type & key, double score, const string_type & member)
+    int_type recv_multi_bulk_reply_(int socket, string_vector & out)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("ZADD") << key << score << member);
-      recv_int_ok_reply_(socket);
+      int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_MULTI_BULK_REPLY);
+      
+      if (length == -1)
+        throw key_error("no such key");
+
+      // The elements are received in place
+      size_t offset = out.size();
+      out.resize( offset + length );
+      
+      for (int_type i = 0; i < length; ++i)
+      {
+        if( !recv_bulk_reply_(socket, out[offset + i]) )
+          out[offset + i] = missing_value();
+      }
+      
+      return length;
     }
     
-    void zadd(const string_type & key, const string_score_pair & value)
+    // Moves the elements of a flat field/value reply into pairs
+    static void to_pairs_(string_vector & flat, string_pair_vector & out)
     {
-      zadd(key, value.second, value.first);
+      out.reserve( out.size() + flat.size() / 2 );
+      for (size_t i = 0; i + 1 < flat.size(); i += 2)
+      {
+        out.push_back( string_pair() );
+        out.back().first.swap(flat[i]);
+        out.back().second.swap(flat[i+1]);
+      }
     }
     
-    void zrem(const string_type & key, const string_type & member)
+    int_type recv_multi_bulk_reply_(int socket, string_set & out)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("ZREM") << key << member);
-      recv_int_ok_reply_(socket);
+      int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_MULTI_BULK_REPLY);
+      
+      if (length == -1)
+        throw key_error("no such key");
+      
+      for (int_type i = 0; i < length; ++i)
+        out.insert(recv_bulk_reply_(socket));
+      
+      return length;
     }
     
-    double zincrby(const string_type & key, const string_type & member, double increment)
+    // Element readers of lazy_range
+    
+    void recv_element_(int socket, string_type & out)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("ZINCRBY") << key << increment << member);
-      return boost::lexical_cast<double>( recv_bulk_reply_(socket) );
+      if( !recv_bulk_reply_(socket, out) )
+        out = missing_value();
     }
     
-    int_type zrank(const string_type & key, const string_type & member)
+    void recv_element_(int socket, string_pair & out)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("ZRANK") << key << member);
-      return recv_int_reply_(socket);
+      recv_element_(socket, out.first);
+      recv_element_(socket, out.second);
     }
     
-    int_type zrevrank(const string_type & key, const string_type & value)
+    static int_type element_size_(const string_type &)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("ZREVRANK") << key << value);
-      return boost::lexical_cast<int_type>( recv_int_reply_(socket) );
+      return 1;
     }
     
-    void zrange(const string_type & key, int_type start, int_type end, string_vector & out)
+    static int_type element_size_(const string_pair &)
     {
-      int socket = get_socket(key);
-      send_( socket, makecmd("ZRANGE") << key << start << end );
-      recv_multi_bulk_reply_(socket, out);
+      return 2;
     }
-
-  private:
-    void convert(const string_vector & in, string_score_vector & out)
+    
+    template<typename VISITOR>
+    struct element_visitor
     {
-      assert( in.size() % 2 == 0 );
-
-      for(size_t i=0; i < in.size(); i += 2)
+      element_visitor(VISITOR & visitor) : visitor(visitor) {}
+      
+      void operator()(size_t, const value_view & val)
       {
-        const std::string & value = in[i];
-        const std::string & str_score = in[i+1];
-        double score = boost::lexical_cast<double>(str_score);
-        out.push_back( make_pair(value, score) );
+        visitor(val);
+      }
+      
+      VISITOR & visitor;
+    };
+    
+    template<typename VISITOR>
+    struct indexed_visitor
+    {
+      indexed_visitor(VISITOR & visitor, const std::vector<size_t> & indices, size_t offset = 0)
+      : visitor(visitor), indices(indices), offset(offset)
+      {
+      }
+      
+      void operator()(size_t i, const value_view & val)
+      {
+        visitor(indices[offset + i], val);
       }
+      
+      VISITOR & visitor;
+      const std::vector<size_t> & indices;
+      size_t offset;
+    };
+    
+    // Receives a bulk reply into the read buffer and passes a view of it to the visitor.
+    // Returns false if the value does not exist.
+    
+    template<typename VISITOR>
+    bool recv_bulk_reply_view_(int socket, VISITOR & visitor)
+    {
+      int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_SINGLE_BULK_REPLY);
+      
+      if (length == -1)
+        return false;
+      
+      const char * data = recv_buffered_(socket, length + 2);
+      if (data[length] != '\r' || data[length + 1] != '\n')
+        throw protocol_error("invalid bulk reply data; data of unexpected length");
+      
+      visitor( value_view(data, length) );
+      return true;
     }
     
+    // Calls visitor(size_t index, const value_view &) for each non-nil element of a multi bulk reply.
+    
+    template<typename VISITOR>
+    int_type recv_multi_bulk_reply_view_(int socket, VISITOR & visitor)
+    {
+      int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_MULTI_BULK_REPLY);
+      
+      if (length == -1)
+        throw key_error("no such key");
+      
+      for (int_type i = 0; i < length; ++i)
+      {
+        int_type elem_length = recv_bulk_reply_(socket, REDIS_PREFIX_SINGLE_BULK_REPLY);
+        if (elem_length == -1)
+          continue;
+        
+        const char * data = recv_buffered_(socket, elem_length + 2);
+        if (data[elem_length] != '\r' || data[elem_length + 1] != '\n')
+          throw protocol_error("invalid bulk reply data; data of unexpected length");
+        
+        visitor( static_cast<size_t>(i), value_view(data, elem_length) );
+      }
+      
+      return length;
+    }
 
-  public:
+    template<typename INT_TYPE>
+    INT_TYPE recv_int_reply_(int socket)
+    {
+      INT_TYPE val = 0;
+      char prefix = recv_int_line_(socket, REDIS_PREFIX_INT_REPLY, val);
+      
+      if (prefix == '\0')
+        throw protocol_error("invalid integer reply; empty");
+      
+      if (prefix != REDIS_PREFIX_INT_REPLY)
+        throw protocol_error("unexpected prefix for integer reply");
+      
+      return val;
+    }
     
-    void zrange(const string_type & key, int_type start, int_type end, string_score_vector & out)
+    int_type recv_int_reply_(int socket)
     {
-      int socket = get_socket(key);
-      send_( socket, makecmd("ZRANGE") << key << start << end << "WITHSCORES" );
-      string_vector res;
-      recv_multi_bulk_reply_(socket, res);
-      convert(res, out);
+      return recv_int_reply_<int_type>(socket);
     }
     
-    void zrevrange(const string_type & key, int_type start, int_type end, string_vector & out)
+    // Reads a line of the form <prefix><integer>CRLF straight from the read buffer without
+    // allocating. Returns the prefix that was found ('\0' for an empty line). out is only
+    // set if it matches the expected prefix.
+    
+    template<typename INT_TYPE>
+    char recv_int_line_(int socket, char prefix, INT_TYPE & out)
     {
-      int socket = get_socket(key);
-      send_( socket, makecmd("ZREVRANGE") << key << start << end );
-      recv_multi_bulk_reply_(socket, out);
+      recv_buffer & buf = connection_(socket).read_buffer;
+      size_t line_size = buffered_line_(socket, buf);
+      
+      const char * line = buf.data();
+      const char * end = line + line_size;
+      buf.consume(line_size);
+      
+      while (end > line && (end[-1] == '\n' || end[-1] == '\r'))
+        --end;
+      
+      if (line == end)
+        return '\0';
+      
+      if (*line == prefix)
+        out = parse_int<INT_TYPE>(line + 1, end);
+      
+      return *line;
     }
     
-    void zrevrange(const string_type & key, int_type start, int_type end, string_score_vector & out)
+    void recv_int_ok_reply_(int socket)
     {
-      int socket = get_socket(key);
-      send_( socket, makecmd("ZREVRANGE") << key << start << end << "WITHSCORES" );
-      string_vector res;
-      recv_multi_bulk_reply_(socket, res);
-      convert(res, out);
+      if (recv_int_reply_(socket) != 1)
+        throw protocol_error("expecting int reply of 1");
+    }
+    
+    inline int get_socket(const string_type & key)
+    {
+      size_t con_count = connections_.size();
+      if(con_count == 1)
+        return connections_[0].socket;
+      size_t idx = hasher_( key, static_cast<const std::vector<connection_data> &>(connections_) );
+      return connections_[idx].socket;
+    }
+
+    int get_socket(const string_vector & keys)
+    {
+      assert( !keys.empty() );
+
+      if( connections_.size() == 1 )
+        return connections_[0].socket;
+      
+      int socket = -1;
+      for(size_t i=0; i < keys.size(); i++)
+      {
+        int cur_socket = get_socket(keys[i]);
+        if(i > 0 && socket != cur_socket)
+          return -1;
+          //throw std::runtime_error("not possible in cluster mode");
+        
+        socket = cur_socket;
+      }
+
+      return socket;
+    }
+
+#ifndef NDEBUG
+    void output_proto_debug(const std::string & data, bool is_received = true)
+    {
+      std::string escaped_data(data);
+      size_t pos;
+      while ((pos = escaped_data.find("\n")) != std::string::npos)
+        escaped_data.replace(pos, 1, "\\n");
+      while ((pos = escaped_data.find("\r")) != std::string::npos)
+        escaped_data.replace(pos, 1, "\\r");
+      
+      std::cerr << time(NULL) << ": "
+                                 << (is_received ? "RECV '" : "SEND '")
+                                 << escaped_data
+                                 << "'"
+                                    << std::endl;
     }
+#endif
 
-  protected:
-    void zrangebyscore_base(bool withscores, const string_type & key, double min, double max, string_vector & out, int_type offset, int_type max_count, int range_modification)
+    std::vector<std::string>::size_type split(const std::string & str, char delim, std::vector<std::string> & elems)
     {
-      int socket = get_socket(key);
-      std::string min_str, max_str;
-      if( range_modification & exclude_min )
-        min_str = "(";
-      if( range_modification & exclude_max )
-        max_str = "(";
-      
-      min_str += boost::lexical_cast<std::string>(min);
-      max_str += boost::lexical_cast<std::string>(max);
-      
-      makecmd m("ZRANGEBYSCORE");
-      m << key << min_str << max_str;
-        
-      if(max_count != -1 || offset > 0)
+      std::stringstream ss(str);
+      std::string item;
+      std::vector<std::string>::size_type n = 0;
+      while (getline(ss, item, delim))
       {
-        std::cerr << "Adding limit: " << offset << " " << max_count << std::endl;
-        m << "LIMIT" << offset << max_count;
+        elems.push_back(item);
+        ++n;
       }
-        
-      send_(socket, m);
-      recv_multi_bulk_reply_(socket, out);
+      return n;
     }
     
-  public:
-    void zrangebyscore(const string_type & key, double min, double max, string_vector & out, int_type offset = 0, int_type max_count = -1, int range_modification = 0)
+    inline std::string & rtrim(std::string & str, const std::string & ws = REDIS_WHITESPACE)
     {
-      zrangebyscore_base(false, key, min, max, out, offset, max_count, range_modification);
+      std::string::size_type pos = str.find_last_not_of(ws);
+      str.erase(pos + 1);
+      return str;
     }
     
-    void zrangebyscore(const string_type & key, double min, double max, string_score_vector & out, int_type offset = 0, int_type max_count = -1, int range_modification = 0)
+    inline void split_lines(const std::string & str, std::vector<std::string> & elems)
     {
-      string_vector res;
-      zrangebyscore_base(true, key, min, max, res, offset, max_count, range_modification);
-      convert(res, out);
+      split(str, '\n', elems);
+      for (std::vector<std::string>::iterator it = elems.begin(); it != elems.end(); ++it)
+        rtrim(*it);
     }
+    // Reads N bytes from given blocking socket into dest. Bytes that are already buffered
+    // are used first. Large remainders are received directly into dest instead of passing
+    // through the connection buffer.
     
-    int_type zcount(const string_type & key, double min, double max, int range_modification = 0)
+    void read_n(int socket, char * dest, size_t n)
     {
-      int socket = get_socket(key);
-      std::string min_str, max_str;
-      if( range_modification & exclude_min )
-        min_str = "(";
-      if( range_modification & exclude_max )
-        max_str = "(";
+      recv_buffer & buf = connection_(socket).read_buffer;
       
-      min_str += boost::lexical_cast<std::string>(min);
-      max_str += boost::lexical_cast<std::string>(max);
+      while( buf.size() < n && n - buf.size() < recv_buffer::chunk_size )
+        fill_(socket, buf);
       
-      send_(socket, makecmd("ZCOUNT") << key << min_str << max_str);
-      return recv_int_reply_(socket);
+      size_t bytes_read = std::min(buf.size(), n);
+      if( bytes_read > 0 )
+      {
+        memcpy(dest, buf.data(), bytes_read);
+        buf.consume(bytes_read);
+      }
+      
+      connection_data & con = connection_(socket);
+      while (bytes_read != n)
+        bytes_read += recv_(con, dest + bytes_read, n - bytes_read);
     }
     
-    int_type zremrangebyrank( const string_type & key, int_type start, int_type end )
-    {
-      int socket = get_socket(key);
-      send_(socket, makecmd("ZREMRANGEBYRANK") << key << start << end);
-      return recv_int_reply_(socket);
-    }
+    // Reads and discards N bytes from given blocking socket.
     
-    int_type zremrangebyscore( const string_type& key, double min, double max )
+    void skip_n(int socket, size_t n)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("ZREMRANGEBYSCORE") << key << min << max);
-      return recv_int_reply_(socket);
+      recv_buffer & buf = connection_(socket).read_buffer;
+      
+      while( n > 0 )
+      {
+        if( buf.empty() )
+          fill_(socket, buf);
+        
+        size_t bytes_skipped = std::min(buf.size(), n);
+        buf.consume(bytes_skipped);
+        n -= bytes_skipped;
+      }
     }
+
+    // Receives at least one more byte into the read buffer of a connection.
     
-    int_type zcard( const string_type & key )
+    size_t fill_(int socket, recv_buffer & buf, size_t min_space = recv_buffer::chunk_size)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("ZCARD") << key);
-      return recv_int_reply_(socket);
+      connection_data & con = connection_(socket);
+      size_t bytes_received;
+      for (;;)
+      {
+        try
+        {
+          char * p = buf.prepare(min_space);
+          bytes_received = recv_(con, p, buf.free_space());
+          break;
+        }
+        catch (connection_error &)
+        {
+          // The reply of an idempotent request did not arrive, it is sent again on a new connection
+          if (con.replay.empty())
+            throw;
+          replay_(con);
+        }
+      }
+      
+      if (!con.replay.empty())
+        con.replay.clear();
+      buf.commit(bytes_received);
+      return bytes_received;
     }
     
-    double zscore( const string_type& key, const string_type& element )
+    // Receives at most n bytes, waiting within the timeout. A failed connection is marked to be
+    // connected again on its next use.
+    size_t recv_(connection_data & con, char * dest, size_t n)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("ZSCORE") << key << element);
-      return boost::lexical_cast<double>( recv_bulk_reply_(socket) );
+      wait_(con, POLLIN);
+      try
+      {
+        return recv_or_throw(con.socket, dest, n, 0);
+      }
+      catch (connection_error &)
+      {
+        con.broken = true;
+        throw;
+      }
     }
+
+    // Receives n bytes into the read buffer of a connection and consumes them. The returned
+    // pointer stays valid until the next read from this connection.
     
-    int_type zunionstore( const string_type & dstkey, const string_vector & keys, const std::vector<double> & weights = std::vector<double>(), aggregate_type aggragate = aggregate_sum )
+    const char * recv_buffered_(int socket, size_t n)
     {
-      int dst_socket = get_socket(dstkey);
-      int socket = get_socket(keys);
-      if(socket != dst_socket)
-        throw std::runtime_error("feature is not available in cluster mode");
-      
-      makecmd m("ZUNIONSTORE");
-      m << dstkey << keys.size() << keys;
+      recv_buffer & buf = connection_(socket).read_buffer;
+      while( buf.size() < n )
+        fill_(socket, buf, std::max<size_t>(recv_buffer::chunk_size, n - buf.size()));
       
-      if( weights.size() > 0 )
+      const char * data = buf.data();
+      buf.consume(n);
+      return data;
+    }
+
+    connection_data & connection_(int socket)
+    {
+      BOOST_FOREACH(connection_data & con, connections_)
       {
-        assert(keys.size() == weights.size());
-        m << "WEIGHTS" << weights;
+        if( con.socket == socket )
+          return con;
       }
+      throw connection_error("socket does not belong to this client");
+    }
+    
+    // Milliseconds the calling thread may wait for a connection, -1 without limit
+    int wait_ms_(const connection_data & con) const
+    {
+      int ms = con.timeout_ms > 0 ? con.timeout_ms : -1;
       
-      m << "AGGREGATE";
-      switch(aggragate)
+      const boost::posix_time::ptime * until = deadline_.get();
+      if (until)
       {
-        case aggregate_sum:
-          m << "SUM";
-          break;
-        case aggregate_min:
-          m << "MIN";
-          break;
-        case aggregate_max:
-          m << "MAX";
-          break;
-        default:
-          assert(false);
+        boost::int64_t left = (*until - boost::posix_time::microsec_clock::universal_time()).total_milliseconds();
+        if (left < 0)
+          left = 0;
+        if (ms == -1 || left < ms)
+          ms = static_cast<int>(left);
       }
-      
-      send_(socket, m);
-      return recv_int_reply_(socket);
+      return ms;
     }
     
-    int_type zinterstore(const string_type & dstkey, const string_vector & keys, const std::vector<double> & weights = std::vector<double>(), aggregate_type aggragate = aggregate_sum )
+    // Waits until the socket is readable or writable (as given by events) within the timeout.
+    // Errors and hangups are reported by the following recv() or send().
+    void wait_(connection_data & con, short events)
     {
-      int dst_socket = get_socket(dstkey);
-      int socket = get_socket(keys);
-      if(socket != dst_socket)
-        throw std::runtime_error("feature is not available in cluster mode");
+      int ms = wait_ms_(con);
+      if (ms == -1)
+        return;
       
-      makecmd m("ZINTERSTORE");
-      m << dstkey << keys.size() << keys;
-      if( weights.size() > 0 )
-      {
-        assert(keys.size() == weights.size());
-        m << "WEIGHTS" << weights;
-      }
+      struct pollfd pfd;
+      pfd.fd = con.socket;
+      pfd.events = events;
+      pfd.revents = 0;
       
-      m << "AGGREGATE";
-      switch(aggragate)
-      {
-        case aggregate_sum:
-          m << "SUM";
-          break;
-        case aggregate_min:
-          m << "MIN";
-          break;
-        case aggregate_max:
-          m << "MAX";
-          break;
-        default:
-          assert(false);
-      }
+      int count;
+      do
+        count = ::poll(&pfd, 1, ms);
+      while (count == -1 && errno == EINTR);
       
-      send_(socket, m);
-      return recv_int_reply_(socket);
+      if (count == -1)
+        throw connection_error(std::string("poll error: ") + strerror(errno));
+      if (count == 0)
+        timed_out_(con);
     }
     
-    bool hset( const string_type & key, const string_type & field, const string_type & value )
+    // The connection is shut down because a reply arriving late would be taken for the reply of
+    // the next command. It is connected again when it is used next.
+    void timed_out_(connection_data & con)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("HSET") << key << field << value);
-      return recv_int_reply_(socket) == 1;
+      ::shutdown(con.socket, SHUT_RDWR);
+      con.broken = true;
+      throw timeout_error("timeout (" + address_(con) + ")");
     }
+
+    // Fan-out helpers: the replies of several servers are processed in the order in which they
+    // arrive, so a slow server does not delay the replies that are already waiting.
     
-    string_type hget( const string_type & key, const string_type & field )
+    template<typename MAP>
+    static std::vector<int> sockets_of_(const MAP & socket_map)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("HGET") << key << field);
-      return recv_bulk_reply_(socket);
+      std::vector<int> sockets;
+      for (typename MAP::const_iterator it = socket_map.begin(); it != socket_map.end(); ++it)
+        sockets.push_back(it->first);
+      return sockets;
     }
     
-    bool hsetnx( const string_type & key, const string_type & field, const string_type & value )
+    std::vector<int> all_sockets_() const
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("HSETNX") << key << field << value);
-      return recv_int_reply_(socket) == 1;
+      std::vector<int> sockets;
+      BOOST_FOREACH(const connection_data & con, connections_)
+      {
+        sockets.push_back(con.socket);
+      }
+      return sockets;
     }
     
-    void hmset( const string_type & key, const string_vector & fields, const string_vector& values )
+    // Waits until a reply can be read from one of the sockets, removes it from sockets and returns it.
+    int next_ready_(std::vector<int> & sockets)
     {
-      int socket = get_socket(key);
-      makecmd m("HMSET");
-      m << key;
-      assert( fields.size() == values.size() );
+      assert( !sockets.empty() );
       
-      for(size_t i=0; i < fields.size(); i++)
-        m << fields[i] << values[i];
+      size_t ready = sockets.size();
+      for (size_t i = 0; i < sockets.size() && ready == sockets.size(); ++i)
+      {
+        if (!connection_(sockets[i]).read_buffer.empty())
+          ready = i;
+      }
       
-      send_(socket, m);
-      recv_ok_reply_(socket);
-    }
-    
-    void hmset( const string_type & key, const string_pair_vector & field_value_pairs )
-    {
-      int socket = get_socket(key);
-      makecmd m("HMSET");
-      m << key;
+      if (ready == sockets.size() && sockets.size() == 1)
+        ready = 0;
       
-      for(size_t i=0; i < field_value_pairs.size(); i++)
-        m << field_value_pairs[i].first << field_value_pairs[i].second;
+      if (ready == sockets.size())
+      {
+        std::vector<struct pollfd> fds( sockets.size() );
+        int ms = -1;
+        for (size_t i = 0; i < sockets.size(); ++i)
+        {
+          fds[i].fd = sockets[i];
+          fds[i].events = POLLIN;
+          fds[i].revents = 0;
+          
+          int con_ms = wait_ms_(connection_(sockets[i]));
+          if (con_ms != -1 && (ms == -1 || con_ms < ms))
+            ms = con_ms;
+        }
+        
+        int count;
+        do
+          count = ::poll(&fds[0], fds.size(), ms);
+        while (count == -1 && errno == EINTR);
+        
+        if (count == -1)
+          throw connection_error(std::string("poll error: ") + strerror(errno));
+        
+        if (count == 0)
+        {
+          // None of the replies arrived in time
+          for (size_t i = 1; i < sockets.size(); ++i)
+          {
+            ::shutdown(sockets[i], SHUT_RDWR);
+            connection_(sockets[i]).broken = true;
+          }
+          timed_out_(connection_(sockets[0]));
+        }
+        
+        // Errors and hangups are reported when the socket is read
+        for (size_t i = 0; i < fds.size() && ready == sockets.size(); ++i)
+        {
+          if (fds[i].revents != 0)
+            ready = i;
+        }
+      }
       
-      send_(socket, m);
-      recv_ok_reply_(socket);
+      int socket = sockets[ready];
+      sockets.erase(sockets.begin() + ready);
+      return socket;
     }
     
-    void hmget( const string_type & key, const string_vector & fields, string_vector & out)
+    reply_t next_reply_type(int socket)
     {
-      int socket = get_socket(key);
-      makecmd m("HMGET");
-      m << key;
+      recv_buffer & buf = connection_(socket).read_buffer;
+      if( buf.empty() )
+        fill_(socket, buf);
       
-      for(size_t i=0; i < fields.size(); i++)
-        m << fields[i];
+      switch( buf.data()[0] )
+      {
+        case REDIS_PREFIX_STATUS_REPLY_VALUE:
+          return status_code_reply;
+        case REDIS_PREFIX_STATUS_REPLY_ERR_C:
+          return error_reply;
+        case REDIS_PREFIX_INT_REPLY:
+          return int_reply;
+        case REDIS_PREFIX_SINGLE_BULK_REPLY:
+          return bulk_reply;
+        case REDIS_PREFIX_MULTI_BULK_REPLY:
+          return multi_bulk_reply;
+      }
 
-      send_(socket, m);
-      recv_multi_bulk_reply_(socket, out);
+      throw std::runtime_error("invalid/unknown rely type from redis server");
+    }
+
+    // Receives a reply of any type into res. Bulk and multi bulk values are received in place,
+    // without copying them. The type is set last, so res stays consistent if receiving fails.
+    void recv_generic_reply_(int socket, reply_data_t & res)
+    {
+      reply_t type = next_reply_type(socket);
+      res.first = no_reply;
+      switch( type )
+      {
+        case status_code_reply:
+          res.second = read_line(socket).substr(1);
+          break;
+        case error_reply:
+          res.second = read_line(socket).substr(strlen(REDIS_PREFIX_STATUS_REPLY_ERROR));
+          break;
+        case int_reply:
+          res.second = recv_int_reply_(socket);
+          break;
+        case bulk_reply:
+        {
+          res.second = std::string();
+          std::string & val = boost::get<std::string>(res.second);
+          if( !recv_bulk_reply_(socket, val) )
+            val = missing_value();
+          break;
+        }
+        case multi_bulk_reply:
+        {
+          res.second = string_vector();
+          recv_multi_bulk_reply_( socket, boost::get<string_vector>(res.second) );
+          break;
+        }
+        case no_reply:
+          assert(false);
+      }
+      res.first = type;
     }
     
-    int_type hincrby( const string_type & key, const string_type & field, int_type by )
-    {
-      int socket = get_socket(key);
-      send_(socket, makecmd("HINCRBY") << key << field << by);
-      return recv_int_reply_(socket);
-    }
+    // Reads a single line of character data from the given blocking socket.
+    // Returns the line that was read, not including EOL delimiter(s).  Both LF
+    // ('\n') and CRLF ("\r\n") delimiters are supported.  If there was an I/O
+    // error reading from the socket, connection_error is raised.  If max_size
+    // bytes are read before finding an EOL delimiter, these bytes are returned
+    // as they are.
     
-    bool hexists( const string_type & key, const string_type & field )
+    std::string read_line(int socket, ssize_t max_size = 2048)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("HEXISTS") << key << field);
-      return recv_int_reply_(socket) == 1;
+      assert(socket > 0);
+      assert(max_size > 0);
+      
+      recv_buffer & buf = connection_(socket).read_buffer;
+      size_t line_size = buffered_line_(socket, buf, max_size);
+      
+      std::string line(buf.data(), line_size);
+      buf.consume(line_size);
+      return rtrim(line, REDIS_LBR);
     }
     
-    bool hdel( const string_type& key, const string_type& field )
-    {
-      int socket = get_socket(key);
-      send_(socket, makecmd("HDEL") << key << field);
-      return recv_int_reply_(socket) == 1;
-    }
+    // Receives into the read buffer of a connection until it starts with a complete line
+    // (or max_size bytes without EOL). Returns the size of the line including the EOL.
     
-    int_type hlen( const string_type & key )
+    size_t buffered_line_(int socket, recv_buffer & buf, size_t max_size = 2048)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("HLEN") << key);
-      return recv_int_reply_(socket);
+      size_t scanned = 0;
+      
+      while (true)
+      {
+        if( buf.size() > scanned )
+        {
+          const char * eol = static_cast<const char *>(memchr(buf.data() + scanned, '\n', buf.size() - scanned));
+          if( eol )
+            return eol - buf.data() + 1;
+        }
+        
+        if( buf.size() >= max_size )
+          return max_size;
+        
+        scanned = buf.size();
+        fill_(socket, buf);
+      }
     }
     
-    void hkeys( const string_type & key, string_vector & out )
+  private:
+    std::vector<connection_data> connections_;
+    connect_mode connect_mode_;
+    bool auto_pipelining_;
+    size_t window_commands_;
+    size_t window_bytes_;
+    size_t chunk_keys_;
+    size_t chunk_bytes_;
+    int reconnect_min_ms_;
+    int reconnect_max_ms_;
+    int retries_;
+    string_type password_;
+    boost::mutex blocking_mutex_;
+    std::vector< std::vector<base_client *> > blocking_idle_; // per server, see blocking_
+    boost::thread_specific_ptr<boost::posix_time::ptime> deadline_;
+    boost::shared_ptr<health_monitor_> monitor_;
+    //int socket_;
+    CONSISTENT_HASHER hasher_;
+  };
+  
+  struct default_hasher
+  {
+    inline size_t operator()(const std::string & key, const std::vector<connection_data> & connections)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("HKEYS") << key);
-      recv_multi_bulk_reply_(socket, out);
+      return boost::hash<std::string>()(key) % connections.size();
     }
-    
-    void hvals( const string_type & key, string_vector & out )
+  };
+  
+  typedef base_client<default_hasher> client;
+
+  /**
+   * Pool of connected clients for the same servers, shared by several threads. A thread leases a
+   * client for a while and uses it exclusively, so no client is shared and no new connections
+   * are opened per request as with clone().
+   *
+   *   redis::client_pool pool(connections.begin(), connections.end(), 4, 16);
+   *   {
+   *     redis::client_pool::lease c(pool);
+   *     c->set("key", "value");
+   *   } // the client is returned to the pool
+   *
+   * The pool connects min_size clients up front and more on demand, up to max_size. When all of
+   * them are leased, a lease waits for a client to be returned.
+   */
+  template<typename CONSISTENT_HASHER>
+  class base_client_pool
+  {
+  public:
+    typedef base_client<CONSISTENT_HASHER> client_type;
+
+    template<typename CON_ITERATOR>
+    base_client_pool(CON_ITERATOR begin, CON_ITERATOR end, size_t min_size, size_t max_size)
+    : connections_(begin, end), size_(0), max_size_(max_size)
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("HVALS") << key);
-      recv_multi_bulk_reply_(socket, out);
+      if( connections_.empty() )
+        throw std::runtime_error("No connections given!");
+      if( max_size == 0 || min_size > max_size )
+        throw std::runtime_error("invalid pool size");
+
+      try
+      {
+        for (size_t i = 0; i < min_size; ++i)
+        {
+          idle_.push_back( create_() );
+          ++size_;
+        }
+      }
+      catch (...)
+      {
+        close_idle_();
+        throw;
+      }
     }
-    
-    void hgetall( const string_type & key, string_pair_vector & out )
+
+    ~base_client_pool()
     {
-      int socket = get_socket(key);
-      send_(socket, makecmd("HGETALL") << key);
-      string_vector s;
-      recv_multi_bulk_reply_(socket, s);
-      for(size_t i = 0; i < s.size(); i+=2)
-        out.push_back( make_pair(s[i], s[i+1]) );
+      assert( idle_.size() == size_ ); // all clients have to be returned
+      close_idle_();
     }
-    
-    void select(int_type dbindex)
+
+    /**
+     * Exclusive use of one client of the pool until destruction. Waits up to timeout for a client
+     * if all of them are leased (forever if timeout is not_a_date_time) and throws timeout_error
+     * if none became free in time.
+     *
+     * A client whose connection failed should be discard()ed, the pool then connects a new one on
+     * demand.
+     */
+    class lease
     {
-      BOOST_FOREACH(const connection_data & con, connections_)
+    public:
+      explicit lease(base_client_pool & pool,
+                     boost::posix_time::time_duration timeout = boost::posix_time::not_a_date_time)
+      : pool_(pool), client_( pool.acquire_(timeout) )
       {
-        send_(con.socket, makecmd("SELECT") << dbindex);
       }
-      
-      BOOST_FOREACH(connection_data & con, connections_)
+
+      ~lease()
       {
-        recv_ok_reply_(con.socket);
-        con.dbindex = dbindex;
+        if (client_)
+          pool_.release_(client_);
       }
-    }
-    
-    void select(int_type dbindex, const connection_data & con)
-    {
-      int socket = con.socket;
-      send_(socket, makecmd("SELECT") << dbindex);
-      recv_ok_reply_(socket);
-      BOOST_FOREACH(connection_data & cur_con, connections_)
+
+      client_type & operator*() const
       {
-        if( cur_con == con )
-          cur_con.dbindex = dbindex;
+        assert(client_);
+        return *client_;
       }
-    }
-    
-    void move(const string_type & key,
-                           int_type dbindex)
-    {
-      int socket = get_socket(key);
-      send_(socket, makecmd("MOVE") << key << dbindex);
-      recv_int_ok_reply_(socket);
-    }
-    
-    void flushdb()
-    {
-      BOOST_FOREACH(const connection_data & con, connections_)
+
+      client_type * operator->() const
       {
-        send_(con.socket, makecmd("FLUSHDB"));
+        assert(client_);
+        return client_;
       }
-      
-      BOOST_FOREACH(const connection_data & con, connections_)
+
+      // Closes the client instead of returning it to the pool
+      void discard()
       {
-        recv_ok_reply_(con.socket);
+        if (client_)
+          pool_.discard_(client_);
+        client_ = NULL;
       }
+
+    private:
+      lease(const lease &);
+      lease & operator=(const lease &);
+
+      base_client_pool & pool_;
+      client_type * client_;
+    };
+
+    // Number of connected clients, leased or not
+    size_t size() const
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return size_;
     }
-    
-    void flushdb(const connection_data & con)
+
+    size_t idle() const
     {
-      int socket = con.socket;
-      send_(socket, makecmd("FLUSHDB"));
-      recv_ok_reply_(socket);
+      boost::mutex::scoped_lock lock(mutex_);
+      return idle_.size();
     }
-    
-    void flushall()
+
+  private:
+    base_client_pool(const base_client_pool &);
+    base_client_pool & operator=(const base_client_pool &);
+
+    client_type * create_()
     {
-      if( connections_.size() > 1 )
-        throw std::runtime_error("feature is not available in cluster mode");
-      
-      int socket = connections_[0].socket;
-      send_(socket, makecmd("FLUSHALL"));
-      recv_ok_reply_(socket);
+      return new client_type(connections_.begin(), connections_.end());
     }
-    
-    void flushall(const connection_data & con)
+
+    void close_idle_()
     {
-      int socket = con.socket;
-      send_(socket, makecmd("FLUSHALL"));
-      recv_ok_reply_(socket);
+      for (size_t i = 0; i < idle_.size(); ++i)
+        delete idle_[i];
+      idle_.clear();
     }
-    
-    int_type sort(const string_type & key,
-                  string_vector & out,
-                  sort_order order = sort_order_ascending,
-                  bool lexicographically = false)
+
+    client_type * acquire_(boost::posix_time::time_duration timeout)
     {
-      int socket = get_socket(key);
-      makecmd m("SORT");
-      m << key << (order == sort_order_ascending ? "ASC" : "DESC");
-      if(lexicographically)
-        m << "ALPHA";
-      
-      send_(socket, m);
-      return recv_multi_bulk_reply_(socket, out);
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (idle_.empty() && size_ == max_size_)
+      {
+        if (timeout.is_not_a_date_time())
+        {
+          while (idle_.empty() && size_ == max_size_)
+            returned_.wait(lock);
+        }
+        else
+        {
+          boost::system_time deadline = boost::get_system_time() + timeout;
+          while (idle_.empty() && size_ == max_size_)
+          {
+            if (!returned_.timed_wait(lock, deadline) && idle_.empty() && size_ == max_size_)
+              throw timeout_error("no client of the pool became available in time");
+          }
+        }
+      }
+
+      if (!idle_.empty())
+      {
+        client_type * client = idle_.back();
+        idle_.pop_back();
+        return client;
+      }
+
+      // Connect without holding the lock, the slot is reserved meanwhile
+      ++size_;
+      lock.unlock();
+      try
+      {
+        return create_();
+      }
+      catch (...)
+      {
+        lock.lock();
+        --size_;
+        returned_.notify_one();
+        throw;
+      }
+    }
+
+    void release_(client_type * client)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      idle_.push_back(client);
+      returned_.notify_one();
+    }
+
+    void discard_(client_type * client)
+    {
+      delete client;
+      boost::mutex::scoped_lock lock(mutex_);
+      --size_;
+      returned_.notify_one();
     }
+
+    const std::vector<connection_data> connections_;
+    mutable boost::mutex mutex_;
+    boost::condition_variable returned_;
+    std::vector<client_type *> idle_;   // most recently returned last
+    size_t size_;
+    size_t max_size_;
+  };
+
+  typedef base_client_pool<default_hasher> client_pool;
+
+#ifdef __linux__
+  
+  /**
+   * Asynchronous client on non-blocking sockets and an epoll event loop. Commands are built with
+   * makecmd and distributed with the same hashers as base_client. Instead of returning the reply,
+   * each command takes a callback that is called with the reply from within run_once() or run().
+   * A single thread can so keep many requests in flight on all servers at once.
+   *
+   * Error replies are passed to the callbacks (reply type error_reply). Socket errors are thrown
+   * as connection_error from run_once() after the replies that arrived before them were passed on.
+   * The connection is closed then, its outstanding callbacks are called with an error_reply
+   * "connection closed" (exceptions they throw are ignored), and later commands for that server
+   * throw connection_error. An exception thrown by a callback closes the connection of its reply
+   * the same way and is passed on by run_once().
+   *
+   * The client does not authenticate, so it can only be used with servers that require no password.
+   */
+  template<typename CONSISTENT_HASHER>
+  class base_async_client
+  {
+  public:
+    typedef std::string string_type;
+    typedef long int_type;
+    typedef boost::function<void (const reply_data_t &)> reply_callback;
     
-    int_type sort(const string_type & key,
-                  string_vector & out,
-                  int_type limit_start,
-                  int_type limit_end,
-                  sort_order order = sort_order_ascending,
-                  bool lexicographically = false)
+    explicit base_async_client(const string_type & host = "localhost",
+                               uint16_t port = 6379, int_type dbindex = 0)
+    : epoll_fd_(-1), pending_(0)
     {
-      makecmd m("SORT");
-      m << key
-        << "LIMIT"
-        << limit_start
-        << limit_end
-        << (order == sort_order_ascending ? "ASC" : "DESC");
-        
-      if(lexicographically)
-        m << "ALPHA";
-      
-      send_(m);
-      return recv_multi_bulk_reply_(out);
+      connection_data con;
+      con.host = host;
+      con.port = port;
+      con.dbindex = dbindex;
+      connections_.push_back(con);
+      init();
     }
     
-    int_type sort(const string_type & key,
-                  string_vector & out,
-                  const string_type & by_pattern,
-                  int_type limit_start,
-                  int_type limit_end,
-                  const string_vector & get_patterns,
-                  sort_order order = sort_order_ascending,
-                  bool lexicographically = false)
+    template<typename CON_ITERATOR>
+    base_async_client(CON_ITERATOR begin, CON_ITERATOR end)
+    : epoll_fd_(-1), pending_(0)
     {
-      int socket = get_socket(key);
-      makecmd m("SORT");
-      
-      m << key
-      << "BY"    << by_pattern
-      << "LIMIT" << limit_start << limit_end;
-      
-      string_vector::const_iterator it = get_patterns.begin();
-      for ( ; it != get_patterns.end(); ++it)
-        m << "GET" << *it;
-      
-      m << (order == sort_order_ascending ? "ASC" : "DESC");
-      if(lexicographically)
-        m << "ALPHA";
-      
-      send_(socket, m);
-      return recv_multi_bulk_reply_(socket, out);
+      connections_.assign(begin, end);
+      if( connections_.empty() )
+        throw std::runtime_error("No connections given!");
+      init();
     }
     
-    void save()
+    ~base_async_client()
     {
-      BOOST_FOREACH(const connection_data & con, connections_)
+      for (size_t i = 0; i < streams_.size(); ++i)
       {
-        send_(con.socket, makecmd("SAVE"));
-      }
-      
-      BOOST_FOREACH(const connection_data & con, connections_)
-      {
-        recv_ok_reply_(con.socket);
+        if (streams_[i].fd != ANET_ERR)
+          close(streams_[i].fd);
       }
+      if (epoll_fd_ != -1)
+        close(epoll_fd_);
+    }
+    
+    // Sends the command to the server of its key. The callback may be empty.
+    void exec(const makecmd & cmd, const reply_callback & callback)
+    {
+      queue_(hasher_(cmd.key_name(), connections_), cmd, callback);
     }
     
-    void save(const connection_data & con)
+    void get(const string_type & key, const reply_callback & callback)
     {
-      send_(con.socket, makecmd("SAVE"));
-      recv_ok_reply_(con.socket);
+      queue_(key, makecmd(prefix::get) << key, callback);
     }
     
-    void bgsave()
+    void set(const string_type & key, const string_type & value, const reply_callback & callback = reply_callback())
     {
-      BOOST_FOREACH(const connection_data & con, connections_)
-      {
-        send_(con.socket, makecmd("BGSAVE"));
-      }
-      
-      BOOST_FOREACH(const connection_data & con, connections_)
-      {
-        std::string reply = recv_single_line_reply_(con.socket);
-        if(reply != REDIS_STATUS_REPLY_OK && reply != "Background saving started")
-          throw protocol_error("Unexpected response on bgsave: '" + reply + "'");
-      }
+      queue_(key, makecmd(prefix::set) << key << value, callback);
     }
     
-    void bgsave(const connection_data & con)
+    void incr(const string_type & key, const reply_callback & callback = reply_callback())
     {
-      send_(con.socket, makecmd("BGSAVE"));
-      std::string reply = recv_single_line_reply_(con.socket);
-      if(reply != REDIS_STATUS_REPLY_OK && reply != "Background saving started")
-        throw protocol_error("Unexpected response on bgsave: '" + reply + "'");
+      queue_(key, makecmd(prefix::incr) << key, callback);
     }
     
-    time_t lastsave()
+    void del(const string_type & key, const reply_callback & callback = reply_callback())
     {
-      time_t res = 0;
-      BOOST_FOREACH(const connection_data & con, connections_)
-      {
-        int socket = con.socket;
-        send_(socket, makecmd("LASTSAVE"));
-        time_t cur = recv_int_reply_(socket);
-        if(res > 0)
-          res = std::min(cur, res);
-        else
-          res = cur;
-      }
-      return res;
+      queue_(key, makecmd(prefix::del) << key, callback);
     }
     
-    time_t lastsave(const connection_data & con)
+    void hget(const string_type & key, const string_type & field, const reply_callback & callback)
     {
-      send_(con.socket, makecmd("LASTSAVE"));
-      return recv_int_reply_(con.socket);
+      queue_(key, makecmd(prefix::hget) << key << field, callback);
     }
     
-    void shutdown()
+    void hset(const string_type & key, const string_type & field, const string_type & value,
+              const reply_callback & callback = reply_callback())
     {
-      BOOST_FOREACH(const connection_data & con, connections_)
-      {
-        int socket = con.socket;
-        send_(socket, makecmd("SHUTDOWN"));
-        
-        // we expected to get a connection_error as redis closes the connection on shutdown command.
-        
-        try
-        {
-          recv_ok_reply_(socket);
-        }
-        catch (connection_error & e)
-        {
-        }
-      }
+      queue_(key, makecmd(prefix::hset) << key << field << value, callback);
     }
     
-    void shutdown(const connection_data & con)
+    void rpush(const string_type & key, const string_type & value, const reply_callback & callback = reply_callback())
     {
-      send_(con.socket, makecmd("SHUTDOWN"));
-      
-      // we expected to get a connection_error as redis closes the connection on shutdown command.
+      queue_(key, makecmd(prefix::rpush) << key << value, callback);
+    }
+    
+    void lpush(const string_type & key, const string_type & value, const reply_callback & callback = reply_callback())
+    {
+      queue_(key, makecmd(prefix::lpush) << key << value, callback);
+    }
+    
+#ifdef REDIS_HAS_COROUTINES
+    /**
+     * Awaitable command for C++20 coroutines, see async_task. The command is queued when it is
+     * awaited, the coroutine is resumed from within run_once() or run() once the reply arrived.
+     * So a coroutine reads like synchronous code but never blocks the thread that runs the loop.
+     */
+    template<typename RESULT>
+    class awaiter
+    {
+    public:
+      typedef RESULT (*converter)(const reply_data_t &);
       
-      try
+      awaiter(base_async_client & client, size_t index, const makecmd & cmd, converter convert)
+      : client_(client), index_(index), cmd_(cmd), convert_(convert)
       {
-        recv_ok_reply_(con.socket);
       }
-      catch (connection_error & e)
+      
+      bool await_ready() const noexcept
       {
+        return false;
       }
-    }
-
-    void info(const connection_data & con, server_info & out)
-    {
-      int socket = con.socket;
-      send_(socket, makecmd("INFO"));
-      std::string response = recv_bulk_reply_(socket);
       
-      if (response.empty())
-        throw protocol_error("empty");
+      void await_suspend(std::coroutine_handle<> handle)
+      {
+        handle_ = handle;
+        client_.queue_(index_, cmd_, resume_with_reply(this));
+      }
       
-      string_vector lines;
-      split_lines(response, lines);
-      if (lines.empty())
-        throw protocol_error("empty line for info");
+      RESULT await_resume() const
+      {
+        return convert_(reply_);
+      }
       
-      for(string_vector::const_iterator it = lines.begin(); it != lines.end(); ++it)
+    private:
+      struct resume_with_reply
       {
-        const std::string & line = *it;
-        if( line.empty() || line[0] == '#' ) // Don't throw protocol_error on empty and comment lines
-          continue;
-        string_vector line_parts;
-        split(line, ':', line_parts);
-        if (line_parts.size() != 2)
-          throw protocol_error("unexpected line format for info");
-        
-        const std::string & key = line_parts[0];
-        const std::string & val = line_parts[1];
+        explicit resume_with_reply(awaiter * self)
+        : self(self)
+        {
+        }
         
-        out.param_map[key] = val;
+        void operator()(const reply_data_t & reply)
+        {
+          self->reply_ = reply;
+          self->handle_.resume();
+        }
         
-        if (key == "redis_version")
-          out.version = val;
-        else if (key == "bgsave_in_progress")
-          out.bgsave_in_progress = boost::lexical_cast<unsigned long>(val) == 1;
-        else if (key == "connected_clients")
-          out.connected_clients = boost::lexical_cast<unsigned long>(val);
-        else if (key == "connected_slaves")
-          out.connected_slaves = boost::lexical_cast<unsigned long>(val);
-        else if (key == "used_memory")
-          out.used_memory = boost::lexical_cast<unsigned long>(val);
-        else if (key == "changes_since_last_save")
-          out.changes_since_last_save = boost::lexical_cast<unsigned long>(val);
-        else if (key == "last_save_time")
-          out.last_save_time = boost::lexical_cast<unsigned long>(val);
-        else if (key == "total_connections_received")
-          out.total_connections_received = boost::lexical_cast<unsigned long>(val);
-        else if (key == "total_commands_processed")
-          out.total_commands_processed = boost::lexical_cast<unsigned long>(val);
-        else if (key == "uptime_in_seconds")
-          out.uptime_in_seconds = boost::lexical_cast<unsigned long>(val);
-        else if (key == "uptime_in_days")
-          out.uptime_in_days = boost::lexical_cast<unsigned long>(val);
-        else if (key == "role")
-          out.role = val == "master" ? role_master : role_slave;
-        else if (key == "arch_bits")
-          out.arch_bits = boost::lexical_cast<unsigned short>(val);
-        else if (key == "multiplexing_api")
-          out.multiplexing_api = val;
-        #ifndef NDEBUG // Ignore new/unknown keys in release mode
-          else
-            std::cerr << "Found unknown info key '" << key << "'" << std::endl;
-          #endif // NDEBUG
-      }
+        awaiter * self;
+      };
+      
+      base_async_client & client_;
+      size_t index_;
+      makecmd cmd_;
+      converter convert_;
+      std::coroutine_handle<> handle_;
+      reply_data_t reply_;
+    };
+    
+    // The typed commands below are the ones with a callback method above, anything else is awaited
+    // with co_exec().
+    
+    // The reply as it is, error replies included
+    awaiter<reply_data_t> co_exec(const makecmd & cmd)
+    {
+      return awaiter<reply_data_t>(*this, hasher_(cmd.key_name(), connections_), cmd, &as_reply_);
     }
     
-    void info(server_info & out)
+    // Gives missing_value() if the key does not exist
+    awaiter<string_type> co_get(const string_type & key)
     {
-      info(connections_[0], out);
+      return awaiter<string_type>(*this, hasher_(key, connections_), makecmd(prefix::get) << key, &as_bulk_);
     }
-
-    int_type publish(const string_type & channel, const string_type & message)
+    
+    awaiter<void> co_set(const string_type & key, const string_type & value)
     {
-      int socket = get_socket(channel);
-      send_(socket, makecmd("PUBLISH") << channel << message);
-      return recv_int_reply_(socket);
+      return awaiter<void>(*this, hasher_(key, connections_), makecmd(prefix::set) << key << value, &as_ok_);
     }
-
-#if 0 // currently unuseable
-    struct subscription_t
+    
+    awaiter<int_type> co_incr(const string_type & key)
     {
-      string_type channel;
-      boost::function<void (const string_type &)> callback;
-    };
-
-    void subscribe(const string_type & channel)
+      return awaiter<int_type>(*this, hasher_(key, connections_), makecmd(prefix::incr) << key, &as_int_);
+    }
+    
+    awaiter<bool> co_del(const string_type & key)
     {
-      int socket = get_socket(channel);
-      
+      return awaiter<bool>(*this, hasher_(key, connections_), makecmd(prefix::del) << key, &as_bool_);
     }
-#endif // 0 // currently unuseable
     
-  private:
-    base_client(const base_client &);
-    base_client & operator=(const base_client &);
-
-    void send_(int socket, const std::string & msg)
+    awaiter<string_type> co_hget(const string_type & key, const string_type & field)
     {
-#ifndef NDEBUG
-      //output_proto_debug(msg, false);
-#endif
-      
-      if (anetWrite(socket, const_cast<char *>(msg.data()), msg.size()) == -1)
-        throw connection_error(strerror(errno));
+      return awaiter<string_type>(*this, hasher_(key, connections_), makecmd(prefix::hget) << key << field, &as_bulk_);
     }
     
-    std::string recv_single_line_reply_(int socket)
+    awaiter<bool> co_hset(const string_type & key, const string_type & field, const string_type & value)
     {
-      std::string line = read_line(socket);
-      
-      #ifndef NDEBUG
-      //output_proto_debug(line);
-      #endif
-      
-      if (line.empty())
-        throw protocol_error("empty single line reply");
-      
-      if (line.find(REDIS_PREFIX_STATUS_REPLY_ERROR) == 0)
-      {
-        std::string error_msg = line.substr( strlen(REDIS_PREFIX_STATUS_REPLY_ERROR) );
-        if (error_msg.empty())
-          error_msg = "unknown error";
-        throw protocol_error(error_msg);
-      }
-      
-      if (line[0] != REDIS_PREFIX_STATUS_REPLY_VALUE)
-        throw protocol_error("unexpected prefix for status reply");
-      
-      return line.substr(1);
+      return awaiter<bool>(*this, hasher_(key, connections_), makecmd(prefix::hset) << key << field << value, &as_bool_);
     }
     
-    void recv_ok_reply_(int socket)
+    awaiter<int_type> co_rpush(const string_type & key, const string_type & value)
     {
-      if (recv_single_line_reply_(socket) != REDIS_STATUS_REPLY_OK)
-        throw protocol_error("expected OK response");
+      return awaiter<int_type>(*this, hasher_(key, connections_), makecmd(prefix::rpush) << key << value, &as_int_);
     }
     
-    int_type recv_bulk_reply_(int socket, char prefix)
+    awaiter<int_type> co_lpush(const string_type & key, const string_type & value)
     {
-      std::string line = read_line(socket);
+      return awaiter<int_type>(*this, hasher_(key, connections_), makecmd(prefix::lpush) << key << value, &as_int_);
+    }
+#endif // REDIS_HAS_COROUTINES
+    
+    // Number of commands whose reply was not received yet, including the SELECT on connect
+    size_t pending() const
+    {
+      return pending_;
+    }
+    
+    /**
+     * Waits up to timeout_ms milliseconds (forever if negative) for the sockets to become ready,
+     * sends queued commands and calls the callbacks of the received replies.
+     * @returns false if the timeout expired without any event
+     */
+    bool run_once(int timeout_ms = -1)
+    {
+      struct epoll_event events[max_events];
+      int count;
+      do
+        count = epoll_wait(epoll_fd_, events, max_events, timeout_ms);
+      while (count == -1 && errno == EINTR);
       
-#ifndef NDEBUG
-      //output_proto_debug(line);
-#endif
+      if (count == -1)
+        throw connection_error(std::string("epoll_wait: ") + strerror(errno));
       
-      if (line[0] != prefix)
+      for (int i = 0; i < count; ++i)
       {
-#ifndef NDEBUG
-        std::cerr << "unexpected prefix for bulk reply (expected '" << prefix << "' but got '" << line[0] << "')" << std::endl;
-#endif // NDEBUG
-        throw protocol_error("unexpected prefix for bulk reply");
+        size_t index = events[i].data.u32;
+        stream & s = streams_[index];
+        try
+        {
+          if (!s.connected)
+            finish_connect_(index);
+          
+          // Replies may arrive together with the hangup, they are passed on before failing
+          if (events[i].events & EPOLLIN)
+            read_(s);
+          
+          if (events[i].events & (EPOLLERR | EPOLLHUP))
+            throw connection_error("connection error (" + address_(index) + ")");
+          
+          if (events[i].events & EPOLLOUT)
+            write_(s);
+          
+          update_events_(index);
+        }
+        catch (...)
+        {
+          close_(index);
+          throw;
+        }
       }
-      
-      return boost::lexical_cast<int_type>(line.substr(1));
+      return count > 0;
     }
     
-    std::string recv_bulk_reply_(int socket)
+    // Runs the event loop until all replies were received.
+    void run()
     {
-      int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_SINGLE_BULK_REPLY );
-      
-      if (length == -1)
-        return missing_value();
-      
-      int_type real_length = length + 2;    // CRLF
-      
-      std::string data = read_n(socket, real_length);
-      
-#ifndef NDEBUG
-      //output_proto_debug(data.substr(0, data.length()-2));
-#endif
-      
-      if (data.empty())
-        throw protocol_error("invalid bulk reply data; empty");
-      
-      if (data.length() != static_cast<std::string::size_type>(real_length))
-        throw protocol_error("invalid bulk reply data; data of unexpected length");
-      
-      data.erase(data.size() - 2);
-      
-      return data;
+      while (pending_ > 0)
+        run_once();
     }
     
-    int_type recv_multi_bulk_reply_(int socket, string_vector & out)
+  private:
+    base_async_client(const base_async_client &);
+    base_async_client & operator=(const base_async_client &);
+    
+    enum
     {
-      int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_MULTI_BULK_REPLY);
-      
-      if (length == -1)
-        throw key_error("no such key");
-
-      out.reserve( out.size()+length );
+      max_events = 64,
+      read_chunk_size = 16 * 1024
+    };
+    
+    // Per connection state of the event loop
+    struct stream
+    {
+      stream()
+      : fd(ANET_ERR), connected(false), out_pos(0), events(0)
+      {
+      }
       
-      for (int_type i = 0; i < length; ++i)
-        out.push_back(recv_bulk_reply_(socket));
+      int fd;                              // ANET_ERR once the connection failed
+      bool connected;
+      std::string out;                     // requests that are not yet written
+      size_t out_pos;                      // written bytes of out
+      std::deque<reply_callback> callbacks; // in the order of the requests
+      reply_parser parser;
+      uint32_t events;                     // the events the socket is registered for
+    };
+    
+    void init()
+    {
+      epoll_fd_ = epoll_create(static_cast<int>(connections_.size()));
+      if (epoll_fd_ == -1)
+        throw connection_error(std::string("epoll_create: ") + strerror(errno));
       
-      return length;
+      streams_.resize(connections_.size());
+      try
+      {
+        for (size_t i = 0; i < connections_.size(); ++i)
+        {
+          char err[ANET_ERR_LEN];
+          stream & s = streams_[i];
+          s.fd = anetTcpNonBlockConnect(err, const_cast<char*>(connections_[i].host.c_str()), connections_[i].port);
+          if (s.fd == ANET_ERR)
+            throw connection_error( err + std::string(" (") + address_(i) + ")" );
+          anetTcpNoDelay(NULL, s.fd);
+          
+          struct epoll_event ev;
+          memset(&ev, 0, sizeof(ev));
+          ev.events = s.events = EPOLLIN | EPOLLOUT;
+          ev.data.u32 = static_cast<uint32_t>(i);
+          if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, s.fd, &ev) == -1)
+            throw connection_error(std::string("epoll_ctl: ") + strerror(errno));
+          
+          // Sent as soon as the connection is established
+          queue_(i, makecmd("SELECT") << connections_[i].dbindex, &check_select_);
+        }
+      }
+      catch (...)
+      {
+        // The destructor does not run if the constructor throws
+        for (size_t i = 0; i < streams_.size(); ++i)
+        {
+          if (streams_[i].fd != ANET_ERR)
+            close(streams_[i].fd);
+        }
+        close(epoll_fd_);
+        throw;
+      }
     }
     
-    int_type recv_multi_bulk_reply_(int socket, string_set & out)
+    static void check_select_(const reply_data_t & reply)
     {
-      int_type length = recv_bulk_reply_(socket, REDIS_PREFIX_MULTI_BULK_REPLY);
-      
-      if (length == -1)
-        throw key_error("no such key");
-      
-      for (int_type i = 0; i < length; ++i)
-        out.insert(recv_bulk_reply_(socket));
-      
-      return length;
+      if (reply.first != status_code_reply)
+        throw protocol_error("selecting the database failed");
     }
-
-    template<typename INT_TYPE>
-    INT_TYPE recv_int_reply_(int socket)
+    
+#ifdef REDIS_HAS_COROUTINES
+    // Converters of the awaitable commands. Error replies are thrown like base_client does.
+    
+    static void check_reply_(const reply_data_t & reply, reply_t expected)
     {
-      std::string line = read_line(socket);
-      
-      #ifndef NDEBUG
-      //output_proto_debug(line);
-      #endif
-      
-      if (line.empty())
-        throw protocol_error("invalid integer reply; empty");
-      
-      if (line[0] != REDIS_PREFIX_INT_REPLY)
-        throw protocol_error("unexpected prefix for integer reply");
-      
-      return boost::lexical_cast<INT_TYPE>(line.substr(1));
+      if (reply.first == error_reply)
+        throw protocol_error( boost::get<std::string>(reply.second) );
+      if (reply.first != expected)
+        throw protocol_error("unexpected reply type");
     }
     
-    int_type recv_int_reply_(int socket)
+    static reply_data_t as_reply_(const reply_data_t & reply)
     {
-      std::string line = read_line(socket);
-      
-#ifndef NDEBUG
-      //output_proto_debug(line);
-#endif
-      
-      if (line.empty())
-        throw protocol_error("invalid integer reply; empty");
-      
-      if (line[0] != REDIS_PREFIX_INT_REPLY)
-        throw protocol_error("unexpected prefix for integer reply");
-      
-      return boost::lexical_cast<int_type>(line.substr(1));
+      return reply;
     }
     
-    void recv_int_ok_reply_(int socket)
+    static string_type as_bulk_(const reply_data_t & reply)
     {
-      if (recv_int_reply_(socket) != 1)
-        throw protocol_error("expecting int reply of 1");
+      check_reply_(reply, bulk_reply);
+      return boost::get<std::string>(reply.second);
     }
     
-    inline int get_socket(const string_type & key)
+    static void as_ok_(const reply_data_t & reply)
     {
-      size_t con_count = connections_.size();
-      if(con_count == 1)
-        return connections_[0].socket;
-      size_t idx = hasher_( key, static_cast<const std::vector<connection_data> &>(connections_) );
-      return connections_[idx].socket;
+      check_reply_(reply, status_code_reply);
+      if (boost::get<std::string>(reply.second) != REDIS_STATUS_REPLY_OK)
+        throw protocol_error("expected OK response");
     }
-
-    int get_socket(const string_vector & keys)
+    
+    static int_type as_int_(const reply_data_t & reply)
     {
-      assert( !keys.empty() );
-
-      if( connections_.size() == 1 )
-        return connections_[0].socket;
-      
-      int socket = -1;
-      for(size_t i=0; i < keys.size(); i++)
-      {
-        int cur_socket = get_socket(keys[i]);
-        if(i > 0 && socket != cur_socket)
-          return -1;
-          //throw std::runtime_error("not possible in cluster mode");
-        
-        socket = cur_socket;
-      }
-
-      return socket;
+      check_reply_(reply, int_reply);
+      return boost::get<long>(reply.second);
     }
-
-#ifndef NDEBUG
-    void output_proto_debug(const std::string & data, bool is_received = true)
+    
+    static bool as_bool_(const reply_data_t & reply)
     {
-      std::string escaped_data(data);
-      size_t pos;
-      while ((pos = escaped_data.find("\n")) != std::string::npos)
-        escaped_data.replace(pos, 1, "\\n");
-      while ((pos = escaped_data.find("\r")) != std::string::npos)
-        escaped_data.replace(pos, 1, "\\r");
-      
-      std::cerr << time(NULL) << ": "
-                                 << (is_received ? "RECV '" : "SEND '")
-                                 << escaped_data
-                                 << "'"
-                                    << std::endl;
+      return as_int_(reply) == 1;
     }
-#endif
-
-    std::vector<std::string>::size_type split(const std::string & str, char delim, std::vector<std::string> & elems)
+#endif // REDIS_HAS_COROUTINES
+    
+    std::string address_(size_t index) const
     {
-      std::stringstream ss(str);
-      std::string item;
-      std::vector<std::string>::size_type n = 0;
-      while (getline(ss, item, delim))
-      {
-        elems.push_back(item);
-        ++n;
-      }
-      return n;
+      std::ostringstream os;
+      os << "redis://" << connections_[index].host << ':' << connections_[index].port;
+      return os.str();
     }
     
-    inline std::string & rtrim(std::string & str, const std::string & ws = REDIS_WHITESPACE)
+    void queue_(const string_type & key, const makecmd & cmd, const reply_callback & callback)
     {
-      std::string::size_type pos = str.find_last_not_of(ws);
-      str.erase(pos + 1);
-      return str;
+      queue_(hasher_(key, connections_), cmd, callback);
     }
     
-    inline void split_lines(const std::string & str, std::vector<std::string> & elems)
+    void queue_(size_t index, const makecmd & cmd, const reply_callback & callback)
     {
-      split(str, '\n', elems);
-      for (std::vector<std::string>::iterator it = elems.begin(); it != elems.end(); ++it)
-        rtrim(*it);
+      stream & s = streams_[index];
+      if (s.fd == ANET_ERR)
+        throw connection_error("connection was closed (" + address_(index) + ")");
+      if (cmd.contiguous())
+        s.out.append(cmd.data(), cmd.size());
+      else
+        s.out += static_cast<std::string>(cmd);
+      s.callbacks.push_back(callback);
+      ++pending_;
+      update_events_(index);
     }
-    // Reads N bytes from given blocking socket.
     
-    std::string read_n(int socket, ssize_t n)
+    void finish_connect_(size_t index)
     {
-      // changed char* to vector<char> buffer to don't leak memory on exceptions (and also because I hate this delete stuff)
-      // C++0x TODO: use a std::string here and it's non-const data() member instead of the vector<char> indirection
-      std::vector<char> buffer(n);
-
-      char* buf_start = &buffer[0];
-      char* bp = buf_start;
-      ssize_t bytes_read = 0;
-      
-      while (bytes_read != n)
-      {
-        ssize_t bytes_received = recv_or_throw(socket, bp, n - (bp - buf_start), 0);
-        
-        bytes_read += bytes_received;
-        bp         += bytes_received;
-      }
-      
-      return std::string( buf_start, n );
+      int error = 0;
+      socklen_t len = sizeof(error);
+      if (getsockopt(streams_[index].fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+        error = errno;
+      if (error != 0)
+        throw connection_error( strerror(error) + std::string(" (") + address_(index) + ")" );
+      streams_[index].connected = true;
     }
-
-    reply_t next_reply_type(int socket)
+    
+    // Writes as much of the queued requests as the socket takes without blocking
+    void write_(stream & s)
     {
-      char reply_prefix[1];
-      recv_or_throw(socket, reply_prefix, 1, MSG_PEEK);
-      
-      switch( reply_prefix[0] )
+      while (s.out_pos < s.out.size())
       {
-        case REDIS_PREFIX_STATUS_REPLY_VALUE:
-          return status_code_reply;
-        case REDIS_PREFIX_STATUS_REPLY_ERR_C:
-          return error_reply;
-        case REDIS_PREFIX_INT_REPLY:
-          return int_reply;
-        case REDIS_PREFIX_SINGLE_BULK_REPLY:
-          return bulk_reply;
-        case REDIS_PREFIX_MULTI_BULK_REPLY:
-          return multi_bulk_reply;
+        ssize_t n = ::send(s.fd, s.out.data() + s.out_pos, s.out.size() - s.out_pos, REDIS_SEND_FLAGS);
+        if (n == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+          throw connection_error(strerror(errno));
+        }
+        s.out_pos += n;
       }
-
-      throw std::runtime_error("invalid/unknown rely type from redis server");
+      s.out.clear();
+      s.out_pos = 0;
     }
-
-    reply_data_t recv_generic_reply_(int socket)
+    
+    // Reads everything that is available and calls the callbacks of the complete replies
+    void read_(stream & s)
     {
-      reply_data_t res;
-      res.first = next_reply_type(socket);
-      switch( res.first )
+      char buf[read_chunk_size];
+      for (;;)
       {
-        case status_code_reply:
-          res.second = read_line(socket).substr(1);
-          break;
-        case error_reply:
-          res.second = read_line(socket).substr(strlen(REDIS_PREFIX_STATUS_REPLY_ERROR));
-          break;
-        case int_reply:
-          res.second = recv_int_reply_(socket);
-          break;
-        case bulk_reply:
-          res.second = recv_bulk_reply_(socket);
-          break;
-        case multi_bulk_reply:
+        ssize_t n = ::recv(s.fd, buf, sizeof(buf), 0);
+        if (n == 0)
+          throw connection_error("connection was closed");
+        if (n == -1)
         {
-          string_vector v;
-          recv_multi_bulk_reply_( socket, v );
-          res.second = v;
-          break;
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+          throw connection_error(std::string("recv error: ") + strerror(errno));
         }
-        case no_reply:
-          assert(false);
+        
+        s.parser.feed(buf, n);
+        if (static_cast<size_t>(n) < sizeof(buf))
+          break;
+      }
+      
+      reply_data_t reply;
+      while (s.parser.next_reply(reply))
+      {
+        if (s.callbacks.empty())
+          throw protocol_error("received a reply without a request");
+        
+        reply_callback callback;
+        callback.swap(s.callbacks.front());
+        s.callbacks.pop_front();
+        --pending_;
+        if (callback)
+          callback(reply);
       }
-      return res;
     }
     
-    // Reads a single line of character data from the given blocking socket.
-    // Returns the line that was read, not including EOL delimiter(s).  Both LF
-    // ('\n') and CRLF ("\r\n") delimiters are supported.  If there was an I/O
-    // error reading from the socket, connection_error is raised.  If max_size
-    // bytes are read before finding an EOL delimiter, a blank string is
-    // returned.
-    
-    std::string read_line(int socket, ssize_t max_size = 2048)
+    // Closes a failed connection and fails its outstanding requests
+    void close_(size_t index)
     {
-      assert(socket > 0);
-      assert(max_size > 0);
-      
-      std::ostringstream oss;
+      stream & s = streams_[index];
+      if (s.fd == ANET_ERR)
+        return;
       
-      enum { buffer_size = 64 };
-      char buffer[buffer_size];
-      memset(buffer, 0, buffer_size);
+      close(s.fd); // also removes it from the epoll set
+      s.fd = ANET_ERR;
+      s.out.clear();
+      s.out_pos = 0;
       
-      ssize_t total_bytes_read = 0;
-      bool found_delimiter = false;
+      std::deque<reply_callback> callbacks;
+      callbacks.swap(s.callbacks);
+      pending_ -= callbacks.size();
       
-      while (total_bytes_read < max_size && !found_delimiter)
+      // Awaiting coroutines are resumed and throw
+      reply_data_t closed(error_reply, "connection closed (" + address_(index) + ")");
+      for (size_t i = 0; i < callbacks.size(); ++i)
       {
-        // Peek at what's available.
-        
-        ssize_t bytes_received = recv_or_throw(socket, buffer, buffer_size, MSG_PEEK);
-        
-        // Some data is available; Length might be < buffer_size.
-        // Look for newline in whatever was read though.
-        
-        char * eol = static_cast<char *>(memchr(buffer, '\n', bytes_received));
-        
-        // If found, write data from the buffer to the output string.
-        // Else, write the entire buffer and continue reading more data.
-        
-        ssize_t to_read = bytes_received;
-        
-        if (eol)
+        if (!callbacks[i])
+          continue;
+        try
         {
-          to_read = eol - buffer + 1;
-          oss.write(buffer, to_read);
-          found_delimiter = true;
+          callbacks[i](closed);
+        }
+        catch (...)
+        {
+          // The failure of the connection is reported by run_once() already
         }
-        else
-          oss.write(buffer, bytes_received);
-        
-          // Now read from the socket to remove the peeked data from the socket's
-          // read buffer.  This will not block since we've peeked already and know
-          // there's data waiting.  It might fail if we were interrupted however.
-
-          bytes_received = recv_or_throw(socket, buffer, to_read, 0);
       }
+    }
+    
+    // Only waits for the socket to become writable while there are requests to write
+    void update_events_(size_t index)
+    {
+      stream & s = streams_[index];
+      uint32_t events = EPOLLIN;
+      if (!s.connected || !s.out.empty())
+        events |= EPOLLOUT;
       
-      // Construct final line string. Remove trailing CRLF-based whitespace.
+      if (events == s.events)
+        return;
       
-      std::string line = oss.str();
-      return rtrim(line, REDIS_LBR);
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = events;
+      ev.data.u32 = static_cast<uint32_t>(index);
+      if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, s.fd, &ev) == -1)
+        throw connection_error(std::string("epoll_ctl: ") + strerror(errno));
+      s.events = events;
     }
     
-  private:
     std::vector<connection_data> connections_;
-    //int socket_;
+    std::vector<stream> streams_;
+    int epoll_fd_;
+    size_t pending_;
     CONSISTENT_HASHER hasher_;
   };
   
-  struct default_hasher
+  typedef base_async_client<default_hasher> async_client;
+
+#ifdef REDIS_HAS_COROUTINES
+
+  /**
+   * Return type of coroutines that await commands of a base_async_client, e.g.
+   *
+   *   redis::async_task handle(redis::async_client & ac, std::string key)
+   *   {
+   *     if (co_await ac.co_incr(key) == 1)
+   *       co_await ac.co_set(key + ":first", "yes");
+   *   }
+   *
+   * The coroutine starts when it is called and runs until it awaits the first command, the rest
+   * runs from within the event loop of the client. get() rethrows an exception that ended the
+   * coroutine. A task that is destroyed before it is done detaches from the coroutine, which then
+   * frees itself when it ends; its exception is lost in that case.
+   *
+   * @warning The client must not be destroyed while a coroutine awaits one of its commands.
+   */
+  class async_task
   {
-    inline size_t operator()(const std::string & key, const std::vector<connection_data> & connections)
+  public:
+    struct promise_type
     {
-      return boost::hash<std::string>()(key) % connections.size();
+      promise_type()
+      : detached(false)
+      {
+      }
+
+      async_task get_return_object()
+      {
+        return async_task( std::coroutine_handle<promise_type>::from_promise(*this) );
+      }
+
+      std::suspend_never initial_suspend() noexcept
+      {
+        return std::suspend_never();
+      }
+
+      struct final_awaiter
+      {
+        bool await_ready() const noexcept
+        {
+          return false;
+        }
+
+        void await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+        {
+          if (handle.promise().detached)
+            handle.destroy();
+        }
+
+        void await_resume() const noexcept
+        {
+        }
+      };
+
+      final_awaiter final_suspend() noexcept
+      {
+        return final_awaiter();
+      }
+
+      void return_void()
+      {
+      }
+
+      void unhandled_exception()
+      {
+        error = std::current_exception();
+      }
+
+      bool detached;
+      std::exception_ptr error;
+    };
+
+    async_task(async_task && other) noexcept
+    : handle_(other.handle_)
+    {
+      other.handle_ = std::coroutine_handle<promise_type>();
+    }
+
+    ~async_task()
+    {
+      if (!handle_)
+        return;
+
+      if (handle_.done())
+        handle_.destroy();
+      else
+        handle_.promise().detached = true;
     }
+
+    bool done() const
+    {
+      return handle_ && handle_.done();
+    }
+
+    // Rethrows the exception that ended the coroutine, if any
+    void get() const
+    {
+      if (!done())
+        throw std::runtime_error("the coroutine is not done yet");
+      if (handle_.promise().error)
+        std::rethrow_exception(handle_.promise().error);
+    }
+
+  private:
+    explicit async_task(std::coroutine_handle<promise_type> handle)
+    : handle_(handle)
+    {
+    }
+
+    async_task(const async_task &);
+    async_task & operator=(const async_task &);
+
+    std::coroutine_handle<promise_type> handle_;
   };
-  
-  typedef base_client<default_hasher> client;
+
+#endif // REDIS_HAS_COROUTINES
+
+#endif // __linux__
 
   class distributed_value
   {
@@ -14,6 +14,10 @@ void test_sets(redis::client & c);
 void test_zsets(redis::client & c);
 void test_hashes(redis::client & c);
 void test_generic(redis::client & c);
+void test_reply_parser();
+void test_pipeline(redis::client & c);
+void test_async_client(redis::client & c);
+void test_client_pool(redis::client & c);
 
 // High level API
 void test_distributed_strings(redis::client & c);
@@ -23,6 +27,55 @@ void test_distributed_ints(redis::client & c);
 void test_cluster();
 void benchmark(redis::client & c, int TEST_SIZE);
 
+struct collect_values
+{
+  collect_values(redis::client::string_vector & out) : out(out) {}
+
+  void operator()(const redis::value_view & val)
+  {
+    out.push_back( val.str() );
+  }
+
+  void operator()(size_t index, const redis::value_view & val)
+  {
+    out.at(index) = val.str();
+  }
+
+  redis::client::string_vector & out;
+};
+
+struct concurrent_requests
+{
+  concurrent_requests(redis::client & c, int id) : c(c), id(id) {}
+
+  void operator()()
+  {
+    for(int i=0; i < 100; i++)
+    {
+      string key = "ap_" + boost::lexical_cast<string>(id) + "_" + boost::lexical_cast<string>(i);
+      c.set(key, key);
+      ASSERT_EQUAL(c.get(key), key);
+      c.incr("ap_counter");
+    }
+  }
+
+  redis::client & c;
+  int id;
+};
+
+struct blocking_pop
+{
+  blocking_pop(redis::client & c, string & popped) : c(c), popped(popped) {}
+
+  void operator()()
+  {
+    popped = c.blpop("ap_queue", 10);
+  }
+
+  redis::client & c;
+  string & popped;
+};
+
 int main()
 {
   try 
@@ -122,6 +175,13 @@ int main()
       ASSERT_EQUAL(c.get(foo), bar);
     }
 
+    test("command prefixes");
+    {
+      ASSERT_EQUAL(string(redis::makecmd(redis::prefix::get) << "x"), string(redis::makecmd("GET") << "x"));
+      ASSERT_EQUAL(string(redis::makecmd(redis::prefix::hset) << "h" << "f" << "v"), string(redis::makecmd("HSET") << "h" << "f" << "v"));
+      ASSERT_EQUAL(string(redis::makecmd(redis::prefix::zincrby) << "z" << 1.5 << "m"), string(redis::makecmd("ZINCRBY") << "z" << 1.5 << "m"));
+    }
+
     test("getset");
     {
       ASSERT_EQUAL(c.getset(foo, baz), bar);
@@ -143,6 +203,102 @@ int main()
       ASSERT_EQUAL(vals[1], y_val);
     }
 
+    test("get with visitor");
+    {
+      redis::client::string_vector vals;
+      ASSERT_EQUAL(c.get("x", collect_values(vals)), true);
+      ASSERT_EQUAL(vals.size(), size_t(1));
+      ASSERT_EQUAL(vals[0], string("hello"));
+      ASSERT_EQUAL(c.get("nonexistent_x", collect_values(vals)), false);
+      ASSERT_EQUAL(vals.size(), size_t(1));
+    }
+
+    test("get into existing buffer");
+    {
+      string out("some previous content");
+      ASSERT_EQUAL(c.get("x", out), true);
+      ASSERT_EQUAL(out, string("hello"));
+      ASSERT_EQUAL(c.get("nonexistent_x", out), false);
+      ASSERT_EQUAL(out, string("hello"));
+
+      char buf[4];
+      ASSERT_EQUAL(c.get("y", buf, sizeof(buf)), (redis::client::int_type) 5);
+      ASSERT_EQUAL(string(buf, sizeof(buf)), string("worl"));
+      ASSERT_EQUAL(c.get("nonexistent_x", buf, sizeof(buf)), (redis::client::int_type) -1);
+      ASSERT_EQUAL(c.get("x"), string("hello"));
+    }
+
+    test("set_stream, get_stream");
+    {
+      string val;
+      for(int i=0; i < 200000; i++)
+        val += (char) (i % 256);
+
+      istringstream in(val);
+      c.set_stream("streamed", in, val.size());
+      ASSERT_EQUAL(c.get("streamed"), val);
+
+      ostringstream out;
+      ASSERT_EQUAL(c.get_stream("streamed", out), true);
+      ASSERT_EQUAL(out.str(), val);
+      ASSERT_EQUAL(c.get_stream("nonexistent_x", out), false);
+
+      bool threw = false;
+      istringstream short_in("too short");
+      try
+      {
+        c.set_stream("streamed", short_in, 100);
+      }
+      catch (redis::value_error & e)
+      {
+        threw = true;
+      }
+      ASSERT_EQUAL(threw, true);
+      ASSERT_EQUAL(c.get("streamed"), val);
+    }
+
+    test("mget with visitor");
+    {
+      redis::client::string_vector keys;
+      keys.push_back("x");
+      keys.push_back("nonexistent_x");
+      keys.push_back("y");
+      redis::client::string_vector vals(3);
+      c.mget(keys, collect_values(vals));
+      ASSERT_EQUAL(vals[0], string("hello"));
+      ASSERT_EQUAL(vals[1], string());
+      ASSERT_EQUAL(vals[2], string("world"));
+    }
+
+    test("mset, mget, del (chunked)");
+    {
+      redis::client::string_pair_vector pairs;
+      redis::client::string_vector keys;
+      for(int i=0; i < 100; i++)
+      {
+        keys.push_back( "chunked_" + boost::lexical_cast<string>(i) );
+        pairs.push_back( make_pair(keys.back(), string(i, 'v')) );
+      }
+
+      c.set_chunk_size(3, 64);
+      c.mset(pairs);
+
+      redis::client::string_vector vals;
+      c.mget(keys, vals);
+      ASSERT_EQUAL(vals.size(), keys.size());
+      redis::client::string_vector visited(keys.size());
+      c.mget(keys, collect_values(visited));
+      for(size_t i=0; i < keys.size(); i++)
+      {
+        ASSERT_EQUAL(vals[i], pairs[i].second);
+        ASSERT_EQUAL(visited[i], pairs[i].second);
+      }
+
+      ASSERT_EQUAL(c.del(keys.begin(), keys.end()), true);
+      ASSERT_EQUAL(c.exists("chunked_99"), false);
+      c.set_chunk_size(redis::client::default_chunk_keys, redis::client::default_chunk_bytes);
+    }
+
     test("setnx");
     {
       ASSERT_EQUAL(c.setnx(foo, bar), false);
@@ -195,6 +351,16 @@ int main()
       ASSERT_EQUAL(keys[1], goo);
     }
 
+    test("keys (lazy)");
+    {
+      redis::client::string_range keys;
+      ASSERT_EQUAL(c.keys("*oo", keys), 2L);
+      redis::client::string_vector vals( keys.begin(), keys.end() );
+      ASSERT_EQUAL(vals.size(), (size_t) 2);
+      ASSERT_EQUAL(vals[0], foo);
+      ASSERT_EQUAL(vals[1], goo);
+    }
+
     test("randomkey");
     {
       ASSERT_GT(c.randomkey().size(), (size_t) 0);
@@ -314,6 +480,180 @@ int main()
       // TODO
     }
     
+    test("auto pipelining");
+    {
+      c.set_auto_pipelining(true);
+      boost::thread_group threads;
+      for(int i=0; i < 20; i++)
+        threads.create_thread( concurrent_requests(c, i) );
+      threads.join_all();
+      c.set_auto_pipelining(false);
+      ASSERT_EQUAL(c.get("ap_counter"), string("2000"));
+    }
+
+    test("auto pipelining with a blocking pop");
+    {
+      c.set_auto_pipelining(true);
+      string popped;
+      boost::thread pop( blocking_pop(c, popped) );
+      boost::this_thread::sleep( boost::posix_time::milliseconds(100) );
+      // Not held back by the waiting BLPOP, which has a connection of its own
+      c.rpush("ap_queue", "pushed");
+      pop.join();
+      c.set_auto_pipelining(false);
+      ASSERT_EQUAL(popped, string("pushed"));
+    }
+
+    test("timeouts");
+    {
+      redis::client slow(c.connections().begin(), c.connections().end());
+      slow.set_timeout(100);
+      bool timed_out = false;
+      try
+      {
+        slow.blpop("timeout_list", 2);
+      }
+      catch(redis::timeout_error & e)
+      {
+        timed_out = true;
+      }
+      ASSERT_EQUAL(timed_out, true);
+
+      // The connection is shut down and connected again
+      ASSERT_EQUAL(slow.exists("timeout_list"), false);
+
+      redis::client bounded(c.connections().begin(), c.connections().end());
+      timed_out = false;
+      try
+      {
+        redis::client::deadline d(bounded, boost::posix_time::milliseconds(100));
+        ASSERT_EQUAL(bounded.exists("timeout_list"), false);
+        bounded.blpop("timeout_list", 2);
+      }
+      catch(redis::timeout_error & e)
+      {
+        timed_out = true;
+      }
+      ASSERT_EQUAL(timed_out, true);
+    }
+
+    test("reconnect");
+    {
+      redis::client r(c.connections().begin(), c.connections().end());
+      r.set("reconnect", "1");
+      redis::command quit(redis::makecmd("QUIT") << redis::key("reconnect"));
+      r.exec(quit);
+      // Reading commands are sent again on a new connection
+      ASSERT_EQUAL(r.get("reconnect"), string("1"));
+
+      r.exec(quit);
+      bool failed = false;
+      try
+      {
+        r.incr("reconnect");
+      }
+      catch(redis::connection_error & e)
+      {
+        failed = true;
+      }
+      ASSERT_EQUAL(failed, true);
+      ASSERT_EQUAL(r.incr("reconnect"), 2L);
+
+      // Writes are not sent again, not even SET
+      r.exec(quit);
+      failed = false;
+      try
+      {
+        r.set("reconnect_set", "1");
+      }
+      catch(redis::connection_error & e)
+      {
+        failed = true;
+      }
+      ASSERT_EQUAL(failed, true);
+      ASSERT_EQUAL(r.exists("reconnect_set"), false);
+
+      // Large arguments are sent without copying them into the request
+      string large(40000, 'x');
+      r.set("reconnect_large", large);
+      r.exec(quit);
+      ASSERT_EQUAL(r.get("reconnect_large"), large);
+    }
+
+    test("connect");
+    {
+      boost::shared_ptr<redis::client> copy( c.clone() );
+      ASSERT_EQUAL(copy->get("reconnect"), string("2"));
+
+      std::vector<redis::connection_data> cons(c.connections());
+      cons.push_back( redis::connection_data("localhost", 1) );
+      bool failed = false;
+      try
+      {
+        redis::client unreachable(cons.begin(), cons.end());
+      }
+      catch(redis::connection_error & e)
+      {
+        failed = true;
+      }
+      ASSERT_EQUAL(failed, true);
+    }
+
+    test("connect lazily");
+    {
+      std::vector<redis::connection_data> cons;
+      cons.push_back( redis::connection_data("localhost", 1) );
+      redis::client unreachable(cons.begin(), cons.end(), redis::client::connect_lazily);
+      bool failed = false;
+      try
+      {
+        unreachable.get("reconnect");
+      }
+      catch(redis::connection_error & e)
+      {
+        failed = true;
+      }
+      ASSERT_EQUAL(failed, true);
+
+      redis::client lazy(c.connections().begin(), c.connections().end(), redis::client::connect_lazily);
+      ASSERT_EQUAL(lazy.get("reconnect"), string("2"));
+      boost::shared_ptr<redis::client> copy( lazy.clone() );
+      ASSERT_EQUAL(copy->get("reconnect"), string("2"));
+    }
+
+    test("health monitor");
+    {
+      redis::client monitored(c.connections().begin(), c.connections().end());
+      monitored.start_health_monitor(20, 100, 2);
+
+      std::vector<redis::connection_data> cons;
+      cons.push_back( redis::connection_data("localhost", 1) );
+      redis::client unreachable(cons.begin(), cons.end(), redis::client::connect_lazily);
+      unreachable.start_health_monitor(20, 100, 2);
+
+      boost::this_thread::sleep( boost::posix_time::milliseconds(300) );
+
+      std::vector<redis::client::server_health> health;
+      monitored.health(health);
+      ASSERT_EQUAL(health.size(), c.connections().size());
+      ASSERT_EQUAL(health[0].available, true);
+      ASSERT_EQUAL(health[0].failures, 0UL);
+      ASSERT_EQUAL(monitored.get("reconnect"), string("2"));
+
+      unreachable.health(health);
+      ASSERT_EQUAL(health[0].available, false);
+      string error;
+      try
+      {
+        unreachable.get("reconnect");
+      }
+      catch(redis::connection_error & e)
+      {
+        error = e.what();
+      }
+      ASSERT_EQUAL(error.find("unavailable") != string::npos, true);
+    }
+
     test_lists(c);
     test_sets(c);
     test_zsets(c);
@@ -324,6 +664,10 @@ int main()
     //test_distributed_mutexes(c);
     
     test_generic(c);
+    test_reply_parser();
+    test_pipeline(c);
+    test_async_client(c);
+    test_client_pool(c);
     
     benchmark(c, 10000);
 
@@ -14,15 +14,8 @@ void benchmark_mset(redis::client & c, int TEST_SIZE, boost::optional<const stri
     if(opt_val)
       val = *opt_val;
     keyValuePairs.push_back( make_pair( ss.str(), val ) );
-
-    if( keyValuePairs.size()*val.size() > (1024*1024*16) )
-    {
-      c.mset( keyValuePairs );
-      keyValuePairs.clear();
-    }
   }
   c.mset( keyValuePairs );
-  keyValuePairs.clear();
 }
 
 void benchmark_get(redis::client & c, int TEST_SIZE)
@@ -62,18 +55,6 @@ void benchmark_mget(redis::client & c, int TEST_SIZE)
     stringstream ss;
     ss << "key_" << i;
     keys.push_back( ss.str() );
-    
-    if( keys.size() == 250 )
-    {
-      redis::client::string_vector out;
-      c.mget( keys, out );
-      for(int i1=0; i1 < (int) keys.size(); i1++)
-      {
-        //assert( boost::lexical_cast<int>( keys[i1].substr(4) ) == boost::lexical_cast<int>( out[i1] ) );
-        //ASSERT_EQUAL( boost::lexical_cast<int>( keys[i1].substr(4) ), boost::lexical_cast<int>( out[i1] ) );
-      }
-      keys.clear();
-    }
   }
   redis::client::string_vector out;
   c.mget( keys, out );
@@ -82,7 +63,6 @@ void benchmark_mget(redis::client & c, int TEST_SIZE)
     //assert( boost::lexical_cast<int>( keys[i1].substr(4) ) == boost::lexical_cast<int>( out[i1] ) );
     //ASSERT_EQUAL( boost::lexical_cast<int>( keys[i1].substr(4) ), boost::lexical_cast<int>( out[i1] ) );
   }
-  keys.clear();
 }
 
 void benchmark_incr(redis::client & c, int TEST_SIZE)
@@ -100,11 +80,106 @@ void benchmark_incr(redis::client & c, int TEST_SIZE)
   }
 }
 
+struct shared_setter
+{
+  shared_setter(redis::client & c, int id, int count) : c(c), id(id), count(count) {}
+
+  void operator()()
+  {
+    for(int i=0; i < count; i++)
+    {
+      stringstream ss;
+      ss << "key_" << id << "_" << i;
+      c.set( ss.str(), ss.str() );
+    }
+  }
+
+  redis::client & c;
+  int id;
+  int count;
+};
+
+// The same number of SETs as benchmark_set, issued by concurrent threads that share the client.
+// With auto pipelining their requests are coalesced into few writes per round trip.
+void benchmark_auto_pipelining(redis::client & c, int TEST_SIZE, int threads)
+{
+  c.set_auto_pipelining(true);
+  {
+    block_duration b("Writing keys with SET from " + boost::lexical_cast<string>(threads) + " threads (auto pipelining)", TEST_SIZE);
+    boost::thread_group group;
+    for(int i=0; i < threads; i++)
+      group.create_thread( shared_setter(c, i, TEST_SIZE / threads) );
+    group.join_all();
+  }
+  c.set_auto_pipelining(false);
+  ASSERT_EQUAL(c.dbsize(), (redis::client::int_type) (TEST_SIZE / threads * threads));
+}
+
+// Compares the reply header parsing of boost::lexical_cast (as used before) with
+// redis::parse_int on integer replies (INCR) and bulk length headers (MGET).
+void benchmark_int_parsing(int TEST_SIZE)
+{
+  vector<string> lines;
+  for(int i=0; i < 1000; i++)
+  {
+    lines.push_back( ":" + boost::lexical_cast<string>(i * 7919) );
+    lines.push_back( "$" + boost::lexical_cast<string>(i % 300) );
+  }
+
+  redis::client::int_type sum_cast = 0, sum_parse = 0;
+  size_t count = lines.size() * TEST_SIZE / 100;
+  {
+    block_duration b("Parsing integer reply lines with lexical_cast", count);
+    for(size_t i=0; i < count; i++)
+    {
+      const string & line = lines[i % lines.size()];
+      sum_cast += boost::lexical_cast<redis::client::int_type>( line.substr(1) );
+    }
+  }
+  {
+    block_duration b("Parsing integer reply lines with parse_int", count);
+    for(size_t i=0; i < count; i++)
+    {
+      const string & line = lines[i % lines.size()];
+      sum_parse += redis::parse_int<redis::client::int_type>( line.data() + 1, line.data() + line.size() );
+    }
+  }
+  ASSERT_EQUAL(sum_parse, sum_cast);
+}
+
+void benchmark_command_building(int TEST_SIZE)
+{
+  const string key("key_12345"), val("some value");
+  size_t bytes_name = 0, bytes_prefix = 0;
+  {
+    block_duration b("Building SET/GET commands by name", TEST_SIZE);
+    for(int i=0; i < TEST_SIZE; i++)
+    {
+      bytes_name += (redis::makecmd("SET") << key << val).size();
+      bytes_name += (redis::makecmd("GET") << key).size();
+    }
+  }
+  {
+    block_duration b("Building SET/GET commands from prefixes", TEST_SIZE);
+    for(int i=0; i < TEST_SIZE; i++)
+    {
+      bytes_prefix += (redis::makecmd(redis::prefix::set) << key << val).size();
+      bytes_prefix += (redis::makecmd(redis::prefix::get) << key).size();
+    }
+  }
+  ASSERT_EQUAL(bytes_prefix, bytes_name);
+}
+
 void benchmark(redis::client & c, int TEST_SIZE)
 {
+  benchmark_int_parsing(TEST_SIZE);
+  benchmark_command_building(TEST_SIZE);
+
   c.flushdb();
   benchmark_set (c, TEST_SIZE);
   c.flushdb();
+  benchmark_auto_pipelining(c, TEST_SIZE, 100);
+  c.flushdb();
   benchmark_mset(c, TEST_SIZE);
   benchmark_get (c, TEST_SIZE);
   benchmark_mget(c, TEST_SIZE);
@@ -0,0 +1,193 @@
+#include "functions.h"
+
+#include "../redisclient.h"
+
+#ifdef __linux__
+
+struct store_reply
+{
+  store_reply(vector<redis::reply_data_t> & out, size_t index) : out(out), index(index) {}
+
+  void operator()(const redis::reply_data_t & reply)
+  {
+    out.at(index) = reply;
+  }
+
+  vector<redis::reply_data_t> & out;
+  size_t index;
+};
+
+struct count_replies
+{
+  count_replies(int & count) : count(count) {}
+
+  void operator()(const redis::reply_data_t &)
+  {
+    ++count;
+  }
+
+  int & count;
+};
+
+void throw_on_reply(const redis::reply_data_t &)
+{
+  throw std::runtime_error("callback failed");
+}
+
+#ifdef REDIS_HAS_COROUTINES
+
+redis::async_task count_and_flag(redis::async_client & ac, string key, vector<string> & log)
+{
+  redis::async_client::int_type count = co_await ac.co_incr(key);
+  if (count == 1)
+    co_await ac.co_set(key + "_first", "yes");
+  log.push_back( co_await ac.co_get(key + "_first") );
+}
+
+redis::async_task pop_from_string(redis::async_client & ac)
+{
+  co_await ac.co_set("async_co_string", "value");
+  co_await ac.co_exec(redis::makecmd("LPOP") << redis::key("async_co_string"));
+  co_await ac.co_incr("async_co_string");
+}
+
+#endif // REDIS_HAS_COROUTINES
+
+void test_async_client(redis::client & c)
+{
+  redis::async_client ac( c.connections().begin(), c.connections().end() );
+  ac.run(); // connects and selects the databases
+  
+  test("async client");
+  {
+    vector<redis::reply_data_t> replies(4);
+    ac.set("async_foo", "bar", store_reply(replies, 0));
+    ac.get("async_foo", store_reply(replies, 1));
+    ac.get("async_nonexistent", store_reply(replies, 2));
+    ac.exec(redis::makecmd("LPOP") << redis::key("async_foo"), store_reply(replies, 3));
+    ASSERT_EQUAL(ac.pending(), (size_t) 4);
+    
+    ac.run();
+    
+    ASSERT_EQUAL(ac.pending(), (size_t) 0);
+    ASSERT_EQUAL(replies[0].first, redis::status_code_reply);
+    ASSERT_EQUAL(boost::get<string>(replies[1].second), string("bar"));
+    ASSERT_EQUAL(boost::get<string>(replies[2].second), redis::client::missing_value());
+    ASSERT_EQUAL(replies[3].first, redis::error_reply);
+    ASSERT_EQUAL(c.get("async_foo"), string("bar"));
+  }
+  
+  test("async client with many requests in flight");
+  {
+    int count = 0;
+    for(int i=0; i < 1000; i++)
+      ac.incr("async_counter_" + boost::lexical_cast<string>(i % 10), count_replies(count));
+    
+    ac.run();
+    
+    ASSERT_EQUAL(count, 1000);
+    ASSERT_EQUAL(c.get("async_counter_3"), string("100"));
+  }
+  
+  test("async client with a throwing callback");
+  {
+    redis::async_client failing( c.connections().begin(), c.connections().begin() + 1 );
+    vector<redis::reply_data_t> dropped(1);
+    failing.get("async_foo", &throw_on_reply);
+    failing.get("async_foo", store_reply(dropped, 0));
+    
+    bool threw = false;
+    try
+    {
+      failing.run();
+    }
+    catch (std::runtime_error & e)
+    {
+      threw = true;
+    }
+    ASSERT_EQUAL(threw, true);
+    ASSERT_EQUAL(failing.pending(), (size_t) 0);
+    // The requests that were outstanding on the closed connection fail
+    ASSERT_EQUAL(dropped[0].first, redis::error_reply);
+    
+    threw = false;
+    try
+    {
+      failing.get("async_foo", redis::async_client::reply_callback());
+    }
+    catch (redis::connection_error & e)
+    {
+      threw = true;
+    }
+    ASSERT_EQUAL(threw, true);
+  }
+
+#ifdef REDIS_HAS_COROUTINES
+  test("async client coroutines");
+  {
+    vector<string> log;
+    vector<redis::async_task> tasks;
+    for(int i=0; i < 10; i++)
+      tasks.push_back( count_and_flag(ac, "async_co_" + boost::lexical_cast<string>(i % 5), log) );
+    
+    ac.run();
+    
+    ASSERT_EQUAL(log.size(), (size_t) 10);
+    for(size_t i=0; i < tasks.size(); i++)
+    {
+      ASSERT_EQUAL(tasks[i].done(), true);
+      ASSERT_EQUAL(log[i], string("yes"));
+    }
+    ASSERT_EQUAL(c.get("async_co_4"), string("2"));
+    
+    redis::async_task failing = pop_from_string(ac);
+    ac.run();
+    ASSERT_EQUAL(failing.done(), true);
+    
+    bool threw = false;
+    try
+    {
+      failing.get();
+    }
+    catch (redis::protocol_error & e)
+    {
+      threw = true;
+    }
+    ASSERT_EQUAL(threw, true);
+    
+    redis::async_client closing( c.connections().begin(), c.connections().begin() + 1 );
+    closing.get("async_foo", &throw_on_reply);
+    redis::async_task interrupted = pop_from_string(closing);
+    threw = false;
+    try
+    {
+      closing.run();
+    }
+    catch (std::runtime_error & e)
+    {
+      threw = true;
+    }
+    ASSERT_EQUAL(threw, true);
+    ASSERT_EQUAL(interrupted.done(), true);
+    
+    threw = false;
+    try
+    {
+      interrupted.get();
+    }
+    catch (redis::protocol_error & e)
+    {
+      threw = true;
+    }
+    ASSERT_EQUAL(threw, true);
+  }
+#endif // REDIS_HAS_COROUTINES
+}
+
+#else
+
+void test_async_client(redis::client &)
+{
+}
+
+#endif // __linux__
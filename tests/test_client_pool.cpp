@@ -0,0 +1,71 @@
+#include "functions.h"
+
+#include "../redisclient.h"
+
+#include <boost/thread/thread.hpp>
+
+struct pooled_requests
+{
+  pooled_requests(redis::client_pool & pool, int id) : pool(pool), id(id) {}
+
+  void operator()()
+  {
+    for(int i=0; i < 50; i++)
+    {
+      redis::client_pool::lease c(pool);
+      string key = "pool_" + boost::lexical_cast<string>(id) + "_" + boost::lexical_cast<string>(i);
+      c->set(key, key);
+      ASSERT_EQUAL(c->get(key), key);
+      c->incr("pool_counter");
+    }
+  }
+
+  redis::client_pool & pool;
+  int id;
+};
+
+void test_client_pool(redis::client & c)
+{
+  test("client pool");
+  {
+    redis::client_pool pool(c.connections().begin(), c.connections().end(), 2, 4);
+    ASSERT_EQUAL(pool.size(), (size_t) 2);
+    ASSERT_EQUAL(pool.idle(), (size_t) 2);
+
+    boost::thread_group threads;
+    for(int i=0; i < 10; i++)
+      threads.create_thread( pooled_requests(pool, i) );
+    threads.join_all();
+
+    ASSERT_EQUAL(c.get("pool_counter"), string("500"));
+    ASSERT_EQUAL(pool.idle(), pool.size());
+    ASSERT_EQUAL(pool.size() <= 4, true);
+  }
+
+  test("client pool limits");
+  {
+    redis::client_pool pool(c.connections().begin(), c.connections().end(), 0, 1);
+    ASSERT_EQUAL(pool.size(), (size_t) 0);
+    {
+      redis::client_pool::lease first(pool);
+      ASSERT_EQUAL(pool.size(), (size_t) 1);
+
+      bool threw = false;
+      try
+      {
+        redis::client_pool::lease second(pool, boost::posix_time::milliseconds(50));
+      }
+      catch (redis::timeout_error & e)
+      {
+        threw = true;
+      }
+      ASSERT_EQUAL(threw, true);
+
+      first.discard();
+      ASSERT_EQUAL(pool.size(), (size_t) 0);
+    }
+
+    redis::client_pool::lease again(pool, boost::posix_time::milliseconds(50));
+    ASSERT_EQUAL(again->exists("pool_counter"), true);
+  }
+}
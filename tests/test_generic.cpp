@@ -52,7 +52,7 @@ void type_tests(redis::client & c, int mode)
   ASSERT_NOT_EQUAL( commands[1].get_error_reply(), string() );
   // 2. Int reply
   ASSERT_EQUAL( commands[2].reply_type(), int_reply );
-  ASSERT_EQUAL( commands[2].get_int_reply(), (int) (strlen("value")+strlen("_test")) );
+  ASSERT_EQUAL( commands[2].get_int_reply(), (long) (strlen("value")+strlen("_test")) );
   // 3. Bulk reply
   ASSERT_EQUAL( commands[3].reply_type(), bulk_reply );
   ASSERT_EQUAL( commands[3].get_bulk_reply(), string("value_test") );
@@ -127,7 +127,7 @@ void test_generic(redis::client & c)
     for(size_t i=0; i < commands.size(); i++)
     {
       ASSERT_EQUAL( commands[i].reply_type(), int_reply );
-      ASSERT_EQUAL( commands[i].get_int_reply(), 1 );
+      ASSERT_EQUAL( commands[i].get_int_reply(), 1L );
     }
     
     c.exec( commands );
@@ -135,7 +135,31 @@ void test_generic(redis::client & c)
     for(size_t i=0; i < commands.size(); i++)
     {
       ASSERT_EQUAL( commands[i].reply_type(), int_reply );
-      ASSERT_EQUAL( commands[i].get_int_reply(), 2 );
+      ASSERT_EQUAL( commands[i].get_int_reply(), 2L );
+    }
+  }
+
+  test("generic incr (bounded window)");
+  {
+    vector<command> commands;
+
+    for(size_t i=0; i<2000; i++)
+    {
+      stringstream ss;
+      ss << "window_test" << i % 50;
+      commands.push_back( redis::makecmd("INCR") << key(ss.str()) );
+    }
+
+    size_t old_commands = c.pipeline_window_commands();
+    size_t old_bytes = c.pipeline_window_bytes();
+    c.set_pipeline_window(7, 256);
+    c.exec( commands );
+    c.set_pipeline_window(old_commands, old_bytes);
+
+    for(size_t i=0; i < commands.size(); i++)
+    {
+      ASSERT_EQUAL( commands[i].reply_type(), int_reply );
+      ASSERT_EQUAL( commands[i].get_int_reply(), (long) (i / 50 + 1) );
     }
   }
 
@@ -98,6 +98,23 @@ void test_hashes(redis::client & c)
     c.hset("hash3", "key1", "hval1");
   }
   
+  test("hdel (range)");
+  {
+    redis::client::string_vector fields;
+    for(int i=0; i < 10; i++)
+    {
+      fields.push_back( boost::lexical_cast<string>(i) );
+      c.hset("hash_range", fields.back(), "x");
+    }
+    fields.push_back("missing");
+    
+    c.set_chunk_size(3);
+    ASSERT_EQUAL(c.hdel("hash_range", fields.begin() + 2, fields.end()), 8L);
+    c.set_chunk_size(redis::client::default_chunk_keys);
+    ASSERT_EQUAL(c.hlen("hash_range"), 2L);
+    c.del("hash_range");
+  }
+  
   test("hlen");
   {
     ASSERT_EQUAL( c.hlen("hash3"), 3L );
@@ -146,4 +163,15 @@ void test_hashes(redis::client & c)
     ASSERT_EQUAL( entries[3].first, string("key4") );
     ASSERT_EQUAL( entries[3].second, string("hval4") );
   }
+  
+  test("hgetall (lazy)");
+  {
+    redis::client::string_pair_range range;
+    ASSERT_EQUAL( c.hgetall("hash1", range), (redis::client::int_type) 4 );
+    redis::client::string_pair_vector entries( range.begin(), range.end() );
+    ASSERT_EQUAL( entries.size(), (size_t) 4 );
+    std::sort(entries.begin(), entries.end());
+    ASSERT_EQUAL( entries[0].first, string("key1") );
+    ASSERT_EQUAL( entries[3].second, string("hval4") );
+  }
 }
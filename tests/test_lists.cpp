@@ -2,6 +2,18 @@
 
 #include "../redisclient.h"
 
+struct append_values
+{
+  append_values(redis::client::string_vector & out) : out(out) {}
+
+  void operator()(const redis::value_view & val)
+  {
+    out.push_back( val.str() );
+  }
+
+  redis::client::string_vector & out;
+};
+
 void test_lists(redis::client & c)
 {
   test("rpush");
@@ -29,6 +41,25 @@ void test_lists(redis::client & c)
     ASSERT_EQUAL(c.lindex("list1", 1), string("val1"));
   }
   
+  test("rpush, lpush (range)");
+  {
+    redis::client::string_vector values;
+    for(int i=0; i < 10; i++)
+      values.push_back( boost::lexical_cast<string>(i) );
+    
+    c.set_chunk_size(4);
+    ASSERT_EQUAL(c.rpush("list_range", values.begin(), values.end()), 10L);
+    ASSERT_EQUAL(c.lpush("list_range", values.begin(), values.end()), 20L);
+    ASSERT_EQUAL(c.rpush("list_range", values.end(), values.end()), 20L);
+    c.set_chunk_size(redis::client::default_chunk_keys);
+    
+    ASSERT_EQUAL(c.lindex("list_range", 0), string("9"));
+    ASSERT_EQUAL(c.lindex("list_range", 9), string("0"));
+    ASSERT_EQUAL(c.lindex("list_range", 10), string("0"));
+    ASSERT_EQUAL(c.lindex("list_range", 19), string("9"));
+    c.del("list_range");
+  }
+  
   test("llen");
   {
     c.del("list1");
@@ -51,6 +82,36 @@ void test_lists(redis::client & c)
     ASSERT_EQUAL(vals[1], string("x"));
   }
   
+  test("lrange with visitor");
+  {
+    redis::client::string_vector vals;
+    ASSERT_EQUAL(c.lrange("list1", 0, -1, append_values(vals)), (redis::client::int_type) 2);
+    ASSERT_EQUAL(vals.size(), (size_t) 2);
+    ASSERT_EQUAL(vals[0], string("y"));
+    ASSERT_EQUAL(vals[1], string("x"));
+  }
+  
+  test("lrange (lazy)");
+  {
+    redis::client::string_range range;
+    ASSERT_EQUAL(c.lrange("list1", 0, -1, range), (redis::client::int_type) 2);
+    redis::client::string_range::iterator it = range.begin();
+    ASSERT_EQUAL(*it, string("y"));
+    ++it;
+    ASSERT_EQUAL(*it, string("x"));
+    ++it;
+    ASSERT_EQUAL(it == range.end(), true);
+  }
+  
+  test("lrange (lazy, closed early)");
+  {
+    redis::client::string_range range;
+    c.lrange("list1", 0, -1, range);
+    ASSERT_EQUAL(*range.begin(), string("y"));
+    range.close();
+    ASSERT_EQUAL(c.llen("list1"), 2L);
+  }
+  
   test("lrange with subset of full list");
   {
     ASSERT_EQUAL(c.exists("list1"), true);
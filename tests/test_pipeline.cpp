@@ -0,0 +1,103 @@
+#include "functions.h"
+
+#include "../redisclient.h"
+
+void test_pipeline(redis::client & c)
+{
+  test("pipeline");
+  {
+    redis::client::pipeline p(c);
+    redis::deferred<void> set_res = p.set("pipe_str", "hello");
+    redis::deferred<string> get_res = p.get("pipe_str");
+    redis::deferred<string> missing = p.get("pipe_nonexistent");
+    redis::deferred<redis::client::int_type> incr_res = p.incr("pipe_int");
+    redis::deferred<redis::client::int_type> incrby_res = p.incrby("pipe_int", 4);
+    p.hset("pipe_hash", "f1", "v1");
+    p.hset("pipe_hash", "f2", "v2");
+    redis::deferred<redis::client::string_pair_vector> hgetall_res = p.hgetall("pipe_hash");
+    p.zadd("pipe_zset", 2.0, "b");
+    p.zadd("pipe_zset", 1.0, "a");
+    redis::deferred<redis::client::string_vector> zrange_res = p.zrange("pipe_zset", 0, -1);
+    redis::deferred<redis::client::string_score_vector> zscores_res = p.zrange_withscores("pipe_zset", 0, -1);
+    redis::deferred<double> zscore_missing = p.zscore("pipe_zset", "c");
+    
+    ASSERT_EQUAL(p.size(), (size_t) 13);
+    ASSERT_EQUAL(get_res.ready(), false);
+    
+    p.execute();
+    
+    ASSERT_EQUAL(p.empty(), true);
+    ASSERT_EQUAL(get_res.ready(), true);
+    set_res.get();
+    ASSERT_EQUAL(get_res.get(), string("hello"));
+    ASSERT_EQUAL(missing.get(), redis::client::missing_value());
+    ASSERT_EQUAL(incr_res.get(), 1L);
+    ASSERT_EQUAL(incrby_res.get(), 5L);
+    ASSERT_EQUAL(hgetall_res.get().size(), (size_t) 2);
+    ASSERT_EQUAL(zrange_res.get().size(), (size_t) 2);
+    ASSERT_EQUAL(zrange_res.get()[0], string("a"));
+    ASSERT_EQUAL(zscores_res.get()[1].second, 2.0);
+    
+    bool thrown = false;
+    try
+    {
+      zscore_missing.get();
+    }
+    catch(redis::key_error &)
+    {
+      thrown = true;
+    }
+    ASSERT_EQUAL(thrown, true);
+  }
+  
+  test("pipeline with error reply");
+  {
+    redis::client::pipeline p(c);
+    redis::deferred<redis::client::int_type> wrong_type = p.incr("pipe_hash");
+    redis::deferred<string> after = p.get("pipe_str");
+    p.execute();
+    
+    bool thrown = false;
+    try
+    {
+      wrong_type.get();
+    }
+    catch(redis::protocol_error &)
+    {
+      thrown = true;
+    }
+    ASSERT_EQUAL(thrown, true);
+    ASSERT_EQUAL(after.get(), string("hello"));
+  }
+  
+  test("pipeline with many commands");
+  {
+    redis::client::pipeline p(c);
+    vector< redis::deferred<string> > results;
+    for(int i=0; i < 500; i++)
+    {
+      string key = "pipe_key_" + boost::lexical_cast<string>(i);
+      p.set(key, boost::lexical_cast<string>(i));
+      results.push_back( p.get(key) );
+    }
+    p.execute();
+    
+    for(int i=0; i < 500; i++)
+      ASSERT_EQUAL(results[i].get(), boost::lexical_cast<string>(i));
+  }
+  
+  test("pipeline larger than the socket buffers");
+  {
+    // Requests and replies of 20 MB each way, which only works if replies are read while sending
+    string value(10000, 'v');
+    c.set("pipe_large", value);
+    redis::client::pipeline p(c);
+    vector< redis::deferred<string> > results;
+    for(int i=0; i < 2000; i++)
+      results.push_back( p.getset("pipe_large", value) );
+    p.execute();
+    
+    for(int i=0; i < 2000; i++)
+      ASSERT_EQUAL(results[i].get(), value);
+  }
+}
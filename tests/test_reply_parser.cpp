@@ -0,0 +1,132 @@
+#include "functions.h"
+
+#include "../redisclient.h"
+
+namespace
+{
+  const std::string replies =
+    "+OK\r\n"
+    "-ERR Operation against a key holding the wrong kind of value\r\n"
+    ":42\r\n"
+    "$11\r\nvalue\r\ntest\r\n"
+    "$-1\r\n"
+    "$0\r\n\r\n"
+    "*3\r\n$1\r\n1\r\n$-1\r\n$1\r\n2\r\n"
+    "*0\r\n";
+
+  void check_replies(redis::reply_parser & parser)
+  {
+    using namespace redis;
+    reply_data_t reply;
+
+    ASSERT_EQUAL( parser.replies_available(), (size_t) 8 );
+
+    parser.next_reply(reply);
+    ASSERT_EQUAL( reply.first, status_code_reply );
+    ASSERT_EQUAL( boost::get<string>(reply.second), string("OK") );
+
+    parser.next_reply(reply);
+    ASSERT_EQUAL( reply.first, error_reply );
+    ASSERT_EQUAL( boost::get<string>(reply.second), string("Operation against a key holding the wrong kind of value") );
+
+    parser.next_reply(reply);
+    ASSERT_EQUAL( reply.first, int_reply );
+    ASSERT_EQUAL( boost::get<long>(reply.second), 42L );
+
+    parser.next_reply(reply);
+    ASSERT_EQUAL( reply.first, bulk_reply );
+    ASSERT_EQUAL( boost::get<string>(reply.second), string("value\r\ntest") );
+
+    parser.next_reply(reply);
+    ASSERT_EQUAL( reply.first, bulk_reply );
+    ASSERT_EQUAL( boost::get<string>(reply.second), redis::client::missing_value() );
+
+    parser.next_reply(reply);
+    ASSERT_EQUAL( reply.first, bulk_reply );
+    ASSERT_EQUAL( boost::get<string>(reply.second), string() );
+
+    parser.next_reply(reply);
+    ASSERT_EQUAL( reply.first, multi_bulk_reply );
+    const vector<string> & bulk = boost::get< vector<string> >(reply.second);
+    ASSERT_EQUAL( bulk.size(), (size_t) 3 );
+    ASSERT_EQUAL( bulk[0], string("1") );
+    ASSERT_EQUAL( bulk[1], redis::client::missing_value() );
+    ASSERT_EQUAL( bulk[2], string("2") );
+
+    parser.next_reply(reply);
+    ASSERT_EQUAL( reply.first, multi_bulk_reply );
+    ASSERT_EQUAL( boost::get< vector<string> >(reply.second).size(), (size_t) 0 );
+
+    ASSERT_EQUAL( parser.next_reply(reply), false );
+    ASSERT_EQUAL( parser.in_progress(), false );
+  }
+}
+
+void test_reply_parser()
+{
+  test("reply parser (single chunk)");
+  {
+    redis::reply_parser parser;
+    parser.feed(replies);
+    check_replies(parser);
+  }
+
+  test("reply parser (split at every byte boundary)");
+  {
+    for(size_t split = 1; split < replies.size(); split++)
+    {
+      redis::reply_parser parser;
+      parser.feed(replies.data(), split);
+      parser.feed(replies.data() + split, replies.size() - split);
+      check_replies(parser);
+    }
+  }
+
+  test("reply parser (byte by byte)");
+  {
+    redis::reply_parser parser;
+    for(size_t i = 0; i < replies.size(); i++)
+      parser.feed(replies.data() + i, 1);
+    check_replies(parser);
+  }
+
+  test("reply parser (protocol error)");
+  {
+    redis::reply_parser parser;
+    bool threw = false;
+    try
+    {
+      parser.feed("?invalid\r\n");
+    }
+    catch (redis::protocol_error & e)
+    {
+      threw = true;
+    }
+    ASSERT_EQUAL(threw, true);
+  }
+
+  test("reply parser (64 bit integer)");
+  {
+    redis::reply_parser parser;
+    parser.feed(":5000000000\r\n");
+    redis::reply_data_t reply;
+    ASSERT_EQUAL( parser.next_reply(reply), true );
+    ASSERT_EQUAL( boost::get<long>(reply.second), 5000000000L );
+  }
+
+  {
+    std::string data;
+    for(int i = 0; i < 10000; i++)
+      data += replies;
+
+    block_duration b("Parsing replies (4k chunks)", 10000 * 8);
+    redis::reply_parser parser;
+    redis::reply_data_t reply;
+    for(size_t pos = 0; pos < data.size(); pos += 4096)
+    {
+      parser.feed(data.data() + pos, std::min(data.size() - pos, (size_t) 4096));
+      while( parser.next_reply(reply) )
+        ;
+    }
+  }
+}
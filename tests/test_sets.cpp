@@ -21,6 +21,21 @@ void test_sets(redis::client & c)
     ASSERT_EQUAL(c.sismember("set1", "sval1"), false);
   }
   
+  test("sadd, srem (range)");
+  {
+    redis::client::string_vector members;
+    for(int i=0; i < 10; i++)
+      members.push_back( boost::lexical_cast<string>(i % 8) );
+    
+    c.set_chunk_size(3);
+    ASSERT_EQUAL(c.sadd("set_range", members.begin(), members.end()), 8L);
+    ASSERT_EQUAL(c.scard("set_range"), 8L);
+    ASSERT_EQUAL(c.srem("set_range", members.begin() + 5, members.end()), 5L);
+    ASSERT_EQUAL(c.scard("set_range"), 3L);
+    c.set_chunk_size(redis::client::default_chunk_keys);
+    c.del("set_range");
+  }
+  
   test("smove");
   {
     c.sadd("set1", "hi");
@@ -53,6 +68,16 @@ void test_sets(redis::client & c)
     ASSERT_NOT_EQUAL(members.find("bye"), members.end());
   }
   
+  test("smembers (lazy)");
+  {
+    redis::client::string_range range;
+    ASSERT_EQUAL(c.smembers("set2", range), 2L);
+    redis::client::string_set members( range.begin(), range.end() );
+    ASSERT_EQUAL(members.size(), (size_t) 2);
+    ASSERT_NOT_EQUAL(members.find("hi"),  members.end());
+    ASSERT_NOT_EQUAL(members.find("bye"), members.end());
+  }
+  
   test("sinter");
   {
     c.sadd("set3", "bye");
@@ -15,6 +15,20 @@ void test_zsets(redis::client & c)
     ASSERT_EQUAL(c.zcard("zset1"), 3L);
   }
   
+  test("zadd (range)");
+  {
+    redis::client::string_score_vector values;
+    for(int i=0; i < 10; i++)
+      values.push_back( make_pair(boost::lexical_cast<string>(i % 7), i * 0.5) );
+    
+    c.set_chunk_size(3);
+    ASSERT_EQUAL(c.zadd("zset_range", values.begin(), values.end()), 7L);
+    c.set_chunk_size(redis::client::default_chunk_keys);
+    ASSERT_EQUAL(c.zcard("zset_range"), 7L);
+    ASSERT_EQUAL(c.zscore("zset_range", "2"), 4.5);
+    c.del("zset_range");
+  }
+  
   test("zrem");
   {
     c.zrem("zset1", "zval1");